@@ -0,0 +1,224 @@
+#!/bin/bash
+#
+# Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+#
+# “Singularity” Copyright (c) 2016, The Regents of the University of California,
+# through Lawrence Berkeley National Laboratory (subject to receipt of any
+# required approvals from the U.S. Dept. of Energy).  All rights reserved.
+#
+# This software is licensed under a customized 3-clause BSD license.  Please
+# consult LICENSE file distributed with the sources of this project regarding
+# your rights to use or distribute this software.
+#
+# NOTICE.  This Software was developed under funding from the U.S. Department of
+# Energy and the U.S. Government consequently retains certain rights. As such,
+# the U.S. Government has been granted for itself and others acting on its
+# behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+# to reproduce, distribute copies to the public, prepare derivative works, and
+# perform publicly and display publicly, and to permit other to do so.
+#
+#
+
+# Launch latency/throughput benchmark for an installed Singularity.
+#
+# Measures `singularity exec <container> /bin/true` with a cold and warm
+# page cache, with and without a running `start` daemon, for image and
+# directory containers and for 1..N concurrent launches.  Each scenario
+# prints one JSON object per line, suitable for comparing builds and hosts.
+#
+# USAGE: bench.sh [-i image] [-d directory] [-n iterations] [-c max concurrency] [-o output]
+
+
+ITERATIONS=50
+CONCURRENCY=4
+IMAGE=""
+DIRECTORY=""
+OUTPUT=""
+SINGULARITY="${SINGULARITY:-singularity}"
+
+while true; do
+    case ${1:-} in
+        -i|--image)
+            IMAGE="${2:-}"
+            shift 2
+        ;;
+        -d|--dir)
+            DIRECTORY="${2:-}"
+            shift 2
+        ;;
+        -n|--iterations)
+            ITERATIONS="${2:-}"
+            shift 2
+        ;;
+        -c|--concurrency)
+            CONCURRENCY="${2:-}"
+            shift 2
+        ;;
+        -o|--output)
+            OUTPUT="${2:-}"
+            shift 2
+        ;;
+        -h|--help)
+            /bin/echo "USAGE: $0 [-i image] [-d directory] [-n iterations] [-c max concurrency] [-o output]"
+            exit 0
+        ;;
+        -*)
+            /bin/echo "ERROR: Unknown option: ${1:-}" 1>&2
+            exit 1
+        ;;
+        *)
+            break
+        ;;
+    esac
+done
+
+if [ -z "$IMAGE" -a -z "$DIRECTORY" ]; then
+    /bin/echo "ERROR: Need at least one of --image or --dir to benchmark" 1>&2
+    exit 1
+fi
+
+if ! which "$SINGULARITY" >/dev/null 2>&1; then
+    /bin/echo "ERROR: Could not find '$SINGULARITY' in PATH" 1>&2
+    exit 1
+fi
+
+if [ -n "$OUTPUT" ]; then
+    exec 3>>"$OUTPUT"
+else
+    exec 3>&1
+fi
+
+TEMPDIR=`mktemp -d /tmp/singularity-bench.XXXXXX`
+trap 'rm -rf "$TEMPDIR"' EXIT
+
+HOST=`hostname`
+KERNEL=`uname -r`
+VERSION=`"$SINGULARITY" --version 2>/dev/null`
+REVISION=`git rev-parse --short HEAD 2>/dev/null`
+STAMP=`date -u +%Y-%m-%dT%H:%M:%SZ`
+
+
+# Microsecond wall clock; bash 5 provides this without a fork
+now_us() {
+    if [ -n "${EPOCHREALTIME:-}" ]; then
+        echo "${EPOCHREALTIME/./}"
+    else
+        echo $(( `date +%s%N` / 1000 ))
+    fi
+}
+
+drop_caches() {
+    sync
+    if [ -w /proc/sys/vm/drop_caches ]; then
+        echo 3 > /proc/sys/vm/drop_caches
+    elif sudo -n true 2>/dev/null; then
+        sudo -n sh -c "echo 3 > /proc/sys/vm/drop_caches"
+    else
+        return 1
+    fi
+}
+
+# run_worker <container> <iterations> <worker id> [drop caches]
+run_worker() {
+    local CONTAINER="$1"
+    local COUNT="$2"
+    local ID="$3"
+    local COLD="${4:-}"
+    local i START END
+
+    for i in `seq 1 $COUNT`; do
+        if [ -n "$COLD" ]; then
+            # Timed apart from the launch, so it can be taken out of the wall time
+            START=`now_us`
+            drop_caches
+            END=`now_us`
+            echo $(( END - START )) >> "$TEMPDIR/drop.$ID"
+        fi
+        START=`now_us`
+        "$SINGULARITY" exec "$CONTAINER" /bin/true >/dev/null 2>&1 || echo "fail" >> "$TEMPDIR/fail.$ID"
+        END=`now_us`
+        echo $(( END - START )) >> "$TEMPDIR/lat.$ID"
+    done
+}
+
+# report <scenario> <container type> <cache> <daemon> <concurrency> <wall us>
+report() {
+    local FAILS=`cat "$TEMPDIR"/fail.* 2>/dev/null | wc -l`
+
+    cat "$TEMPDIR"/lat.* | sort -n | awk -v scenario="$1" -v type="$2" -v cache="$3" \
+        -v daemon="$4" -v conc="$5" -v wall="$6" -v fails="$FAILS" \
+        -v host="$HOST" -v kernel="$KERNEL" -v version="$VERSION" \
+        -v rev="$REVISION" -v stamp="$STAMP" '
+        { v[NR] = $1; sum += $1 }
+        END {
+            if ( NR == 0 ) exit
+            p50 = v[int((NR - 1) * 0.50) + 1]
+            p95 = v[int((NR - 1) * 0.95) + 1]
+            printf "{\"timestamp\":\"%s\",\"host\":\"%s\",\"kernel\":\"%s\",\"version\":\"%s\",\"revision\":\"%s\",", stamp, host, kernel, version, rev
+            printf "\"scenario\":\"%s\",\"container\":\"%s\",\"cache\":\"%s\",\"daemon\":%s,\"concurrency\":%d,", scenario, type, cache, daemon, conc
+            printf "\"launches\":%d,\"failures\":%d,\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p95_ms\":%.3f,\"min_ms\":%.3f,\"max_ms\":%.3f,", NR, fails, sum / NR / 1000, p50 / 1000, p95 / 1000, v[1] / 1000, v[NR] / 1000
+            printf "\"throughput_per_s\":%.2f}\n", NR / (wall / 1000000)
+        }' >&3
+    rm -f "$TEMPDIR"/lat.* "$TEMPDIR"/fail.* "$TEMPDIR"/drop.*
+}
+
+# bench <container> <type> <daemon true/false>
+bench() {
+    local CONTAINER="$1"
+    local TYPE="$2"
+    local DAEMON="$3"
+    local START END DROP N W
+
+    # Warm up, and make sure the container works at all
+    if ! "$SINGULARITY" exec "$CONTAINER" /bin/true >/dev/null 2>&1; then
+        /bin/echo "ERROR: Could not exec /bin/true in $CONTAINER" 1>&2
+        return 1
+    fi
+
+    if drop_caches; then
+        START=`now_us`
+        run_worker "$CONTAINER" "$ITERATIONS" 0 cold
+        END=`now_us`
+        DROP=`awk '{ sum += $1 } END { print sum + 0 }' "$TEMPDIR"/drop.*`
+        report latency "$TYPE" cold "$DAEMON" 1 $(( END - START - DROP ))
+    else
+        /bin/echo "WARNING: Can not drop page cache, skipping cold cache scenario" 1>&2
+    fi
+
+    for N in `seq 1 $CONCURRENCY`; do
+        START=`now_us`
+        for W in `seq 1 $N`; do
+            run_worker "$CONTAINER" "$ITERATIONS" "$W" &
+        done
+        wait
+        END=`now_us`
+        report throughput "$TYPE" warm "$DAEMON" "$N" $(( END - START ))
+    done
+}
+
+
+# bench_all <container> <type>
+bench_all() {
+    local CONTAINER="$1"
+    local TYPE="$2"
+
+    bench "$CONTAINER" "$TYPE" false
+
+    if "$SINGULARITY" start "$CONTAINER" >/dev/null 2>&1; then
+        bench "$CONTAINER" "$TYPE" true
+        "$SINGULARITY" stop "$CONTAINER" >/dev/null 2>&1
+    else
+        /bin/echo "WARNING: Could not start namespace daemon, skipping $TYPE daemon scenarios" 1>&2
+    fi
+}
+
+
+if [ -n "$IMAGE" ]; then
+    bench_all "$IMAGE" image
+fi
+
+if [ -n "$DIRECTORY" ]; then
+    bench_all "$DIRECTORY" directory
+fi
+
+exit 0
@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+#
+# Minimal fork-server for `singularity start --zygote`.
+#
+# Import whatever is expensive, then serve requests.  Every
+# `singularity exec <container> script.py args...` against the started
+# container runs script.py in a fork of this already warmed interpreter;
+# anything else is simply exec'd.
+#
+#   $ singularity start --zygote "python3 /zygote.py" /tmp/Python.img
+#   $ singularity exec /tmp/Python.img /work/job.py 42
+#
+
+import os
+import runpy
+import socket
+import sys
+
+# Warm-up: the imports every request would otherwise pay for
+# import numpy, pandas
+
+sock = socket.socket(fileno=int(os.environ.pop("SINGULARITY_ZYGOTE_FD")))
+
+while True:
+    try:
+        data, fds, _, _ = socket.recv_fds(sock, 128 * 1024, 4)
+    except InterruptedError:
+        continue
+    if not data:
+        break
+
+    fields = data.split(b"\0")[:-1]
+    cwd, mask, argc = fields[0], int(fields[1], 8), int(fields[2])
+    argv = [os.fsdecode(f) for f in fields[3:3 + argc]]
+    env = dict(f.split(b"=", 1) for f in fields[3 + argc:] if b"=" in f)
+
+    pid = os.fork()
+    if pid == 0:
+        # Let the daemon adopt the process that runs the request
+        if os.fork() != 0:
+            os._exit(0)
+        os.write(fds[3], str(os.getpid()).encode())
+        os.close(fds[3])
+        for i in range(3):
+            os.dup2(fds[i], i)
+            os.close(fds[i])
+        try:
+            os.chdir(cwd)
+        except OSError:
+            pass
+        os.umask(mask)
+        os.environb.clear()
+        os.environb.update(env)
+        sock.close()
+        if not argv[0].endswith(".py"):
+            os.execvp(argv[0], argv)
+        sys.argv = argv
+        try:
+            runpy.run_path(argv[0], run_name="__main__")
+        except SystemExit as e:
+            sys.stdout.flush()
+            os._exit(e.code if isinstance(e.code, int) else int(e.code is not None))
+        except BaseException:
+            import traceback
+            traceback.print_exc()
+            os._exit(1)
+        sys.stdout.flush()
+        os._exit(0)
+
+    for fd in fds:
+        os.close(fd)
+    os.waitpid(pid, 0)
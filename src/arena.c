@@ -0,0 +1,108 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+// Most launches fit in the first chunk
+#define ARENA_CHUNK 16384
+#define ARENA_ALIGN 16
+
+
+struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t size;
+    size_t used;
+    char data[] __attribute__ ((aligned (ARENA_ALIGN)));
+};
+
+static __thread struct arena_chunk *arena_current = NULL;
+// One released chunk is kept, so a mark taken near the end of a chunk
+// does not cost a malloc() and free() every time round a loop
+static __thread struct arena_chunk *arena_spare = NULL;
+
+
+static struct arena_chunk *arena_chunk_new(size_t size) {
+    struct arena_chunk *chunk;
+
+    if ( size <= ARENA_CHUNK - sizeof(struct arena_chunk) && arena_spare != NULL ) {
+        chunk = arena_spare;
+        arena_spare = NULL;
+    } else {
+        if ( size < ARENA_CHUNK - sizeof(struct arena_chunk) ) {
+            size = ARENA_CHUNK - sizeof(struct arena_chunk);
+        }
+        if ( ( chunk = (struct arena_chunk *) malloc(sizeof(struct arena_chunk) + size) ) == NULL ) {
+            fprintf(stderr, "ABORT: Can't allocate memory\n");
+            abort();
+        }
+        chunk->size = size;
+    }
+    chunk->used = 0;
+    chunk->prev = arena_current;
+
+    return(chunk);
+}
+
+
+void *arena_alloc(size_t size) {
+    void *ret;
+
+    size = ( size + ARENA_ALIGN - 1 ) & ~( (size_t) ARENA_ALIGN - 1 );
+    if ( arena_current == NULL || arena_current->size - arena_current->used < size ) {
+        arena_current = arena_chunk_new(size);
+    }
+
+    ret = arena_current->data + arena_current->used;
+    arena_current->used += size;
+
+    return(ret);
+}
+
+
+struct arena_mark arena_save(void) {
+    struct arena_mark mark;
+
+    mark.chunk = arena_current;
+    mark.used = ( arena_current != NULL ) ? arena_current->used : 0;
+
+    return(mark);
+}
+
+
+void arena_restore(struct arena_mark mark) {
+    while ( arena_current != mark.chunk ) {
+        struct arena_chunk *chunk = arena_current;
+
+        arena_current = chunk->prev;
+        if ( arena_spare == NULL && chunk->size == ARENA_CHUNK - sizeof(struct arena_chunk) ) {
+            arena_spare = chunk;
+        } else {
+            free(chunk);
+        }
+    }
+    if ( arena_current != NULL ) {
+        arena_current->used = mark.used;
+    }
+}
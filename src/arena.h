@@ -0,0 +1,44 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+
+#ifndef __ARENA_H_
+#define __ARENA_H_
+
+#include <stddef.h>
+
+// A per-thread bump allocator for the short lived strings the util.c
+// helpers build.  Nothing in it is freed on its own: arena_restore()
+// gives back everything allocated since the matching arena_save() in one
+// go, so take a mark around any loop or phase whose temporaries do not
+// outlive it.  Arena memory must never be passed to free() or realloc().
+// A thread's arena outlives the thread, so its strings may be handed on.
+
+struct arena_mark {
+    struct arena_chunk *chunk;
+    size_t used;
+};
+
+void *arena_alloc(size_t size) __attribute__ ((malloc));
+struct arena_mark arena_save(void);
+void arena_restore(struct arena_mark mark);
+
+#endif /* __ARENA_H_ */
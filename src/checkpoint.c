@@ -0,0 +1,240 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/sysmacros.h>
+
+#include "config.h"
+#include "checkpoint.h"
+#include "config_parser.h"
+#include "util.h"
+#include "file.h"
+#include "message.h"
+
+
+/*
+ * Checkpoint and restore of a namespace daemon with CRIU.  The dump holds
+ * the daemon's process tree and its PID and mount namespaces; everything
+ * outside of them (the image's loop device and the host mounts the
+ * container was built from) is recorded as external, so the restore can
+ * be pointed at a freshly attached loop device.  The images are written
+ * and read only as root, in a directory the user can not modify.
+ */
+
+#define CHECKPOINT_ARGS 32
+#define CHECKPOINT_LOOP_KEY "singularity-image"
+
+
+// The configured CRIU binary, or NULL if it is not there
+static char *checkpoint_criu_path(void) {
+    char *criu;
+
+    if ( ( criu = config_get_key_value("criu path") ) == NULL ) {
+        criu = xstrdup("/usr/sbin/criu");
+    }
+    if ( is_exec(criu) < 0 ) {
+        message(ERROR, "CRIU is not available at: %s\n", criu);
+        return(NULL);
+    }
+
+    return(criu);
+}
+
+// Run CRIU as root with a clean environment and return its exit status
+static int checkpoint_criu(char **args) {
+    char *criu;
+    char *envp[] = { "PATH=/usr/sbin:/usr/bin:/sbin:/bin", NULL };
+    sigset_t empty;
+    int status;
+    pid_t pid;
+
+    if ( ( criu = checkpoint_criu_path() ) == NULL ) {
+        return(-1);
+    }
+    args[0] = criu;
+
+    message(VERBOSE, "Running %s %s\n", criu, args[1]);
+    if ( ( pid = fork() ) == 0 ) {
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        if ( setresgid(0, 0, 0) < 0 || setresuid(0, 0, 0) < 0 ) {
+            message(ERROR, "Could not become root for CRIU: %s\n", strerror(errno));
+            ABORT(255);
+        }
+        execve(criu, args, envp); // Flawfinder: ignore (root owned path from the config)
+        message(ERROR, "Could not exec %s: %s\n", criu, strerror(errno));
+        ABORT(255);
+    }
+    if ( pid < 0 ) {
+        message(ERROR, "Could not fork for CRIU: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    while ( waitpid(pid, &status, 0) < 0 ) {
+        if ( errno != EINTR ) {
+            message(ERROR, "Failed waiting for CRIU: %s\n", strerror(errno));
+            return(-1);
+        }
+    }
+    if ( ! WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+        return(-1);
+    }
+    return(0);
+}
+
+
+// Arguments shared by dump and restore
+static int checkpoint_args(char **args, char *dir) {
+    int i = 1;
+
+    args[i++] = "--images-dir";
+    args[i++] = dir;
+    args[i++] = "--shell-job";
+    args[i++] = "--ext-mount-map";
+    args[i++] = "auto";
+    args[i++] = "--enable-external-sharing";
+    args[i++] = "--enable-external-masters";
+
+    return(i);
+}
+
+
+int checkpoint_dump(char *dir, pid_t pid, char *loop_dev, int leave_running) {
+    char *args[CHECKPOINT_ARGS];
+    char pidstr[16]; // Flawfinder: ignore (bounded by snprintf)
+    char external[64]; // Flawfinder: ignore (bounded by snprintf)
+    struct stat loopstat;
+    int i;
+
+    message(DEBUG, "Called checkpoint_dump(%s, %d, %s, %d)\n", dir, pid, loop_dev ? loop_dev : "", leave_running);
+
+    // Never mix the files of two checkpoints
+    if ( is_dir(dir) == 0 && s_rmdir(dir) < 0 ) {
+        message(ERROR, "Could not remove old checkpoint %s\n", dir);
+        return(-1);
+    }
+    if ( s_mkpath(dir, 0700) < 0 ) {
+        message(ERROR, "Could not create checkpoint directory %s\n", dir);
+        return(-1);
+    }
+
+    snprintf(pidstr, sizeof(pidstr), "%d", pid); // Flawfinder: ignore
+    args[1] = "dump";
+    i = checkpoint_args(&args[1], dir) + 1;
+    args[i++] = "--tree";
+    args[i++] = pidstr;
+    args[i++] = "--log-file";
+    args[i++] = "dump.log";
+    if ( loop_dev != NULL ) {
+        if ( stat(loop_dev, &loopstat) < 0 ) {
+            message(ERROR, "Could not stat loop device %s: %s\n", loop_dev, strerror(errno));
+            return(-1);
+        }
+        snprintf(external, sizeof(external), "dev[%u/%u]:%s", major(loopstat.st_rdev), minor(loopstat.st_rdev), CHECKPOINT_LOOP_KEY); // Flawfinder: ignore
+        args[i++] = "--external";
+        args[i++] = external;
+    }
+    if ( leave_running > 0 ) {
+        args[i++] = "--leave-running";
+    }
+    args[i] = NULL;
+
+    if ( checkpoint_criu(args) < 0 ) {
+        message(ERROR, "Checkpoint failed, see %s/dump.log\n", dir);
+        return(-1);
+    }
+
+    message(DEBUG, "Return checkpoint_dump() = 0\n");
+    return(0);
+}
+
+
+// Whether a restore from dir can be attempted at all: CRIU is there and
+// so is a checkpoint.  Called as root.
+int checkpoint_check(char *dir) {
+    if ( checkpoint_criu_path() == NULL ) {
+        return(-1);
+    }
+    if ( is_file(joinpath(dir, "inventory.img")) < 0 ) {
+        message(ERROR, "No checkpoint found for this container\n");
+        return(-1);
+    }
+
+    return(0);
+}
+
+
+pid_t checkpoint_restore(char *dir, char *loop_dev, char *pidfile) {
+    char *args[CHECKPOINT_ARGS];
+    char external[PATH_MAX + 64]; // Flawfinder: ignore (bounded by snprintf)
+    char *pidstr;
+    pid_t pid;
+    int i;
+
+    message(DEBUG, "Called checkpoint_restore(%s, %s, %s)\n", dir, loop_dev ? loop_dev : "", pidfile);
+
+    if ( checkpoint_check(dir) < 0 ) {
+        return(-1);
+    }
+    unlink(pidfile);
+
+    // Detached, so the restored daemon is handed to us as its subreaper
+    args[1] = "restore";
+    i = checkpoint_args(&args[1], dir) + 1;
+    args[i++] = "--restore-detached";
+    args[i++] = "--root";
+    args[i++] = "/";
+    args[i++] = "--pidfile";
+    args[i++] = pidfile;
+    args[i++] = "--log-file";
+    args[i++] = "restore.log";
+    if ( loop_dev != NULL ) {
+        snprintf(external, sizeof(external), "dev[%s]:%s", CHECKPOINT_LOOP_KEY, loop_dev); // Flawfinder: ignore
+        args[i++] = "--external";
+        args[i++] = external;
+    }
+    args[i] = NULL;
+
+    if ( checkpoint_criu(args) < 0 ) {
+        message(ERROR, "Restore failed, see %s/restore.log\n", dir);
+        return(-1);
+    }
+
+    if ( ( pidstr = filecat(pidfile) ) == NULL || ( pid = strtol(pidstr, NULL, 10) ) <= 0 ) {
+        message(ERROR, "Could not read restored daemon pid from %s\n", pidfile);
+        return(-1);
+    }
+    unlink(pidfile);
+    free(pidstr);
+
+    message(DEBUG, "Return checkpoint_restore() = %d\n", pid);
+    return(pid);
+}
@@ -0,0 +1,289 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "config.h"
+#include "util.h"
+#include "file.h"
+#include "fileio.h"
+
+#ifndef LIBEXECDIR
+#define LIBEXECDIR "/usr/libexec"
+#endif
+#ifndef SYSCONFDIR
+#define SYSCONFDIR "/etc"
+#endif
+#ifndef LOCALSTATEDIR
+#define LOCALSTATEDIR "/var"
+#endif
+
+
+/*
+ * The singularity command.  exec, run, shell, start and stop go straight
+ * to sexec from here, doing what bin/singularity and cli/<command>.exec
+ * would; everything else, and anything unusual (help, bad options, a
+ * site's own etc/singularity/init that has to be sourced), is handed to
+ * the shell dispatcher in libexecdir, which is the reference for all of it.
+ */
+
+struct cli_option {
+    const char *command;
+    const char *short_opt;
+    const char *long_opt;
+    const char *variable;   // set to "1", or to the argument if takes_arg
+    int takes_arg;
+};
+
+static const struct cli_option cli_options[] = {
+    { "exec",   "-w", "--writable",     "SINGULARITY_WRITABLE",     0 },
+    { "exec",   "-C", "--contain",      "SINGULARITY_CONTAIN",      0 },
+    { "exec",   "-J", "--job-ns",       "SINGULARITY_JOB_NS",       0 },
+    { "exec",   "-m", "--mpi",          "SINGULARITY_MPI",          0 },
+    { "exec",   "-t", "--tasks",        "SINGULARITY_TASKS",        1 },
+    { "exec",   "-j", "--jobs",         "SINGULARITY_TASK_JOBS",    1 },
+    { "exec",   "-o", "--output",       "SINGULARITY_TASK_OUTPUT",  1 },
+    { "run",    "-w", "--writable",     "SINGULARITY_WRITABLE",     0 },
+    { "run",    "-C", "--contain",      "SINGULARITY_CONTAIN",      0 },
+    { "run",    "-J", "--job-ns",       "SINGULARITY_JOB_NS",       0 },
+    { "run",    "-m", "--mpi",          "SINGULARITY_MPI",          0 },
+    { "shell",  "-s", "--shell",        "SHELL",                    1 },
+    { "shell",  "-w", "--writable",     "SINGULARITY_WRITABLE",     0 },
+    { "shell",  "-C", "--contain",      "SINGULARITY_CONTAIN",      0 },
+    { "shell",  "-J", "--job-ns",       "SINGULARITY_JOB_NS",       0 },
+    { "start",  "-w", "--writable",     "SINGULARITY_WRITABLE",     0 },
+    { "start",  "-C", "--contain",      "SINGULARITY_CONTAIN",      0 },
+    { "start",  "-p", "--pool",         "SINGULARITY_POOL",         1 },
+    { "start",  "-i", "--idle-timeout", "SINGULARITY_POOL_IDLE",    1 },
+    { "start",  "-z", "--zygote",       "SINGULARITY_ZYGOTE",       1 },
+    { NULL,     NULL, NULL,             NULL,                       0 }
+};
+
+
+// Resource managers whose jobs the stock init runs without a PID namespace
+static const char *cli_batch_variables[] = {
+    "OMPI_COMM_WORLD_SIZE", "SLURM_JOB_ID", "JOB_ID", "PBS_JOBID", "LSB_JOBID",
+    "COBALT_JOBID", "_CONDOR_JOB_AD", "LOAD_STEP_ID", NULL
+};
+
+
+static char *cli_read(char *path) {
+    char *ret;
+    int fd;
+
+    if ( ( fd = open(path, O_RDONLY | O_CLOEXEC) ) < 0 ) { // Flawfinder: ignore
+        return(NULL);
+    }
+    ret = fileio_read(fd, NULL);
+    close(fd);
+
+    return(ret);
+}
+
+// Whether etc/singularity/init is the one installed with Singularity, whose
+// copy in libexecdir is never edited, so cli_init() can stand in for it
+static int cli_init_is_stock(void) {
+    char *init = cli_read(SYSCONFDIR "/singularity/init");
+    char *stock = cli_read(LIBEXECDIR "/singularity/init.dist");
+    int ret = ( init != NULL && stock != NULL && strcmp(init, stock) == 0 ) ? 0 : -1;
+
+    free(init);
+    free(stock);
+    return(ret);
+}
+
+// What sourcing the stock etc/singularity/init does, but for the "unset
+// module" that main() does in any case
+static void cli_init(void) {
+    const char **variable;
+    char *path = getenv("PATH"); // Flawfinder: ignore (only appended to)
+
+    setenv("PATH", strjoin(path != NULL ? path : "", ":/bin:/sbin:/usr/bin:/usr/sbin"), 1);
+    setenv("HISTFILE", "/dev/null", 1);
+
+    for ( variable = cli_batch_variables; *variable != NULL; variable++ ) {
+        char *value = getenv(*variable); // Flawfinder: ignore (only checked for being set)
+
+        if ( value != NULL && value[0] != '\0' ) {
+            setenv("SINGULARITY_NO_NAMESPACE_PID", "1", 1);
+            break;
+        }
+    }
+}
+
+
+static void cli_fallback(char **argv) {
+    char *dispatcher = LIBEXECDIR "/singularity/singularity";
+
+    argv[0] = dispatcher;
+    execv(dispatcher, argv); // Flawfinder: ignore (our own installed script)
+    fprintf(stderr, "ERROR: Could not execute %s: %s\n", dispatcher, strerror(errno));
+    exit(255);
+}
+
+
+// Run sexec for start and stop and print what their scripts print
+static int cli_daemon_command(char *command, char *sexec, char *image) {
+    int level = atoi(getenv("MESSAGELEVEL")); // Flawfinder: ignore (set by main())
+    int status;
+    pid_t pid;
+
+    if ( ( pid = fork() ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not fork: %s\n", strerror(errno));
+        return(255);
+    }
+    if ( pid == 0 ) {
+        execl(sexec, sexec, NULL); // Flawfinder: ignore (our own installed binary)
+        fprintf(stderr, "ERROR: Could not execute %s: %s\n", sexec, strerror(errno));
+        _exit(255);
+    }
+    while ( waitpid(pid, &status, 0) < 0 ) {
+        if ( errno != EINTR ) {
+            return(255);
+        }
+    }
+    if ( ! WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+        return(WIFEXITED(status) ? WEXITSTATUS(status) : 255);
+    }
+
+    if ( level < 1 ) {
+        return(0);
+    }
+    if ( strcmp(command, "stop") == 0 ) {
+        printf("Singularity namespace process daemon has been stopped\n");
+    } else if ( getenv("SINGULARITY_POOL") != NULL ) { // Flawfinder: ignore
+        printf("Singularity container pool has started. Subsequent calls to\n");
+        printf("this container will start in an already prepared container.\n\n");
+        printf("To stop the pool use the following command:\n\n");
+        printf("    $ singularity stop %s\n\n", image);
+    } else {
+        printf("Singularity namespace process daemon has started. Subsequent\n");
+        printf("calls to this container will run in this existing namespace.\n\n");
+        printf("To stop the daemon/namespace use the following command:\n\n");
+        printf("    $ singularity stop %s\n\n", image);
+    }
+
+    return(0);
+}
+
+
+int main(int argc, char **argv) {
+    char *sexec = LIBEXECDIR "/singularity/sexec";
+    char *command;
+    char *image;
+    int level = 1;
+    int debug = 0;
+    int i = 1;
+
+    // Global options; help and version are the dispatcher's
+    for ( ; i < argc && argv[i][0] == '-'; i++ ) {
+        if ( strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--quiet") == 0 ) {
+            level = 0;
+        } else if ( strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0 ) {
+            level = 5;
+            debug = 1;
+        } else if ( strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0 ) {
+            level++;
+        } else {
+            cli_fallback(argv);
+        }
+    }
+    if ( i >= argc ) {
+        cli_fallback(argv);
+    }
+
+    command = argv[i++];
+    if ( strcmp(command, "exec") != 0 && strcmp(command, "run") != 0 && strcmp(command, "shell") != 0 &&
+            strcmp(command, "start") != 0 && strcmp(command, "stop") != 0 ) {
+        cli_fallback(argv);
+    }
+    if ( is_file(SYSCONFDIR "/singularity/init") == 0 ) {
+        if ( cli_init_is_stock() < 0 ) {
+            cli_fallback(argv);
+        }
+        cli_init();
+    }
+
+    setenv("MESSAGELEVEL", int2str(level), 1);
+    setenv("DEBUG", debug ? "1" : "", 1);
+    setenv("RETVAL", "0", 1);
+    setenv("SINGULARITY_libexecdir", LIBEXECDIR, 1);
+    setenv("SINGULARITY_sysconfdir", SYSCONFDIR, 1);
+    setenv("SINGULARITY_localstatedir", LOCALSTATEDIR, 1);
+    setenv("SINGULARITY_COMMAND", command, 1);
+    unsetenv("module");
+    if ( strcmp(command, "shell") == 0 ) {
+        setenv("SHELL", "/bin/sh", 1);
+    }
+
+    // Command options, all of which only set a variable for sexec
+    for ( ; i < argc && argv[i][0] == '-'; i++ ) {
+        const struct cli_option *opt;
+
+        for ( opt = cli_options; opt->command != NULL; opt++ ) {
+            if ( strcmp(opt->command, command) == 0 && ( strcmp(opt->short_opt, argv[i]) == 0 || strcmp(opt->long_opt, argv[i]) == 0 ) ) {
+                break;
+            }
+        }
+        if ( opt->command == NULL ) {
+            cli_fallback(argv);
+        }
+        if ( opt->takes_arg ) {
+            setenv(opt->variable, i + 1 < argc ? argv[++i] : "", 1);
+        } else {
+            setenv(opt->variable, "1", 1);
+        }
+    }
+    if ( i >= argc || strcmp(argv[i], "help") == 0 ) {
+        cli_fallback(argv);
+    }
+    image = argv[i++];
+    setenv("SINGULARITY_IMAGE", image, 1);
+
+    // As libexec/functions makes sure of
+    if ( getenv("USER") == NULL || getenv("HOME") == NULL ) { // Flawfinder: ignore
+        struct passwd *pw = getpwuid(getuid());
+
+        if ( pw != NULL ) {
+            setenv("USER", pw->pw_name, 0);
+            setenv("HOME", pw->pw_dir, 0);
+        }
+    }
+
+    if ( strcmp(command, "start") == 0 || strcmp(command, "stop") == 0 ) {
+        return(cli_daemon_command(command, sexec, image));
+    }
+
+    argv[i - 1] = sexec;
+    execv(sexec, &argv[i - 1]); // Flawfinder: ignore (our own installed binary)
+    fprintf(stderr, "ERROR: Could not execute %s: %s\n", sexec, strerror(errno));
+    return(255);
+}
@@ -26,75 +26,427 @@
 #include <sys/types.h>
 #include <errno.h> 
 #include <string.h>
+#include <ctype.h>
 #include <fcntl.h>  
+#include <fnmatch.h>
 #include <linux/limits.h>
 
 #include "config.h"
 #include "util.h"
 #include "message.h"
 #include "file.h"
+#include "config_parser.h"
+#include "probes.h"
 
 
-#define MAX_LINE_LEN 2048
+#define CONFIG_HASH_SIZE 64
 
-FILE *config_fp = NULL;
+#define CONFIG_TYPE_BOOL 1
+#define CONFIG_TYPE_STRING 2
+#define CONFIG_TYPE_LIST 3
+#define CONFIG_TYPE_INT 4
 
-int config_open(char *config_path) {
-    message(VERBOSE, "Opening configuration file: %s\n", config_path);
-    if ( is_file(config_path) == 0 ) {
-        if ( ( config_fp = fopen(config_path, "r") ) != NULL ) { // Flawfinder: ignore (we have to open the file...)
-            return(0);
+struct config_entry {
+    char *key;
+    char **values;
+    int count;
+    int alloc;
+    struct config_entry *next;
+};
+
+// The global settings live in a section with no pattern; every
+// '[image <glob>]' header in the file starts another one.
+struct config_section {
+    char *pattern;
+    struct config_entry *table[CONFIG_HASH_SIZE];
+    struct config_section *next;
+};
+
+// Every key singularity.conf may contain, so typos are caught at load time
+// rather than silently falling back to the default.  Keys marked 'image'
+// may also be overridden inside an image section.
+static const struct {
+    const char *key;
+    int type;
+    int image;
+} config_keys[] = {
+    { "allow pid ns",         CONFIG_TYPE_BOOL,   0 },
+    { "mount proc",           CONFIG_TYPE_BOOL,   0 },
+    { "mount sys",            CONFIG_TYPE_BOOL,   0 },
+    { "mount home",           CONFIG_TYPE_BOOL,   0 },
+    { "mount slave",          CONFIG_TYPE_BOOL,   0 },
+    { "config passwd",        CONFIG_TYPE_BOOL,   0 },
+    { "config group",         CONFIG_TYPE_BOOL,   0 },
+    { "bind path",            CONFIG_TYPE_LIST,   0 },
+    { "container dir",        CONFIG_TYPE_STRING, 0 },
+    { "sessiondir prefix",    CONFIG_TYPE_STRING, 0 },
+    { "checkpoint dir",       CONFIG_TYPE_STRING, 0 },
+    { "criu path",            CONFIG_TYPE_STRING, 0 },
+    { "host lib path",        CONFIG_TYPE_LIST,   0 },
+    { "host lib dir",         CONFIG_TYPE_STRING, 0 },
+    { "host lib cache",       CONFIG_TYPE_STRING, 0 },
+    { "identity cache",       CONFIG_TYPE_STRING, 0 },
+    { "identity cache ttl",   CONFIG_TYPE_INT,    0 },
+    { "staged file cache",    CONFIG_TYPE_STRING, 0 },
+    { "image mount options",  CONFIG_TYPE_STRING, 1 },
+    { "loop direct io",       CONFIG_TYPE_BOOL,   1 },
+    { "loop read ahead",      CONFIG_TYPE_INT,    1 },
+    { NULL, 0, 0 }
+};
+
+static struct config_section config_global;
+static struct config_section *config_sections = NULL;
+static struct config_section *config_image = NULL;
+static int config_loaded = 0;
+
+
+static unsigned int config_hash(const char *key) {
+    unsigned int hash = 5381;
+
+    while ( *key != '\0' ) {
+        hash = ( ( hash << 5 ) + hash ) + (unsigned char) *key++;
+    }
+
+    return(hash % CONFIG_HASH_SIZE);
+}
+
+static struct config_entry *config_lookup(struct config_section *section, const char *key) {
+    struct config_entry *entry;
+
+    for ( entry = section->table[config_hash(key)]; entry != NULL; entry = entry->next ) {
+        if ( strcmp(entry->key, key) == 0 ) {
+            return(entry);
+        }
+    }
+
+    return(NULL);
+}
+
+// Look in the selected image section first, then fall back to the globals
+static struct config_entry *config_find(const char *key) {
+    struct config_entry *entry;
+
+    if ( config_loaded == 0 ) {
+        message(ERROR, "Configuration has not been loaded\n");
+        ABORT(255);
+    }
+
+    if ( config_image != NULL && ( entry = config_lookup(config_image, key) ) != NULL ) {
+        return(entry);
+    }
+
+    return(config_lookup(&config_global, key));
+}
+
+static int config_key_index(const char *key) {
+    int i;
+
+    for ( i = 0; config_keys[i].key != NULL; i++ ) {
+        if ( strcmp(config_keys[i].key, key) == 0 ) {
+            return(i);
         }
     }
-    message(ERROR, "Could not open configuration file %s: %s\n", config_path, strerror(errno));
+
     return(-1);
 }
 
-void config_close(void) {
-    message(VERBOSE, "Closing configuration file\n");
-    if ( config_fp != NULL ) {
-        fclose(config_fp);
-        config_fp = NULL;
+static int config_parse_bool(const char *value) {
+    if ( strcmp(value, "yes") == 0 ||
+            strcmp(value, "y") == 0 ||
+            strcmp(value, "1") == 0 ) {
+        return(1);
+    } else if ( strcmp(value, "no") == 0 ||
+            strcmp(value, "n") == 0 ||
+            strcmp(value, "0") == 0 ) {
+        return(0);
+    }
+
+    return(-1);
+}
+
+static int config_parse_int(const char *value, long *ret) {
+    char *end;
+
+    errno = 0;
+    *ret = strtol(value, &end, 10);
+    if ( errno != 0 || end == value || *end != '\0' ) {
+        return(-1);
     }
+
+    return(0);
 }
 
-void config_rewind(void) {
-    message(DEBUG, "Rewinding configuration file\n");
-    if ( config_fp != NULL ) {
-        rewind(config_fp);
+// Strip leading and trailing whitespace in place
+static char *config_trim(char *str) {
+    char *end;
+
+    while ( isspace((unsigned char) *str) ) {
+        str++;
     }
+
+    end = str + strlen(str);
+    while ( end > str && isspace((unsigned char) end[-1]) ) {
+        end--;
+    }
+    *end = '\0';
+
+    return(str);
 }
 
-char *config_get_key_value(char *key) {
-    char *config_key;
-    char *config_value;
-    char *line;
+static void config_add(struct config_section *section, const char *key, const char *value) {
+    struct config_entry *entry;
 
-    line = (char *)xmalloc(MAX_LINE_LEN);
+    if ( ( entry = config_lookup(section, key) ) == NULL ) {
+        unsigned int hash = config_hash(key);
 
-    message(DEBUG, "Called config_get_key_value(%s)\n", key);
+        entry = (struct config_entry *) xmalloc(sizeof(struct config_entry));
+        entry->key = xstrdup(key);
+        entry->count = 0;
+        entry->alloc = 4;
+        entry->values = (char **) xmalloc(sizeof(char *) * entry->alloc);
+        entry->next = section->table[hash];
+        section->table[hash] = entry;
+    }
+
+    if ( entry->count + 1 >= entry->alloc ) {
+        entry->alloc *= 2;
+        if ( ( entry->values = (char **) realloc(entry->values, sizeof(char *) * entry->alloc) ) == NULL ) {
+            fprintf(stderr, "ABORT: Can't allocate memory\n");
+            abort();
+        }
+    }
+
+    entry->values[entry->count++] = xstrdup(value);
+    entry->values[entry->count] = NULL;
+}
+
+static struct config_section *config_add_section(char *pattern) {
+    struct config_section *section;
+    struct config_section **tail = &config_sections;
+
+    section = (struct config_section *) xmalloc(sizeof(struct config_section));
+    memset(section, 0, sizeof(struct config_section));
+    section->pattern = xstrdup(pattern);
+
+    // Keep file order so the first matching section wins
+    while ( *tail != NULL ) {
+        tail = &(*tail)->next;
+    }
+    *tail = section;
+
+    return(section);
+}
+
+static void config_free_section(struct config_section *section) {
+    int i;
+
+    for ( i = 0; i < CONFIG_HASH_SIZE; i++ ) {
+        struct config_entry *entry = section->table[i];
+
+        while ( entry != NULL ) {
+            struct config_entry *next = entry->next;
+            int j;
+
+            for ( j = 0; j < entry->count; j++ ) {
+                free(entry->values[j]);
+            }
+            free(entry->values);
+            free(entry->key);
+            free(entry);
+            entry = next;
+        }
+        section->table[i] = NULL;
+    }
+}
+
+static void config_free(void) {
+    config_free_section(&config_global);
+
+    while ( config_sections != NULL ) {
+        struct config_section *next = config_sections->next;
+
+        config_free_section(config_sections);
+        free(config_sections->pattern);
+        free(config_sections);
+        config_sections = next;
+    }
 
-    while ( fgets(line, MAX_LINE_LEN, config_fp) ) {
-        if ( ( config_key = strtok(line, "=") ) != NULL ) {
-            chomp(config_key);
-            if ( strcmp(config_key, key) == 0 ) {
-                if ( ( config_value = xstrdup(strtok(NULL, "=")) ) != NULL ) {
-                    chomp(config_value);
-                    if ( config_value[0] == ' ' ) {
-                        config_value++;
-                    }
-                    message(DEBUG, "Return config_get_key_value(%s) = %s\n", key, config_value);
-                    return(config_value);
-                }
+    config_image = NULL;
+    config_loaded = 0;
+}
+
+
+int config_open(char *config_path) {
+    FILE *config_fp;
+    struct config_section *section = &config_global;
+    char *line = NULL;
+    size_t line_len = 0;
+    int lineno = 0;
+    int errors = 0;
+
+    message(VERBOSE, "Opening configuration file: %s\n", config_path);
+    PROBE1(config__open, config_path);
+    if ( is_file(config_path) < 0 || ( config_fp = fopen(config_path, "r") ) == NULL ) { // Flawfinder: ignore (we have to open the file...)
+        message(ERROR, "Could not open configuration file %s: %s\n", config_path, strerror(errno));
+        return(-1);
+    }
+
+    config_free();
+
+    while ( getline(&line, &line_len, config_fp) >= 0 ) {
+        char *key;
+        char *value;
+        char *sep;
+        long tmp;
+        int i;
+
+        lineno++;
+        key = config_trim(line);
+
+        if ( key[0] == '\0' || key[0] == '#' ) {
+            continue;
+        }
+
+        if ( key[0] == '[' ) {
+            size_t len = strlen(key);
+
+            if ( key[len - 1] != ']' || strncmp(key, "[image", 6) != 0 || !isspace((unsigned char) key[6]) ) {
+                message(ERROR, "%s:%d: Syntax error, expected '[image <path>]': %s\n", config_path, lineno, key);
+                errors++;
+                section = NULL;
+                continue;
             }
+            key[len - 1] = '\0';
+            value = config_trim(&key[6]);
+
+            message(DEBUG, "Loaded configuration section for image '%s'\n", value);
+            section = config_add_section(value);
+            continue;
+        }
+
+        if ( ( sep = strchr(key, '=') ) == NULL ) {
+            message(ERROR, "%s:%d: Syntax error, expected 'key = value': %s\n", config_path, lineno, key);
+            errors++;
+            continue;
         }
+
+        *sep = '\0';
+        value = config_trim(sep + 1);
+        key = config_trim(key);
+
+        if ( key[0] == '\0' ) {
+            message(ERROR, "%s:%d: Syntax error, missing configuration key\n", config_path, lineno);
+            errors++;
+            continue;
+        }
+
+        if ( section == NULL ) {
+            // Already reported the bad section header
+            continue;
+        }
+
+        if ( ( i = config_key_index(key) ) < 0 ) {
+            message(WARNING, "%s:%d: Unknown configuration key '%s'\n", config_path, lineno, key);
+        } else if ( section != &config_global && config_keys[i].image == 0 ) {
+            message(ERROR, "%s:%d: Configuration key '%s' can not be set per image\n", config_path, lineno, key);
+            errors++;
+            continue;
+        } else if ( config_keys[i].type == CONFIG_TYPE_BOOL && config_parse_bool(value) < 0 ) {
+            message(ERROR, "%s:%d: Unsupported value for configuration boolean key '%s' = '%s'\n", config_path, lineno, key, value);
+            errors++;
+            continue;
+        } else if ( config_keys[i].type == CONFIG_TYPE_INT && config_parse_int(value, &tmp) < 0 ) {
+            message(ERROR, "%s:%d: Unsupported value for configuration integer key '%s' = '%s'\n", config_path, lineno, key, value);
+            errors++;
+            continue;
+        } else if ( config_keys[i].type != CONFIG_TYPE_LIST && config_lookup(section, key) != NULL ) {
+            message(WARNING, "%s:%d: Ignoring duplicate configuration key '%s'\n", config_path, lineno, key);
+            continue;
+        }
+
+        message(DEBUG, "Loaded configuration '%s' = '%s'\n", key, value);
+        config_add(section, key, value);
     }
+
     free(line);
+    if ( fclose(config_fp) != 0 ) {
+        message(ERROR, "Could not close configuration file %s: %s\n", config_path, strerror(errno));
+        return(-1);
+    }
+
+    PROBE3(config__loaded, config_path, lineno, errors);
+
+    if ( errors > 0 ) {
+        message(ERROR, "Found %d error(s) in configuration file %s\n", errors, config_path);
+        config_free();
+        return(-1);
+    }
+
+    config_loaded = 1;
+    return(0);
+}
+
+void config_close(void) {
+    message(VERBOSE, "Closing configuration file\n");
+    config_free();
+}
+
+int config_select_image(char *image_path) {
+    struct config_section *section;
+    char *path;
+
+    message(DEBUG, "Called config_select_image(%s)\n", image_path);
+
+    // Match against the canonical path so relative names and symlinks
+    // pick up the same profile.
+    if ( ( path = realpath(image_path, NULL) ) == NULL ) {
+        path = xstrdup(image_path);
+    }
+
+    config_image = NULL;
+    for ( section = config_sections; section != NULL; section = section->next ) {
+        if ( fnmatch(section->pattern, path, 0) == 0 ) {
+            PROBE2(config__image, section->pattern, path);
+            message(VERBOSE, "Using configuration profile '[image %s]' for %s\n", section->pattern, path);
+            config_image = section;
+            break;
+        }
+    }
+
+    free(path);
+
+    return(config_image != NULL ? 0 : -1);
+}
+
+char *config_get_key_value(char *key) {
+    struct config_entry *entry;
+
+    message(DEBUG, "Called config_get_key_value(%s)\n", key);
+
+    if ( ( entry = config_find(key) ) != NULL ) {
+        message(DEBUG, "Return config_get_key_value(%s) = %s\n", key, entry->values[0]);
+        return(entry->values[0]);
+    }
 
     message(DEBUG, "Return config_get_key_value(%s) = NULL\n", key);
     return(NULL);
 }
 
+int config_get_key_list(char *key, char ***values) {
+    struct config_entry *entry;
+
+    message(DEBUG, "Called config_get_key_list(%s)\n", key);
+
+    if ( ( entry = config_find(key) ) != NULL ) {
+        *values = entry->values;
+        message(DEBUG, "Return config_get_key_list(%s) = %d\n", key, entry->count);
+        return(entry->count);
+    }
+
+    *values = NULL;
+    message(DEBUG, "Return config_get_key_list(%s) = 0\n", key);
+    return(0);
+}
 
 int config_get_key_bool(char *key, int def) {
     char *config_value;
@@ -102,23 +454,34 @@ int config_get_key_bool(char *key, int def) {
     message(DEBUG, "Called config_get_key_bool(%s, %d)\n", key, def);
 
     if ( ( config_value = config_get_key_value(key) ) != NULL ) {
-        if ( strcmp(config_value, "yes") == 0 ||
-                strcmp(config_value, "y") == 0 ||
-                strcmp(config_value, "1") == 0 ) {
-            message(DEBUG, "Return config_get_key_bool(%s, %d) = 1\n", key, def);
-            return(1);
-        } else if ( strcmp(config_value, "no") == 0 ||
-                strcmp(config_value, "n") == 0 ||
-                strcmp(config_value, "0") == 0 ) {
-            message(DEBUG, "Return config_get_key_bool(%s, %d) = 0\n", key, def);
-            return(0);
-        } else {
+        int ret = config_parse_bool(config_value);
+
+        if ( ret < 0 ) {
             message(ERROR, "Unsupported value for configuration boolean key '%s' = '%s'\n", key, config_value);
-            message(DEBUG, "Return config_get_key_bool(%s, %d) = -1\n", key, def);
-            return(-1);
         }
+        message(DEBUG, "Return config_get_key_bool(%s, %d) = %d\n", key, def, ret);
+        return(ret);
     }
 
     message(DEBUG, "Return config_get_key_bool(%s, %d) = %d (DEFAULT)\n", key, def, def);
     return(def);
 }
+
+long config_get_key_int(char *key, long def) {
+    char *config_value;
+    long ret;
+
+    message(DEBUG, "Called config_get_key_int(%s, %ld)\n", key, def);
+
+    if ( ( config_value = config_get_key_value(key) ) != NULL ) {
+        if ( config_parse_int(config_value, &ret) < 0 ) {
+            message(ERROR, "Unsupported value for configuration integer key '%s' = '%s'\n", key, config_value);
+            ret = -1;
+        }
+        message(DEBUG, "Return config_get_key_int(%s, %ld) = %ld\n", key, def, ret);
+        return(ret);
+    }
+
+    message(DEBUG, "Return config_get_key_int(%s, %ld) = %ld (DEFAULT)\n", key, def, def);
+    return(def);
+}
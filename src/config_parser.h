@@ -19,10 +19,18 @@
  */
 
 
+// config_open() parses the whole file once into an in-memory table; the
+// getters below are then plain lookups.  Values are owned by the table and
+// remain valid until config_close().
 int config_open(char *config_path);
 void config_close(void);
-void config_rewind(void);
+
+// Apply the first '[image <glob>]' section matching image_path on top of the
+// global settings.  Returns 0 if a section matched, -1 otherwise.
+int config_select_image(char *image_path);
 
 char *config_get_key_value(char *key);
 int config_get_key_bool(char *key, int def);
+int config_get_key_list(char *key, char ***values);
+long config_get_key_int(char *key, long def);
 
@@ -26,20 +26,125 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/param.h>
+#include <sys/signalfd.h>
 #include <errno.h> 
 #include <string.h>
 #include <fcntl.h>  
+#include <signal.h>
+#include <time.h>
 
 #include "config.h"
 #include "container_actions.h"
 #include "util.h"
+#include "arena.h"
 #include "file.h"
 #include "message.h"
+#include "daemon_socket.h"
+#include "zygote.h"
+
+
+// Expand ${NAME} references in value from the current environment
+static char *container_env_expand(char *value) {
+    char *ret = "";
+    char *p;
+
+    while ( ( p = strstr(value, "${") ) != NULL && strchr(p, '}') != NULL ) {
+        char *end = strchr(p, '}');
+        char *name = strndup(p + 2, end - p - 2);
+        char *var = getenv(name); // Flawfinder: ignore (the container's own environment)
+
+        *p = '\0';
+        ret = strjoin(ret, strjoin(value, var != NULL ? var : ""));
+        free(name);
+        value = end + 1;
+    }
+
+    return(strjoin(ret, value));
+}
+
+/*
+ * Bootstrap writes /.env, NAME=value lines with ${NAME} references, next
+ * to /environment, which the /.exec, /.run and /.shell wrappers source
+ * through /bin/sh.  Applying it here saves starting that shell on every
+ * launch.  It is only trusted while it is at least as new as
+ * /environment, so a container whose /environment was edited since falls
+ * back to the wrappers.  Returns 0 if the environment is set up, -1 if
+ * the wrappers are needed.
+ */
+static int container_environment(void) {
+    struct stat env_stat;
+    struct stat script_stat;
+    char *line = NULL;
+    size_t linelen = 0;
+    FILE *env_fp;
+
+    if ( stat("/.env", &env_stat) < 0 || ! S_ISREG(env_stat.st_mode) ) {
+        return(-1);
+    }
+    if ( stat("/environment", &script_stat) == 0 && ( script_stat.st_mtim.tv_sec > env_stat.st_mtim.tv_sec ||
+            ( script_stat.st_mtim.tv_sec == env_stat.st_mtim.tv_sec && script_stat.st_mtim.tv_nsec > env_stat.st_mtim.tv_nsec ) ) ) {
+        message(VERBOSE2, "/environment is newer than /.env, using the shell wrappers\n");
+        return(-1);
+    }
+
+    // As /environment itself, only once per process tree
+    if ( getenv("SINGULARITY_INIT") != NULL && getenv("SINGULARITY_INIT")[0] != '\0' ) { // Flawfinder: ignore
+        return(0);
+    }
+
+    if ( ( env_fp = fopen("/.env", "re") ) == NULL ) { // Flawfinder: ignore
+        return(-1);
+    }
+
+    message(VERBOSE, "Applying container environment from /.env\n");
+    while ( getline(&line, &linelen, env_fp) > 0 ) {
+        struct arena_mark mark;
+        char *name = line;
+        char *value;
+        char *p;
+
+        chomp(line);
+        if ( line[0] == '#' || ( value = strchr(line, '=') ) == NULL ) {
+            continue;
+        }
+        *value++ = '\0';
+        for ( p = name; *p != '\0' && ( *p == '_' || ( *p >= 'A' && *p <= 'Z' ) || ( *p >= 'a' && *p <= 'z' ) || ( p > name && *p >= '0' && *p <= '9' ) ); p++ ) { }
+        if ( p == name || *p != '\0' ) {
+            message(WARNING, "Ignoring invalid /.env entry: %s\n", name);
+            continue;
+        }
+
+        mark = arena_save();
+        value = container_env_expand(value);
+        message(DEBUG, "Setting %s=%s\n", name, value);
+        setenv(name, value, 1);
+        arena_restore(mark);
+    }
+    free(line);
+    fclose(env_fp);
+
+    return(0);
+}
 
 
 int container_run(int argc, char **argv) {
     message(DEBUG, "Called container_run(%d, **argv)\n", argc);
-    if ( is_exec("/.run") == 0 ) {
+    if ( container_environment() == 0 ) {
+        if ( is_exec("/singularity") == 0 ) {
+            argv[0] = xstrdup("/singularity");
+            message(VERBOSE, "Found /singularity inside container, exec()'ing...\n");
+            if ( execv("/singularity", argv) != 0 ) { // Flawfinder: ignore (exec* is necessary)
+                message(ERROR, "Exec of /singularity failed: %s\n", strerror(errno));
+                ABORT(255);
+            }
+        }
+        message(WARNING, "No Singularity runscript found, launching 'shell'\n");
+        argv[0] = xstrdup("/bin/sh");
+        if ( execv("/bin/sh", argv) != 0 ) { // Flawfinder: ignore (exec* is necessary)
+            message(ERROR, "Exec of /bin/sh failed: %s\n", strerror(errno));
+            ABORT(255);
+        }
+    } else if ( is_exec("/.run") == 0 ) {
         argv[0] = xstrdup("/.run");
         message(VERBOSE, "Found /.run inside container, exec()'ing...\n");
         if ( execv("/.run", argv) != 0 ) { // Flawfinder: ignore (exec* is necessary)
@@ -69,7 +174,7 @@ int container_exec(int argc, char **argv) {
         ABORT(255);
     }
 
-    if ( is_exec("/.exec") == 0 ) {
+    if ( container_environment() < 0 && is_exec("/.exec") == 0 ) {
         argv[0] = xstrdup("Singularity");
         message(VERBOSE, "Found /.exec inside container, exec()'ing...\n");
         if ( execv("/.exec", argv) != 0 ) { // Flawfinder: ignore (exec* is necessary)
@@ -97,7 +202,22 @@ int container_exec(int argc, char **argv) {
 int container_shell(int argc, char **argv) {
     message(DEBUG, "Called container_shell(%d, **argv)\n", argc);
 
-    if ( is_exec("/.shell") == 0 ) {
+    if ( container_environment() == 0 ) {
+        char *shell = getenv("SHELL"); // Flawfinder: ignore (the user's own shell, run as the user)
+
+        if ( shell == NULL || shell[0] == '\0' || is_exec(shell) < 0 ) {
+            if ( shell != NULL && shell[0] != '\0' ) {
+                message(WARNING, "Shell does not exist in container: %s, using /bin/sh\n", shell);
+            }
+            shell = "/bin/sh";
+            setenv("SHELL", shell, 1);
+        }
+        argv[0] = xstrdup(shell);
+        message(VERBOSE, "Exec()'ing %s...\n", shell);
+        if ( execv(shell, argv) != 0 ) { // Flawfinder: ignore (exec* is necessary)
+            message(ERROR, "Exec of %s failed: %s\n", shell, strerror(errno));
+        }
+    } else if ( is_exec("/.shell") == 0 ) {
         argv[0] = xstrdup("Singularity");
         message(VERBOSE, "Exec()'ing /.shell\n");
         if ( execv("/.shell", argv) != 0 ) { // Flawfinder: ignore (exec* is necessary)
@@ -116,35 +236,29 @@ int container_shell(int argc, char **argv) {
 }
 
 
-int container_daemon_start(char *sessiondir) {
-    FILE *comm;
-    char line[256]; // Flawfinder: ignore (this is hard limit in fgets() below)
+int container_daemon_start(int comm_fd, int sock_fd) {
+    char *zygote = getenv("SINGULARITY_ZYGOTE"); // Flawfinder: ignore (run as the user, in the container)
+    pid_t zygote_pid = -1;
+    int zygote_fd = -1;
 
-    message(DEBUG, "Called container_daemon_start(%s)\n", sessiondir);
+    message(DEBUG, "Called container_daemon_start(%d, %d)\n", comm_fd, sock_fd);
 
-// TODO: Create a daemon_start_init function
-    message(DEBUG, "Opening daemon.comm for reading\n");
-    if ( ( comm = fopen(joinpath(sessiondir, "daemon.comm"), "r") ) == NULL ) { // Flawfinder: ignore
-        message(ERROR, "Could not open communication fifo %s: %s\n", joinpath(sessiondir, "daemon.comm"), strerror(errno));
-        sleep(20);
-        ABORT(255);
-    }
-
-    message(DEBUG, "Waiting for read on daemon.comm\n");
-    while ( fgets(line, 256, comm) ) {
-        if ( strcmp(line, "stop") == 0 ) {
-            message(INFO, "Stopping daemon\n");
-            break;
-        } else {
-            message(WARNING, "Got unsupported daemon.comm command: '%s'\n", line);
+    if ( zygote != NULL && zygote[0] != '\0' ) {
+        zygote = xstrdup(zygote);
+        unsetenv("SINGULARITY_ZYGOTE");
+        message(VERBOSE, "Starting zygote: %s\n", zygote);
+        if ( ( zygote_pid = zygote_start(zygote, &zygote_fd) ) < 0 ) {
+            ABORT(255);
         }
     }
-    if (fclose(comm)) {
-        message(ERROR, "Could not close %s: %s\n", joinpath(sessiondir, "daemon.comm"), strerror(errno));
+
+    // Serve `singularity stop` on daemon.comm, and exec requests from
+    // other launches on daemon.sock, until we are told to stop
+    if ( daemon_socket_serve(comm_fd, sock_fd, zygote_pid, zygote_fd) < 0 ) {
         ABORT(255);
     }
 
-    message(DEBUG, "Return container_daemon_start(%s) = 0\n", sessiondir);
+    message(DEBUG, "Return container_daemon_start(%d, %d) = 0\n", comm_fd, sock_fd);
     return(0);
 }
 
@@ -203,4 +317,236 @@ int container_daemon_stop(char *sessiondir) {
 }
 
 
+struct task {
+    pid_t pid;
+    long id;
+    char *line;
+    struct timespec start;
+};
+
+static void task_launch(struct task *task, int null_fd, int output_fd, int wrapped, sigset_t *mask) {
+    char *argv[5];
+    char name[64]; // Flawfinder: ignore (bounded by snprintf)
+    int fd;
+
+    if ( ( task->pid = fork() ) < 0 ) {
+        message(ERROR, "Could not fork task %ld: %s\n", task->id, strerror(errno));
+        ABORT(255);
+    }
+    if ( task->pid > 0 ) {
+        return;
+    }
+
+    sigprocmask(SIG_SETMASK, mask, NULL);
+
+    if ( dup2(null_fd, STDIN_FILENO) < 0 ) {
+        message(ERROR, "Could not redirect stdin for task %ld: %s\n", task->id, strerror(errno));
+        ABORT(255);
+    }
+    if ( output_fd >= 0 ) {
+        snprintf(name, sizeof(name), "task.%ld.out", task->id); // Flawfinder: ignore
+        if ( ( fd = openat(output_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644) ) < 0 || dup2(fd, STDOUT_FILENO) < 0 ) {
+            message(ERROR, "Could not open %s: %s\n", name, strerror(errno));
+            ABORT(255);
+        }
+        close(fd);
+        snprintf(name, sizeof(name), "task.%ld.err", task->id); // Flawfinder: ignore
+        if ( ( fd = openat(output_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644) ) < 0 || dup2(fd, STDERR_FILENO) < 0 ) {
+            message(ERROR, "Could not open %s: %s\n", name, strerror(errno));
+            ABORT(255);
+        }
+        close(fd);
+    }
 
+    snprintf(name, sizeof(name), "%ld", task->id); // Flawfinder: ignore
+    setenv("SINGULARITY_TASK_ID", name, 1);
+
+    argv[1] = "/bin/sh";
+    argv[2] = "-c";
+    argv[3] = task->line;
+    argv[4] = NULL;
+
+    if ( wrapped ) {
+        argv[0] = "Singularity";
+        execv("/.exec", argv); // Flawfinder: ignore (exec* is necessary)
+    } else {
+        execv("/bin/sh", &argv[1]); // Flawfinder: ignore (exec* is necessary)
+    }
+    message(ERROR, "Could not exec task %ld: %s\n", task->id, strerror(errno));
+    _exit(127);
+}
+
+
+// Reap every task that has exited and report it, returns how many
+static int task_reap(struct task *pool, int workers, FILE *report, long *failed) {
+    struct arena_mark mark;
+    struct timespec end;
+    int reaped = 0;
+    int status;
+    pid_t pid;
+    int i;
+
+    while ( ( pid = waitpid(-1, &status, WNOHANG) ) > 0 ) {
+        // As a PID namespace init we also reap orphans that are not ours
+        for ( i = 0; i < workers && pool[i].pid != pid; i++ );
+        if ( i == workers ) {
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if ( WIFSIGNALED(status) ) {
+            status = 128 + WTERMSIG(status);
+        } else {
+            status = WEXITSTATUS(status);
+        }
+        if ( status != 0 ) {
+            (*failed)++;
+        }
+
+        mark = arena_save();
+        fprintf(report, "{\"task\":%ld,\"pid\":%d,\"exit\":%d,\"elapsed_us\":%lld,\"command\":%s}\n",
+                pool[i].id, pid, status,
+                (long long) ( end.tv_sec - pool[i].start.tv_sec ) * 1000000 + ( end.tv_nsec - pool[i].start.tv_nsec ) / 1000,
+                json_string(pool[i].line));
+        arena_restore(mark);
+        fflush(report);
+
+        free(pool[i].line);
+        pool[i].pid = 0;
+        reaped++;
+    }
+
+    return(reaped);
+}
+
+
+/*
+ * Run each line of tasks as a /bin/sh command with at most workers at a
+ * time, reporting one JSON line per finished task to the report stream.
+ * Returns 0 if every task exited zero.
+ */
+int container_tasks(FILE *tasks, int workers, int null_fd, int output_fd) {
+    struct task *pool;
+    sigset_t sigset;
+    sigset_t oldmask;
+    FILE *report = stderr;
+    char *line = NULL;
+    size_t linelen = 0;
+    long next_id = 1;
+    long failed = 0;
+    int running = 0;
+    int eof = 0;
+    int tasks_signal = 0;
+    int sig_fd;
+    int wrapped;
+    int i;
+
+    message(DEBUG, "Called container_tasks(tasks, %d, %d, %d)\n", workers, null_fd, output_fd);
+
+    if ( workers < 1 ) {
+        workers = 1;
+    }
+
+    // Set the environment up once here, for all tasks, if we can
+    wrapped = ( container_environment() < 0 && is_exec("/.exec") == 0 );
+    pool = (struct task *) calloc(workers, sizeof(struct task));
+    if ( pool == NULL ) {
+        message(ERROR, "Could not allocate task pool: %s\n", strerror(errno));
+        ABORT(255);
+    }
+
+    if ( output_fd >= 0 ) {
+        int report_fd = openat(output_fd, "tasks.json", O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+        if ( report_fd < 0 || ( report = fdopen(report_fd, "a") ) == NULL ) {
+            message(ERROR, "Could not open task report tasks.json: %s\n", strerror(errno));
+            ABORT(255);
+        }
+    }
+
+    // Take both task exits and our own signals from a signalfd, so none
+    // can slip in between deciding to wait and waiting.  A signal stops
+    // handing out tasks and is passed on to the running ones.
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGCHLD);
+    sigaddset(&sigset, SIGTERM);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGHUP);
+    sigprocmask(SIG_BLOCK, &sigset, &oldmask);
+    if ( ( sig_fd = signalfd(-1, &sigset, SFD_CLOEXEC) ) < 0 ) {
+        message(ERROR, "Could not create signalfd: %s\n", strerror(errno));
+        ABORT(255);
+    }
+
+    while ( 1 ) {
+        struct signalfd_siginfo info;
+
+        while ( eof == 0 && tasks_signal == 0 && running < workers ) {
+            ssize_t len = getline(&line, &linelen, tasks);
+            char *cmd = line;
+
+            if ( len < 0 ) {
+                eof = 1;
+                break;
+            }
+            while ( len > 0 && ( line[len - 1] == '\n' || line[len - 1] == '\r' ) ) {
+                line[--len] = '\0';
+            }
+            while ( *cmd == ' ' || *cmd == '\t' ) {
+                cmd++;
+            }
+            if ( *cmd == '\0' || *cmd == '#' ) {
+                continue;
+            }
+
+            for ( i = 0; pool[i].pid > 0; i++ );
+            pool[i].id = next_id++;
+            pool[i].line = xstrdup(cmd);
+            clock_gettime(CLOCK_MONOTONIC, &pool[i].start);
+            message(VERBOSE, "Starting task %ld: %s\n", pool[i].id, pool[i].line);
+            task_launch(&pool[i], null_fd, output_fd, wrapped, &oldmask);
+            running++;
+        }
+
+        if ( running == 0 ) {
+            break;
+        }
+
+        if ( read(sig_fd, &info, sizeof(info)) != sizeof(info) ) { // Flawfinder: ignore (fixed size)
+            if ( errno == EINTR ) {
+                continue;
+            }
+            message(ERROR, "Could not wait for tasks: %s\n", strerror(errno));
+            ABORT(255);
+        }
+
+        if ( info.ssi_signo == SIGCHLD ) {
+            running -= task_reap(pool, workers, report, &failed);
+            continue;
+        }
+
+        tasks_signal = info.ssi_signo;
+        message(VERBOSE, "Got signal %d, stopping %d running tasks\n", tasks_signal, running);
+        for ( i = 0; i < workers; i++ ) {
+            if ( pool[i].pid > 0 ) {
+                kill(pool[i].pid, tasks_signal);
+            }
+        }
+    }
+
+    close(sig_fd);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+    message(VERBOSE, "Ran %ld tasks, %ld failed\n", next_id - 1, failed);
+
+    free(line);
+    free(pool);
+    if ( report != stderr ) {
+        fclose(report);
+    }
+
+    if ( tasks_signal != 0 ) {
+        return(128 + tasks_signal);
+    }
+    return( failed > 0 ? 1 : 0 );
+}
@@ -20,11 +20,12 @@
 
 
 
-int container_daemon_start(char *sessiondir);
+int container_daemon_start(int comm_fd, int sock_fd);
 int container_daemon_stop(char *sessiondir);
 int container_shell(int argc, char **argv);
 int container_exec(int argc, char **argv);
 int container_run(int argc, char **argv);
+int container_tasks(FILE *tasks, int workers, int null_fd, int output_fd);
 
 
 
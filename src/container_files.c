@@ -20,18 +20,22 @@
  */
 
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <pwd.h>
+#include <sys/stat.h>
 #include <errno.h> 
+#include <fcntl.h>
+#include <time.h>
 #include <string.h>
-#include <grp.h>
 
 
 #include "config.h"
 #include "file.h"
+#include "fileio.h"
+#include "identity.h"
 #include "util.h"
 #include "message.h"
 
@@ -39,14 +43,8 @@
 
 void update_passwd_file(char *file) {
     FILE *file_fp;
-    uid_t uid = getuid();
-    struct passwd *pwent = getpwuid(uid);
+    struct identity *id = identity_get();
 
-    if (NULL == pwent) {
-        message(ERROR, "Could not get account information for uid %ld: %s\n",
-                (long) uid, strerror(errno));
-        ABORT(255);
-    }
     message(DEBUG, "Called update_passwd_file(%s)\n", file);
 
     message(VERBOSE2, "Checking for passwd file: %s\n", file);
@@ -60,9 +58,9 @@ void update_passwd_file(char *file) {
         message(ERROR, "Could not open passwd file %s: %s\n", file, strerror(errno));
         ABORT(255);
     }
-    if (fprintf(file_fp, "\n%s:x:%d:%d:%s:%s:%s\n", pwent->pw_name,
-                pwent->pw_uid, pwent->pw_gid, pwent->pw_gecos,
-                pwent->pw_dir, pwent->pw_shell) < 0) {
+    if (fprintf(file_fp, "\n%s:x:%d:%d:%s:%s:%s\n", id->name,
+                id->uid, id->gid, id->gecos,
+                id->dir, id->shell) < 0) {
         message(ERROR, "Could not write to passwd file %s: %s\n",
                 file, strerror(errno));
         ABORT(255);
@@ -78,25 +76,8 @@ void update_passwd_file(char *file) {
 
 void update_group_file(char *file) {
     FILE *file_fp;
-    int groupcount;
     int i;
-    int maxgroups = sysconf(_SC_NGROUPS_MAX) + 1;
-    uid_t uid = getuid();
-    uid_t gid = getgid();
-    gid_t gids[maxgroups];
-    struct passwd *pwent = getpwuid(uid);
-    struct group *grent = getgrgid(gid);
-
-    if (NULL == pwent) {
-        message(ERROR, "Could not get account information for uid %ld: %s\n",
-                (long) uid, strerror(errno));
-        ABORT(255);
-    }
-    if (NULL == grent) {
-        message(ERROR, "Could not get group information for gid %ld: %s\n",
-                (long) gid, strerror(errno));
-        ABORT(255);
-    }
+    struct identity *id = identity_get();
 
     message(DEBUG, "Called update_group_file(%s)\n", file);
 
@@ -111,43 +92,97 @@ void update_group_file(char *file) {
         message(ERROR, "Could not open group file %s: %s\n", file, strerror(errno));
         ABORT(255);
     }
-    if (fprintf(file_fp, "\n%s:x:%d:%s\n", grent->gr_name, grent->gr_gid, pwent->pw_name) < 0) {
+    if (fprintf(file_fp, "\n%s:x:%d:%s\n", id->groups[0].name, id->groups[0].gid, id->name) < 0) {
         message(ERROR, "Could not write group file %s: %s\n",
                 file, strerror(errno));
         ABORT(255);
     }
 
-    message(DEBUG, "Getting supplementary group info\n");
-    if ( (groupcount = getgroups(maxgroups, gids)) < 0 ) {
-        message(ERROR, "Failed to get supplementary group list: %s\n",
-                strerror(errno));
-        ABORT(255);
-    }
-
-    for (i=0; i < groupcount; i++) {
-        struct group *gr = getgrgid(gids[i]);
-        if (!gr) {
-            message(ERROR, "Failed to get supplementary group list: %s\n",
+    // groups[0] is the primary group written above
+    for (i=1; i < id->group_count; i++) {
+        message(VERBOSE2, "Adding user's supplementary group ('%s') info to group file\n", id->groups[i].name);
+        if (fprintf(file_fp, "%s:x:%d:%s\n", id->groups[i].name, id->groups[i].gid, id->name) < 0) {
+            message(ERROR, "Could not write to %s: %s\n", file,
                     strerror(errno));
             ABORT(255);
         }
-        message(VERBOSE3, "Found supplementary group membership in: %d\n", gids[i]);
-        if ( gids[i] != gid ) {
-            message(VERBOSE2, "Adding user's supplementary group ('%s') info to group file\n", grent->gr_name);
-            if (NULL == gr) {
-                message(ERROR, "Could not get supplementary group information for gid %ld: %s\n",
-                        (long)gids[i], strerror(errno));
-                ABORT(255);
-            }
-            if (fprintf(file_fp, "%s:x:%d:%s\n", gr->gr_name, gr->gr_gid, pwent->pw_name) < 0) {
-                message(ERROR, "Could not write to %s: %s\n", file,
-                        strerror(errno));
-                ABORT(255);
-            }
-        }
     }
 
     /* fixme: this is failing when not root */
     fclose(file_fp);
 
 }
+
+
+/*
+ * Return a copy of the container's file source, a path below its root
+ * rootfd, updated for the calling user, at staged.  A staged copy made
+ * earlier is reused while it is younger than ttl seconds and carries the
+ * source's mtime, which it is given when written, so that a changed image
+ * makes it stale.  The copy is written aside and renamed into place, so
+ * concurrent launches never see it half done.  The source is opened once,
+ * with no symlinks followed, and only ever looked at through that fd: the
+ * container may belong to the user, and the copy is readable by everyone.
+ */
+char *stage_container_file(int rootfd, char *source, char *staged, long ttl, void (*update)(char *)) {
+    struct stat source_stat;
+    struct stat staged_stat;
+    struct timespec times[2];
+    char *tmpfile;
+    int source_fd;
+    int fd;
+
+    message(DEBUG, "Called stage_container_file(%s, %s)\n", source, staged);
+
+    if ( ( source_fd = open_beneath(rootfd, source, O_RDONLY | O_NONBLOCK) ) < 0 ) {
+        message(VERBOSE2, "Container has no file to stage: %s\n", source);
+        return(NULL);
+    }
+    if ( fstat(source_fd, &source_stat) < 0 || ! S_ISREG(source_stat.st_mode) ) {
+        message(VERBOSE2, "Container has no file to stage: %s\n", source);
+        close(source_fd);
+        return(NULL);
+    }
+
+    if ( lstat(staged, &staged_stat) == 0 && S_ISREG(staged_stat.st_mode) && staged_stat.st_uid == 0 &&
+            staged_stat.st_mtim.tv_sec == source_stat.st_mtim.tv_sec &&
+            staged_stat.st_mtim.tv_nsec == source_stat.st_mtim.tv_nsec &&
+            time(NULL) - staged_stat.st_ctime < ttl ) {
+        message(VERBOSE2, "Using staged file: %s\n", staged);
+        close(source_fd);
+        return(staged);
+    }
+
+    // Not the pid for a name: the container process is pid 1 of its
+    // namespace in every launch
+    tmpfile = strjoin(staged, ".XXXXXX");
+    if ( ( fd = mkostemp(tmpfile, O_CLOEXEC) ) < 0 ) {
+        message(ERROR, "Could not create %s: %s\n", tmpfile, strerror(errno));
+        ABORT(255);
+    }
+
+    message(VERBOSE2, "Creating template of %s for containment\n", source);
+    if ( fileio_copy(source_fd, fd) < 0 || close(fd) < 0 ) {
+        message(ERROR, "Failed copying template %s to %s: %s\n", source, tmpfile, strerror(errno));
+        unlink(tmpfile);
+        ABORT(255);
+    }
+    close(source_fd);
+    update(tmpfile);
+
+    times[0] = source_stat.st_atim;
+    times[1] = source_stat.st_mtim;
+    if ( ( fd = open(tmpfile, O_RDONLY | O_CLOEXEC) ) < 0 || fchmod(fd, 0644) < 0 || futimens(fd, times) < 0 ) { // Flawfinder: ignore
+        message(ERROR, "Could not set mode and times of %s: %s\n", tmpfile, strerror(errno));
+        ABORT(255);
+    }
+    close(fd);
+
+    if ( rename(tmpfile, staged) < 0 ) {
+        message(ERROR, "Could not move %s into place: %s\n", staged, strerror(errno));
+        unlink(tmpfile);
+        ABORT(255);
+    }
+
+    return(staged);
+}
@@ -22,4 +22,5 @@
 
 void update_group_file(char * file);
 void update_passwd_file(char *file);
+char *stage_container_file(int rootfd, char *source, char *staged, long ttl, void (*update)(char *));
 
@@ -0,0 +1,743 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "daemon_socket.h"
+#include "zygote.h"
+#include "container_actions.h"
+#include "hostlibs.h"
+#include "timing.h"
+#include "util.h"
+#include "file.h"
+#include "message.h"
+
+
+/*
+ * Protocol, over a SOCK_SEQPACKET socket in the session directory
+ * (daemon.sock for `start`, pool*.sock for `start --pool`):
+ *
+ * client -> daemon: one request packet, a struct daemon_request_hdr followed
+ *                   by the NUL terminated command, cwd, argv and environ
+ *                   strings, carrying stdin, stdout, stderr and the cwd as
+ *                   SCM_RIGHTS descriptors.
+ * daemon -> client: DAEMON_MSG_STARTED with the pid, then DAEMON_MSG_EXIT
+ *                   with the shell style exit status.
+ * client -> daemon: DAEMON_MSG_SIGNAL for every signal the client receives.
+ */
+
+#define DAEMON_SOCKET_VERSION 1
+#define DAEMON_SOCKET_MAX (128 * 1024)
+
+struct daemon_request_hdr {
+    uint32_t version;
+    uint32_t umask;
+    int32_t argc;
+    int32_t envc;
+};
+
+struct daemon_client {
+    int fd;
+    pid_t pid;
+    int report_fd;
+};
+
+// Exit status of a process reaped before the zygote reported its pid
+struct daemon_exit {
+    pid_t pid;
+    int status;
+};
+
+// Signals the client passes on to the spawned process
+static const int daemon_forward_signals[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2, 0 };
+
+
+static int daemon_socket_addr(char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if ( strlength(path, sizeof(addr->sun_path)) >= (int) sizeof(addr->sun_path) ) {
+        message(VERBOSE, "Daemon socket path is too long: %s\n", path);
+        return(-1);
+    }
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1); // Flawfinder: ignore (length checked above)
+
+    return(0);
+}
+
+int daemon_socket_send(int fd, int type, int value) {
+    struct daemon_msg msg;
+
+    msg.type = type;
+    msg.value = value;
+    if ( send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg) ) {
+        return(-1);
+    }
+    return(0);
+}
+
+
+int daemon_socket_create(char *path, uid_t uid, gid_t gid) {
+    struct sockaddr_un addr;
+    int sock_fd;
+
+    message(DEBUG, "Called daemon_socket_create(%s, %d, %d)\n", path, uid, gid);
+
+    if ( daemon_socket_addr(path, &addr) < 0 ) {
+        return(-1);
+    }
+
+    // We hold the daemon.pid or pool.pid lock, so anything here is stale
+    unlink(addr.sun_path);
+
+    if ( ( sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0) ) < 0 ) {
+        message(ERROR, "Could not create daemon socket: %s\n", strerror(errno));
+        return(-1);
+    }
+    if ( bind(sock_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ) {
+        message(ERROR, "Could not bind daemon socket %s: %s\n", addr.sun_path, strerror(errno));
+        close(sock_fd);
+        return(-1);
+    }
+    if ( chown(addr.sun_path, uid, gid) < 0 || chmod(addr.sun_path, 0600) < 0 ) {
+        message(ERROR, "Could not set ownership of daemon socket %s: %s\n", addr.sun_path, strerror(errno));
+        close(sock_fd);
+        return(-1);
+    }
+    if ( listen(sock_fd, 64) < 0 ) {
+        message(ERROR, "Could not listen on daemon socket %s: %s\n", addr.sun_path, strerror(errno));
+        close(sock_fd);
+        return(-1);
+    }
+
+    message(DEBUG, "Return daemon_socket_create(%s) = %d\n", path, sock_fd);
+    return(sock_fd);
+}
+
+
+int daemon_socket_exec(char *path, char *command, int argc, char **argv, char *cwd, int cwd_fd, mode_t mask) {
+    extern char **environ;
+    struct sockaddr_un addr;
+    struct daemon_request_hdr *request;
+    struct daemon_msg msg;
+    struct msghdr msghdr;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * DAEMON_SOCKET_FDS)];
+        struct cmsghdr align;
+    } control;
+    int fds[DAEMON_SOCKET_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd_fd };
+    struct pollfd pfds[2];
+    sigset_t sigset;
+    sigset_t oldmask;
+    char *buf;
+    size_t len;
+    int envc = 0;
+    int started = 0;
+    int retval = -1;
+    int sock_fd;
+    int sig_fd;
+    int i;
+
+    message(DEBUG, "Called daemon_socket_exec(%s, %s, %d, **argv)\n", path, command, argc);
+
+    if ( daemon_socket_addr(path, &addr) < 0 ) {
+        return(-1);
+    }
+
+    // Build the request
+    len = sizeof(struct daemon_request_hdr) + strlen(command) + strlen(cwd) + 2; // Flawfinder: ignore
+    for ( i = 0; i < argc; i++ ) {
+        len += strlen(argv[i]) + 1; // Flawfinder: ignore
+    }
+    for ( envc = 0; environ[envc] != NULL; envc++ ) {
+        len += strlen(environ[envc]) + 1; // Flawfinder: ignore
+    }
+    if ( len > DAEMON_SOCKET_MAX ) {
+        message(VERBOSE, "Daemon request too large (%zu bytes)\n", len);
+        return(-1);
+    }
+
+    buf = (char *) xmalloc(len);
+    request = (struct daemon_request_hdr *) buf;
+    request->version = DAEMON_SOCKET_VERSION;
+    request->umask = mask;
+    request->argc = argc;
+    request->envc = envc;
+    len = sizeof(struct daemon_request_hdr);
+    len += snprintf(&buf[len], strlen(command) + 1, "%s", command) + 1; // Flawfinder: ignore
+    len += snprintf(&buf[len], strlen(cwd) + 1, "%s", cwd) + 1; // Flawfinder: ignore
+    for ( i = 0; i < argc; i++ ) {
+        len += snprintf(&buf[len], strlen(argv[i]) + 1, "%s", argv[i]) + 1; // Flawfinder: ignore
+    }
+    for ( i = 0; i < envc; i++ ) {
+        len += snprintf(&buf[len], strlen(environ[i]) + 1, "%s", environ[i]) + 1; // Flawfinder: ignore
+    }
+
+    if ( ( sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0) ) < 0 ) {
+        free(buf);
+        return(-1);
+    }
+    if ( connect(sock_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ) {
+        message(VERBOSE, "Could not connect to daemon socket %s: %s\n", addr.sun_path, strerror(errno));
+        close(sock_fd);
+        free(buf);
+        return(-1);
+    }
+
+    memset(&msghdr, 0, sizeof(msghdr));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msghdr.msg_iov = &iov;
+    msghdr.msg_iovlen = 1;
+    msghdr.msg_control = control.buf;
+    msghdr.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msghdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds)); // Flawfinder: ignore (fixed size)
+
+    if ( sendmsg(sock_fd, &msghdr, MSG_NOSIGNAL) != (ssize_t) len ) {
+        message(VERBOSE, "Could not send request to daemon: %s\n", strerror(errno));
+        close(sock_fd);
+        free(buf);
+        return(-1);
+    }
+    free(buf);
+    timing_mark("connect");
+
+    // Pass our signals on to the spawned process until it exits
+    sigemptyset(&sigset);
+    for ( i = 0; daemon_forward_signals[i] != 0; i++ ) {
+        sigaddset(&sigset, daemon_forward_signals[i]);
+    }
+    sigprocmask(SIG_BLOCK, &sigset, &oldmask);
+    if ( ( sig_fd = signalfd(-1, &sigset, SFD_CLOEXEC) ) < 0 ) {
+        message(ERROR, "Could not create signalfd: %s\n", strerror(errno));
+        ABORT(255);
+    }
+
+    pfds[0].fd = sock_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = sig_fd;
+    pfds[1].events = POLLIN;
+
+    while ( 1 ) {
+        if ( poll(pfds, 2, -1) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            message(ERROR, "Could not poll daemon socket: %s\n", strerror(errno));
+            ABORT(255);
+        }
+
+        if ( pfds[1].revents & POLLIN ) {
+            struct signalfd_siginfo info;
+
+            if ( read(sig_fd, &info, sizeof(info)) == sizeof(info) ) { // Flawfinder: ignore (fixed size)
+                message(DEBUG, "Forwarding signal %d to daemon\n", info.ssi_signo);
+                daemon_socket_send(sock_fd, DAEMON_MSG_SIGNAL, info.ssi_signo);
+            }
+        }
+
+        if ( pfds[0].revents & ( POLLIN | POLLHUP | POLLERR ) ) {
+            if ( recv(sock_fd, &msg, sizeof(msg), 0) != sizeof(msg) ) {
+                if ( started == 0 ) {
+                    message(VERBOSE, "Daemon refused the request\n");
+                    retval = -1;
+                } else {
+                    message(ERROR, "Lost connection to the namespace daemon\n");
+                    retval = 255;
+                }
+                break;
+            }
+            if ( msg.type == DAEMON_MSG_STARTED ) {
+                message(VERBOSE, "Daemon started process %d\n", msg.value);
+                started = 1;
+                timing_report(command);
+            } else if ( msg.type == DAEMON_MSG_EXIT ) {
+                message(VERBOSE, "Daemon process returned: %d\n", msg.value);
+                retval = msg.value;
+                break;
+            }
+        }
+    }
+
+    close(sig_fd);
+    close(sock_fd);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+    message(DEBUG, "Return daemon_socket_exec(%s) = %d\n", path, retval);
+    return(retval);
+}
+
+
+int daemon_socket_accept(int sock_fd) {
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+    int client_fd;
+
+    if ( ( client_fd = accept4(sock_fd, NULL, NULL, SOCK_CLOEXEC) ) < 0 ) {
+        return(-1);
+    }
+    if ( getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0 || cred.uid != getuid() ) {
+        message(WARNING, "Rejecting daemon connection from UID %d\n", cred.uid);
+        close(client_fd);
+        return(-1);
+    }
+
+    message(DEBUG, "Accepted daemon connection from pid %d\n", cred.pid);
+    return(client_fd);
+}
+
+
+struct daemon_request *daemon_socket_recv(int client_fd) {
+    struct daemon_request *request;
+    struct daemon_request_hdr *hdr;
+    struct msghdr msghdr;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * DAEMON_SOCKET_FDS)];
+        struct cmsghdr align;
+    } control;
+    char *end;
+    char *p;
+    ssize_t len;
+    int i;
+
+    request = (struct daemon_request *) xmalloc(sizeof(struct daemon_request));
+    memset(request, 0, sizeof(struct daemon_request));
+    for ( i = 0; i < DAEMON_SOCKET_FDS; i++ ) {
+        request->fds[i] = -1;
+    }
+    request->buf = (char *) xmalloc(DAEMON_SOCKET_MAX + 1);
+
+    memset(&msghdr, 0, sizeof(msghdr));
+    iov.iov_base = request->buf;
+    iov.iov_len = DAEMON_SOCKET_MAX;
+    msghdr.msg_iov = &iov;
+    msghdr.msg_iovlen = 1;
+    msghdr.msg_control = control.buf;
+    msghdr.msg_controllen = sizeof(control.buf);
+
+    if ( ( len = recvmsg(client_fd, &msghdr, MSG_CMSG_CLOEXEC) ) < 0 ) {
+        message(WARNING, "Could not read daemon request: %s\n", strerror(errno));
+        daemon_socket_free(request);
+        return(NULL);
+    }
+    cmsg = CMSG_FIRSTHDR(&msghdr);
+    if ( cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(request->fds)) ) {
+        message(WARNING, "Daemon request did not include file descriptors\n");
+        daemon_socket_free(request);
+        return(NULL);
+    }
+    memcpy(request->fds, CMSG_DATA(cmsg), sizeof(request->fds)); // Flawfinder: ignore (fixed size)
+
+    hdr = (struct daemon_request_hdr *) request->buf;
+    if ( ( msghdr.msg_flags & ( MSG_TRUNC | MSG_CTRUNC ) ) || len < (ssize_t) sizeof(struct daemon_request_hdr) ||
+            hdr->version != DAEMON_SOCKET_VERSION || hdr->argc < 1 || hdr->envc < 0 ||
+            hdr->argc > DAEMON_SOCKET_MAX / 2 || hdr->envc > DAEMON_SOCKET_MAX / 2 ) {
+        message(WARNING, "Ignoring malformed daemon request\n");
+        daemon_socket_free(request);
+        return(NULL);
+    }
+    request->umask = hdr->umask;
+    request->argc = hdr->argc;
+
+    // Split up the strings, making sure they all lie within the packet
+    request->buf[len] = '\0';
+    end = &request->buf[len];
+    p = request->buf + sizeof(struct daemon_request_hdr);
+    request->argv = (char **) xmalloc(sizeof(char *) * ( hdr->argc + 1 ));
+    request->envp = (char **) xmalloc(sizeof(char *) * ( hdr->envc + 1 ));
+    for ( i = 0; i < 2 + hdr->argc + hdr->envc && p < end; i++ ) {
+        if ( i == 0 ) {
+            request->command = p;
+        } else if ( i == 1 ) {
+            request->cwd = p;
+        } else if ( i < 2 + hdr->argc ) {
+            request->argv[i - 2] = p;
+        } else {
+            request->envp[i - 2 - hdr->argc] = p;
+        }
+        p += strlen(p) + 1; // Flawfinder: ignore (buf is NUL terminated)
+    }
+    if ( i != 2 + hdr->argc + hdr->envc ) {
+        message(WARNING, "Ignoring truncated daemon request\n");
+        daemon_socket_free(request);
+        return(NULL);
+    }
+    request->argv[hdr->argc] = NULL;
+    request->envp[hdr->envc] = NULL;
+
+    return(request);
+}
+
+
+void daemon_socket_apply(struct daemon_request *request) {
+    char *container;
+    int i;
+
+    for ( i = 0; i < 3; i++ ) {
+        if ( dup2(request->fds[i], i) < 0 ) {
+            message(ERROR, "Could not set up stdio: %s\n", strerror(errno));
+            ABORT(255);
+        }
+    }
+    if ( is_dir(request->cwd) == 0 ) {
+        if ( chdir(request->cwd) < 0 ) {
+            message(ERROR, "Could not chdir to: %s: %s\n", request->cwd, strerror(errno));
+            ABORT(1);
+        }
+    } else if ( fchdir(request->fds[3]) < 0 ) {
+        message(ERROR, "Could not fchdir to cwd: %s\n", strerror(errno));
+        ABORT(1);
+    }
+    umask(request->umask); // Flawfinder: ignore (the client's umask)
+
+    container = xstrdup(getenv("SINGULARITY_CONTAINER")); // Flawfinder: ignore
+    clearenv();
+    for ( i = 0; request->envp[i] != NULL; i++ ) {
+        putenv(request->envp[i]);
+    }
+    setenv("SINGULARITY_CONTAINER", container, 1);
+    hostlibs_environment();
+
+    if ( strcmp(request->command, "run") == 0 ) {
+        container_run(request->argc, request->argv);
+    } else if ( strcmp(request->command, "exec") == 0 ) {
+        container_exec(request->argc, request->argv);
+    } else if ( strcmp(request->command, "shell") == 0 ) {
+        container_shell(request->argc, request->argv);
+    } else {
+        message(ERROR, "Daemon can not run command: %s\n", request->command);
+    }
+    ABORT(255);
+}
+
+
+void daemon_socket_free(struct daemon_request *request) {
+    int i;
+
+    for ( i = 0; i < DAEMON_SOCKET_FDS; i++ ) {
+        if ( request->fds[i] >= 0 ) {
+            close(request->fds[i]);
+        }
+    }
+    free(request->argv);
+    free(request->envp);
+    free(request->buf);
+    free(request);
+}
+
+
+// Fork the process a request asks for
+static pid_t daemon_spawn(struct daemon_request *request, sigset_t *mask) {
+    pid_t pid;
+
+    if ( ( pid = fork() ) == 0 ) {
+        sigprocmask(SIG_SETMASK, mask, NULL);
+        daemon_socket_apply(request);
+    }
+    if ( pid < 0 ) {
+        message(WARNING, "Could not fork for daemon request: %s\n", strerror(errno));
+    }
+
+    return(pid);
+}
+
+
+// Read the pid a zygote child reports, or -1 if it never did
+static pid_t daemon_zygote_pid(int report_fd) {
+    char buf[32]; // Flawfinder: ignore (bounded by recv() below)
+    ssize_t len;
+
+    if ( ( len = recv(report_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT) ) <= 0 ) {
+        return(-1);
+    }
+    buf[len] = '\0';
+    return(strtol(buf, NULL, 10));
+}
+
+
+static int daemon_status(int status) {
+    if ( WIFSIGNALED(status) ) {
+        return(128 + WTERMSIG(status));
+    }
+    return(WEXITSTATUS(status));
+}
+
+
+int daemon_socket_serve(int comm_fd, int sock_fd, pid_t zygote_pid, int zygote_fd) {
+    struct daemon_client *clients = NULL;
+    struct daemon_exit *exits = NULL;
+    struct pollfd *pfds = NULL;
+    sigset_t sigchld;
+    sigset_t oldmask;
+    int nclients = 0;
+    int npending = 0;
+    int nexits = 0;
+    int sig_fd;
+    int done = 0;
+    int i;
+
+    message(DEBUG, "Called daemon_socket_serve(%d, %d, %d, %d)\n", comm_fd, sock_fd, zygote_pid, zygote_fd);
+
+    // Processes forked by the zygote are handed to us to reap
+    if ( zygote_fd >= 0 && prctl(PR_SET_CHILD_SUBREAPER, 1) < 0 ) {
+        message(WARNING, "Could not adopt zygote processes: %s\n", strerror(errno));
+    }
+
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, &oldmask);
+    if ( ( sig_fd = signalfd(-1, &sigchld, SFD_CLOEXEC) ) < 0 ) {
+        message(ERROR, "Could not create signalfd: %s\n", strerror(errno));
+        ABORT(255);
+    }
+
+    while ( done == 0 ) {
+        pfds = (struct pollfd *) realloc(pfds, sizeof(struct pollfd) * ( 3 + nclients ));
+        if ( pfds == NULL ) {
+            message(ERROR, "Could not allocate memory: %s\n", strerror(errno));
+            ABORT(255);
+        }
+        pfds[0].fd = comm_fd;
+        pfds[1].fd = sock_fd;
+        pfds[2].fd = sig_fd;
+        for ( i = 0; i < nclients; i++ ) {
+            pfds[3 + i].fd = clients[i].report_fd >= 0 ? clients[i].report_fd : clients[i].fd;
+        }
+        for ( i = 0; i < 3 + nclients; i++ ) {
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+
+        if ( poll(pfds, 3 + nclients, -1) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            message(ERROR, "Could not poll daemon descriptors: %s\n", strerror(errno));
+            ABORT(255);
+        }
+
+        // The daemon.comm FIFO, as used by `singularity stop`
+        if ( pfds[0].revents & POLLIN ) {
+            char line[256]; // Flawfinder: ignore (bounded by read() below)
+            ssize_t len = read(comm_fd, line, sizeof(line) - 1); // Flawfinder: ignore
+
+            if ( len > 0 ) {
+                line[len] = '\0';
+                if ( strncmp(line, "stop", 4) == 0 ) {
+                    message(INFO, "Stopping daemon\n");
+                    done = 1;
+                } else {
+                    message(WARNING, "Got unsupported daemon.comm command: '%s'\n", line);
+                }
+            }
+        }
+
+        // Reap exited processes and report them to their clients
+        if ( pfds[2].revents & POLLIN ) {
+            struct signalfd_siginfo info;
+            int status;
+            pid_t pid;
+
+            while ( read(sig_fd, &info, sizeof(info)) < 0 && errno == EINTR ); // Flawfinder: ignore (fixed size)
+            while ( ( pid = waitpid(-1, &status, WNOHANG) ) > 0 ) {
+                status = daemon_status(status);
+                if ( pid == zygote_pid ) {
+                    message(WARNING, "Zygote exited with %d, starting requests directly\n", status);
+                    close(zygote_fd);
+                    zygote_fd = -1;
+                    zygote_pid = -1;
+                    continue;
+                }
+                for ( i = 0; i < nclients && clients[i].pid != pid; i++ );
+                if ( i == nclients ) {
+                    // Possibly a zygote child whose pid we have yet to read
+                    if ( npending > 0 ) {
+                        exits = (struct daemon_exit *) realloc(exits, sizeof(struct daemon_exit) * ( nexits + 1 ));
+                        if ( exits == NULL ) {
+                            message(ERROR, "Could not allocate memory: %s\n", strerror(errno));
+                            ABORT(255);
+                        }
+                        exits[nexits].pid = pid;
+                        exits[nexits].status = status;
+                        nexits++;
+                    }
+                    continue;
+                }
+                message(VERBOSE, "Daemon process %d returned: %d\n", pid, status);
+                if ( clients[i].fd >= 0 ) {
+                    daemon_socket_send(clients[i].fd, DAEMON_MSG_EXIT, status);
+                    close(clients[i].fd);
+                }
+                clients[i] = clients[--nclients];
+            }
+        }
+
+        // Requests or signals from connected clients.  A client that goes
+        // away takes its process with it, like a terminal hangup.
+        for ( i = 0; i < nclients; i++ ) {
+            struct daemon_msg msg;
+            ssize_t len;
+
+            if ( pfds[3 + i].revents == 0 ) {
+                continue;
+            }
+
+            // A zygote child reporting its pid, so now it has started
+            if ( clients[i].report_fd >= 0 && pfds[3 + i].fd == clients[i].report_fd ) {
+                pid_t pid = daemon_zygote_pid(clients[i].report_fd);
+                int j;
+
+                close(clients[i].report_fd);
+                clients[i].report_fd = -1;
+                npending--;
+                if ( pid <= 0 ) {
+                    message(WARNING, "Zygote did not start request\n");
+                    close(clients[i].fd);
+                    clients[i] = clients[--nclients];
+                    if ( npending == 0 ) {
+                        nexits = 0;
+                    }
+                    continue;
+                }
+                message(VERBOSE, "Zygote started process %d\n", pid);
+                clients[i].pid = pid;
+                daemon_socket_send(clients[i].fd, DAEMON_MSG_STARTED, pid);
+
+                for ( j = 0; j < nexits && exits[j].pid != pid; j++ );
+                if ( j < nexits ) {
+                    message(VERBOSE, "Daemon process %d returned: %d\n", pid, exits[j].status);
+                    daemon_socket_send(clients[i].fd, DAEMON_MSG_EXIT, exits[j].status);
+                    close(clients[i].fd);
+                    exits[j] = exits[--nexits];
+                    clients[i] = clients[--nclients];
+                }
+                if ( npending == 0 ) {
+                    nexits = 0;
+                }
+                continue;
+            }
+
+            if ( clients[i].fd < 0 || pfds[3 + i].fd != clients[i].fd ) {
+                continue;
+            }
+            if ( ( len = recv(clients[i].fd, &msg, sizeof(msg), MSG_DONTWAIT) ) != sizeof(msg) ) {
+                if ( len < 0 && errno == EAGAIN ) {
+                    continue;
+                }
+                message(VERBOSE, "Client of process %d went away\n", clients[i].pid);
+                kill(clients[i].pid, SIGHUP);
+                close(clients[i].fd);
+                clients[i].fd = -1;
+            } else if ( msg.type == DAEMON_MSG_SIGNAL && msg.value > 0 && msg.value < NSIG ) {
+                message(DEBUG, "Sending signal %d to process %d\n", msg.value, clients[i].pid);
+                kill(clients[i].pid, msg.value);
+            }
+        }
+
+        // New connections, only accepted from our own user
+        if ( pfds[1].revents & POLLIN ) {
+            struct daemon_request *request;
+            int report_fd = -1;
+            int client_fd;
+            pid_t pid = 0;
+
+            if ( ( client_fd = daemon_socket_accept(sock_fd) ) < 0 ) {
+                continue;
+            }
+            if ( ( request = daemon_socket_recv(client_fd) ) == NULL ) {
+                close(client_fd);
+                continue;
+            }
+            if ( zygote_fd >= 0 && strcmp(request->command, "exec") == 0 ) {
+                report_fd = zygote_send(zygote_fd, request);
+            } else {
+                pid = daemon_spawn(request, &oldmask);
+            }
+            daemon_socket_free(request);
+            if ( pid < 0 || ( pid == 0 && report_fd < 0 ) ) {
+                close(client_fd);
+                continue;
+            }
+            if ( report_fd >= 0 ) {
+                npending++;
+            } else {
+                message(VERBOSE, "Started process %d\n", pid);
+                daemon_socket_send(client_fd, DAEMON_MSG_STARTED, pid);
+            }
+
+            clients = (struct daemon_client *) realloc(clients, sizeof(struct daemon_client) * ( nclients + 1 ));
+            if ( clients == NULL ) {
+                message(ERROR, "Could not allocate memory: %s\n", strerror(errno));
+                ABORT(255);
+            }
+            clients[nclients].fd = client_fd;
+            clients[nclients].pid = pid;
+            clients[nclients].report_fd = report_fd;
+            nclients++;
+        }
+    }
+
+    for ( i = 0; i < nclients; i++ ) {
+        if ( clients[i].fd >= 0 ) {
+            close(clients[i].fd);
+        }
+        if ( clients[i].report_fd >= 0 ) {
+            close(clients[i].report_fd);
+        }
+    }
+    if ( zygote_pid > 0 ) {
+        kill(zygote_pid, SIGTERM);
+        close(zygote_fd);
+    }
+    free(clients);
+    free(exits);
+    free(pfds);
+    close(sig_fd);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+    message(DEBUG, "Return daemon_socket_serve() = 0\n");
+    return(0);
+}
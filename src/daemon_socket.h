@@ -0,0 +1,52 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+#define DAEMON_SOCKET_FDS 4
+
+#define DAEMON_MSG_STARTED 1
+#define DAEMON_MSG_EXIT 2
+#define DAEMON_MSG_SIGNAL 3
+
+struct daemon_msg {
+    int type;
+    int value;
+};
+
+// A request received from a client, ready to be applied
+struct daemon_request {
+    char *command;
+    char *cwd;
+    int argc;
+    char **argv;
+    char **envp;
+    int fds[DAEMON_SOCKET_FDS];
+    mode_t umask;
+    char *buf;
+};
+
+int daemon_socket_create(char *path, uid_t uid, gid_t gid);
+int daemon_socket_exec(char *path, char *command, int argc, char **argv, char *cwd, int cwd_fd, mode_t mask);
+int daemon_socket_send(int fd, int type, int value);
+int daemon_socket_accept(int sock_fd);
+struct daemon_request *daemon_socket_recv(int client_fd);
+void daemon_socket_apply(struct daemon_request *request);
+void daemon_socket_free(struct daemon_request *request);
+int daemon_socket_serve(int comm_fd, int sock_fd, pid_t zygote_pid, int zygote_fd);
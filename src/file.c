@@ -28,6 +28,8 @@
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 #include <errno.h> 
 #include <string.h>
 #include <fcntl.h>  
@@ -37,8 +39,10 @@
 #include <time.h>
 
 #include "config.h"
+#include "file.h"
 #include "util.h"
 #include "message.h"
+#include "fileio.h"
 
 
 char *file_id(char *path) {
@@ -127,6 +131,101 @@ int is_dir(char *path) {
     return(-1);
 }
 
+// The mode of path, relative to dirfd.  Unless dirfd is AT_FDCWD leading
+// slashes are skipped, so absolute container paths can be passed as they
+// are, and "/" is dirfd itself.  Only the type and mode are requested,
+// which network file systems can answer without fetching the whole inode.
+static int file_mode_at(int dirfd, char *path, mode_t *mode) {
+    while ( dirfd != AT_FDCWD && path[0] == '/' ) {
+        path++;
+    }
+
+#ifdef HAVE_STATX
+    struct statx filestatx;
+
+    if ( statx(dirfd, path, AT_EMPTY_PATH | AT_NO_AUTOMOUNT, STATX_TYPE | STATX_MODE, &filestatx) == 0 ) {
+        *mode = filestatx.stx_mode;
+        return(0);
+    }
+    if ( errno != ENOSYS ) {
+        return(-1);
+    }
+#endif
+
+    struct stat filestat;
+
+    if ( fstatat(dirfd, path, &filestat, AT_EMPTY_PATH | AT_NO_AUTOMOUNT) < 0 ) {
+        return(-1);
+    }
+    *mode = filestat.st_mode;
+
+    return(0);
+}
+
+int is_file_at(int dirfd, char *path) {
+    mode_t mode;
+
+    if ( file_mode_at(dirfd, path, &mode) < 0 || ! S_ISREG(mode) ) {
+        return(-1);
+    }
+
+    return(0);
+}
+
+int is_dir_at(int dirfd, char *path) {
+    mode_t mode;
+
+    if ( file_mode_at(dirfd, path, &mode) < 0 || ! S_ISDIR(mode) ) {
+        return(-1);
+    }
+
+    return(0);
+}
+
+int is_exec_at(int dirfd, char *path) {
+    mode_t mode;
+
+    if ( file_mode_at(dirfd, path, &mode) < 0 || ! ( S_IXUSR & mode ) ) {
+        return(-1);
+    }
+
+    return(0);
+}
+
+// What a bind mount can use, in one stat
+int is_file_or_dir_at(int dirfd, char *path) {
+    mode_t mode;
+
+    if ( file_mode_at(dirfd, path, &mode) < 0 || ! ( S_ISREG(mode) || S_ISDIR(mode) ) ) {
+        return(-1);
+    }
+
+    return(0);
+}
+
+// Is path, or the directory it would be created in, on a file system that
+// lives in memory?
+int is_tmpfs(char *path) {
+    struct statfs fsstat;
+    char *copy = xstrdup(path);
+    char *dir = copy;
+
+    while ( statfs(dir, &fsstat) < 0 ) {
+        if ( errno != ENOENT || strcmp(dir, "/") == 0 || strcmp(dir, ".") == 0 ) {
+            free(copy);
+            return(-1);
+        }
+        dir = dirname(dir);
+    }
+    free(copy);
+
+    if ( fsstat.f_type == TMPFS_MAGIC || fsstat.f_type == RAMFS_MAGIC ) {
+        return(0);
+    }
+
+    return(-1);
+}
+
 int is_exec(char *path) {
     struct stat filestat;
 
@@ -219,9 +318,8 @@ int s_rmdir(char *dir) {
 
 int copy_file(char * source, char * dest) {
     struct stat filestat;
-    int c;
-    FILE * fp_s;
-    FILE * fp_d;
+    int fd_s;
+    int fd_d;
 
     message(DEBUG, "Called copy_file(%s, %s)\n", source, dest);
 
@@ -231,43 +329,42 @@ int copy_file(char * source, char * dest) {
     }
 
     message(DEBUG, "Opening source file: %s\n", source);
-    if ( ( fp_s = fopen(source, "r") ) == NULL ) { // Flawfinder: ignore
+    if ( ( fd_s = open(source, O_RDONLY | O_CLOEXEC) ) < 0 ) { // Flawfinder: ignore
         message(ERROR, "Could not read %s: %s\n", source, strerror(errno));
         return(-1);
     }
 
     message(DEBUG, "Opening destination file: %s\n", dest);
-    if ( ( fp_d = fopen(dest, "w") ) == NULL ) { // Flawfinder: ignore
-        if (fclose(fp_s)) {
-            message(ERROR, "Could not close %s: %s\n", dest, strerror(errno));
-            ABORT(255);
-        }
+    if ( ( fd_d = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666) ) < 0 ) { // Flawfinder: ignore
         message(ERROR, "Could not write %s: %s\n", dest, strerror(errno));
+        close(fd_s);
         return(-1);
     }
 
-    message(DEBUG, "Calling fstat() on source file descriptor: %d\n", fileno(fp_s));
-    if ( fstat(fileno(fp_s), &filestat) < 0 ) {
+    message(DEBUG, "Calling fstat() on source file descriptor: %d\n", fd_s);
+    if ( fstat(fd_s, &filestat) < 0 ) {
         message(ERROR, "Could not fstat() on %s: %s\n", source, strerror(errno));
+        close(fd_s);
+        close(fd_d);
         return(-1);
     }
 
     message(DEBUG, "Cloning permission string of source to dest\n");
-    if ( fchmod(fileno(fp_d), filestat.st_mode) < 0 ) {
+    if ( fchmod(fd_d, filestat.st_mode) < 0 ) {
         message(ERROR, "Could not set permission mode on %s: %s\n", dest, strerror(errno));
+        close(fd_s);
+        close(fd_d);
         return(-1);
     }
 
     message(DEBUG, "Copying file data...\n");
-    while ( ( c = fgetc(fp_s) ) != EOF ) { // Flawfinder: ignore (checked boundries)
-        if (fputc(c, fp_d) == EOF) {
-            message(ERROR, "Copying failed: %s\n", strerror(errno));
-            ABORT(255);
-        }
+    if ( fileio_copy(fd_s, fd_d) < 0 ) {
+        message(ERROR, "Copying failed: %s\n", strerror(errno));
+        ABORT(255);
     }
 
-    message(DEBUG, "Done copying data, closing file pointers\n");
-    if (fclose(fp_s) || fclose(fp_d)) {
+    message(DEBUG, "Done copying data, closing file descriptors\n");
+    if ( close(fd_s) < 0 || close(fd_d) < 0 ) {
         message(ERROR, "Could not close file: %s\n", strerror(errno));
         ABORT(255);
     }
@@ -278,83 +375,160 @@ int copy_file(char * source, char * dest) {
 }
 
 
+// Readers never see a partly written file
 int fileput(char *path, char *string) {
-    FILE *fd;
-
     message(DEBUG, "Called fileput(%s, %s)\n", path, string);
-    if ( ( fd = fopen(path, "w") ) == NULL // Flawfinder: ignore
-         || fprintf(fd, "%s", string) < 0 ) {
+    if ( fileio_replace(path, string, strlen(string), 0644) < 0 ) {
         message(ERROR, "Could not write to %s: %s\n", path, strerror(errno));
         return(-1);
     }
 
-    if (fclose(fd)) {
-        message(ERROR, "Could not close %s: %s\n", path, strerror(errno));
-        ABORT(255);
-    }
-
     return(0);
 }
 
+
 char *filecat(char *path) {
+    return(filecat_at(AT_FDCWD, path));
+}
+
+
+char *filecat_at(int dirfd, char *path) {
+    struct stat filestat;
     char *ret;
-    FILE *fd;
-    int c;
-    long length;
-    long pos = 0;
+    int fd;
 
     message(DEBUG, "Called filecat(%s)\n", path);
-    
-    if ( is_file(path) < 0 ) {
+
+    // Opened before it is checked, so what is checked is what is read
+    while ( dirfd != AT_FDCWD && path[0] == '/' ) {
+        path++;
+    }
+    if ( ( fd = openat(dirfd, path, O_RDONLY | O_NONBLOCK | O_CLOEXEC) ) < 0 ) { // Flawfinder: ignore
+        if ( errno == ENOENT ) {
+            message(ERROR, "Could not find %s\n", path);
+        } else {
+            message(ERROR, "Could not read from %s: %s\n", path, strerror(errno));
+        }
+        return(NULL);
+    }
+    if ( fstat(fd, &filestat) < 0 || ! S_ISREG(filestat.st_mode) ) {
         message(ERROR, "Could not find %s\n", path);
+        close(fd);
         return(NULL);
     }
 
-    if ( ( fd = fopen(path, "r") ) == NULL ) { // Flawfinder: ignore
+    if ( ( ret = fileio_read(fd, NULL) ) == NULL ) {
         message(ERROR, "Could not read from %s: %s\n", path, strerror(errno));
+        close(fd);
         return(NULL);
     }
 
-
-    if ( fseek(fd, 0L, SEEK_END) < 0 ) {
-        message(ERROR, "Could not seek to end of file %s: %s\n", path, strerror(errno));
-        return(NULL);
+    if ( close(fd) < 0 ) {
+        message(ERROR, "Could not close file %s: %s", path, strerror(errno));
+        ABORT(255);
     }
 
-    length = ftell(fd);
+    return(ret);
+}
 
-    rewind(fd);
 
-    ret = (char *) xmalloc(length+1);
+// The deepest existing directory of dir, an absolute path, below the
+// container root rootfd; the top level component if none of it exists.
+// Walks dir once, one component at a time, from the root down.
+char *container_basedir(int rootfd, char *dir) {
+    char *component;
+    char *end;
+    size_t found = 0;
+    int fd = rootfd;
+    int next;
 
-    while ( ( c = fgetc(fd) ) != EOF ) { // Flawfinder: ignore (checked boundries)
-        ret[pos] = c;
-        pos++;
+    if ( rootfd < 0 || dir == NULL ) {
+        return(NULL);
     }
-    ret[pos] = '\0';
 
-    if (fclose(fd) != 0) {
-        message(ERROR, "Could not close file %s: %s", path, strerror(errno));
-        ABORT(255);
-    }
+    for ( component = dir; *component != '\0'; component = end ) {
+        char *name;
 
-    return(ret);
-}
+        while ( *component == '/' ) {
+            component++;
+        }
+        if ( *component == '\0' ) {
+            break;
+        }
+        end = component + strcspn(component, "/");
+        name = strndup(component, end - component);
 
-char * container_basedir(char *containerdir, char *dir) {
-    char * testdir = xstrdup(dir);
-    char * prevdir = NULL;
-    if ( containerdir == NULL || dir == NULL ) {
+        next = openat(fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC); // Flawfinder: ignore
+        free(name);
+        if ( fd != rootfd ) {
+            close(fd);
+        }
+        if ( next < 0 ) {
+            if ( found == 0 ) {
+                found = end - dir;
+            }
+            fd = rootfd;
+            break;
+        }
+        fd = next;
+        found = end - dir;
+    }
+    if ( fd != rootfd ) {
+        close(fd);
+    }
+
+    if ( found == 0 ) {
         return(NULL);
     }
+    return(strndup(dir, found));
+}
+
+
+// Open path below the container root rootfd with flags, following no
+// symlink and no ".." in any of its components, so that it can not lead
+// out of the container's tree.  Returns -1 with errno set on failure.
+int open_beneath(int rootfd, char *path, int flags) {
+    char *component = path;
+    int fd = rootfd;
+
+    while ( 1 ) {
+        char *name;
+        char *end;
+        int saved_errno;
+        int last;
+        int next;
+
+        while ( *component == '/' ) {
+            component++;
+        }
+        end = component + strcspn(component, "/");
+        if ( end == component || ( end - component == 2 && strncmp(component, "..", 2) == 0 ) ) {
+            if ( fd != rootfd ) {
+                close(fd);
+            }
+            errno = EINVAL;
+            return(-1);
+        }
+        last = ( end[strspn(end, "/")] == '\0' );
+
+        if ( ( name = strndup(component, end - component) ) == NULL ) {
+            next = -1;
+        } else if ( last ) {
+            next = openat(fd, name, flags | O_NOFOLLOW | O_CLOEXEC); // Flawfinder: ignore
+        } else {
+            next = openat(fd, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC); // Flawfinder: ignore
+        }
+        saved_errno = errno;
+        free(name);
+        if ( fd != rootfd ) {
+            close(fd);
+        }
+        errno = saved_errno;
 
-    while ( testdir != NULL && ( strcmp(testdir, "/") != 0 ) ) {
-        if ( is_dir(joinpath(containerdir, testdir)) == 0 ) {
-            return(testdir);
+        if ( next < 0 || last ) {
+            return(next);
         }
-        prevdir = xstrdup(testdir);
-        testdir = dirname(xstrdup(testdir));
+        fd = next;
+        component = end;
     }
-    return(prevdir);
 }
-
@@ -24,12 +24,19 @@ int is_file(char *path);
 int is_fifo(char *path);
 int is_link(char *path);
 int is_dir(char *path);
+int is_tmpfs(char *path);
 int is_exec(char *path);
 int is_owner(char *path, uid_t uid, gid_t gid);
 int is_blk(char *path);
+int is_file_at(int dirfd, char *path);
+int is_dir_at(int dirfd, char *path);
+int is_exec_at(int dirfd, char *path);
+int is_file_or_dir_at(int dirfd, char *path);
 int s_mkpath(char *dir, mode_t mode);
 int s_rmdir(char *dir);
 int copy_file(char * source, char * dest);
 char *filecat(char *path);
 int fileput(char *path, char *string);
-char * container_basedir(char *containerdir, char *dir);
+char *filecat_at(int dirfd, char *path);
+char *container_basedir(int rootfd, char *dir);
+int open_beneath(int rootfd, char *path, int flags);
@@ -0,0 +1,211 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+
+#include "config.h"
+#include "fileio.h"
+#include "util.h"
+#include "arena.h"
+
+// Largest chunk handed to copy_file_range()/sendfile() at once
+#define FILEIO_CHUNK ( 1 << 30 )
+// Buffer for files whose size fstat() does not know (procfs, pipes)
+#define FILEIO_UNSIZED 4096
+
+
+static int fileio_copy_rw(int src_fd, int dst_fd) {
+    char buf[65536]; // Flawfinder: ignore (bounded by sizeof)
+    ssize_t count;
+
+    while ( ( count = read(src_fd, buf, sizeof(buf)) ) != 0 ) { // Flawfinder: ignore (bounded by sizeof)
+        if ( count < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return(-1);
+        }
+        if ( fileio_pwrite(dst_fd, buf, count, -1) < 0 ) {
+            return(-1);
+        }
+    }
+
+    return(0);
+}
+
+
+int fileio_copy(int src_fd, int dst_fd) {
+    struct stat filestat;
+    ssize_t count;
+
+    if ( fstat(src_fd, &filestat) < 0 ) {
+        return(-1);
+    }
+    if ( ! S_ISREG(filestat.st_mode) || filestat.st_size == 0 ) {
+        return(fileio_copy_rw(src_fd, dst_fd));
+    }
+
+#ifdef FICLONE
+    // Shares the extents on btrfs, XFS and the like; whole files only
+    if ( lseek(src_fd, 0, SEEK_CUR) == 0 && lseek(dst_fd, 0, SEEK_CUR) == 0 && ioctl(dst_fd, FICLONE, src_fd) == 0 ) {
+        lseek(dst_fd, filestat.st_size, SEEK_SET);
+        return(0);
+    }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while ( ( count = copy_file_range(src_fd, NULL, dst_fd, NULL, FILEIO_CHUNK, 0) ) > 0 );
+    if ( count == 0 ) {
+        return(0);
+    }
+    // Fall through on the errors that mean "not between these two files"
+    if ( errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF ) {
+        return(-1);
+    }
+#endif
+
+    while ( ( count = sendfile(dst_fd, src_fd, NULL, FILEIO_CHUNK) ) > 0 );
+    if ( count == 0 ) {
+        return(0);
+    }
+    if ( errno != EINVAL && errno != ENOSYS ) {
+        return(-1);
+    }
+
+    return(fileio_copy_rw(src_fd, dst_fd));
+}
+
+
+char *fileio_read(int fd, size_t *length) {
+    struct stat filestat;
+    size_t size;
+    size_t pos = 0;
+    ssize_t count;
+    char *buf;
+
+    if ( fstat(fd, &filestat) < 0 ) {
+        return(NULL);
+    }
+    size = ( S_ISREG(filestat.st_mode) && filestat.st_size > 0 ) ? filestat.st_size : FILEIO_UNSIZED;
+    buf = (char *) xmalloc(size + 1);
+
+    // One read for a regular file; more only if it grew meanwhile
+    while ( ( count = read(fd, buf + pos, size - pos) ) != 0 ) { // Flawfinder: ignore (bounded by size)
+        if ( count < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            free(buf);
+            return(NULL);
+        }
+        pos += count;
+        if ( pos == size ) {
+            char *grown;
+
+            size *= 2;
+            if ( ( grown = (char *) realloc(buf, size + 1) ) == NULL ) {
+                free(buf);
+                errno = ENOMEM;
+                return(NULL);
+            }
+            buf = grown;
+        }
+    }
+    buf[pos] = '\0';
+
+    if ( length != NULL ) {
+        *length = pos;
+    }
+    return(buf);
+}
+
+
+// An offset of -1 writes at, and advances, the file offset
+int fileio_pwrite(int fd, const char *buf, size_t length, off_t offset) {
+    ssize_t count;
+
+    while ( length > 0 ) {
+        if ( offset < 0 ) {
+            count = write(fd, buf, length);
+        } else {
+            count = pwrite(fd, buf, length, offset);
+        }
+        if ( count < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return(-1);
+        }
+        buf += count;
+        length -= count;
+        if ( offset >= 0 ) {
+            offset += count;
+        }
+    }
+
+    return(0);
+}
+
+
+int fileio_replace(char *path, const char *buf, size_t length, mode_t mode) {
+    struct arena_mark mark = arena_save();
+    char *tmpfile = strjoin(path, ".XXXXXX");
+    int saved_errno = 0;
+    int fd;
+
+    if ( ( fd = mkostemp(tmpfile, O_CLOEXEC) ) < 0 ) {
+        arena_restore(mark);
+        return(-1);
+    }
+    if ( fileio_pwrite(fd, buf, length, 0) < 0 || fchmod(fd, mode) < 0 ) {
+        saved_errno = errno;
+    }
+    // Closed exactly once, on every path: with setup running on a second
+    // thread the number can be handed out again as soon as it is closed
+    if ( close(fd) < 0 && saved_errno == 0 ) {
+        saved_errno = errno;
+    }
+    if ( saved_errno == 0 && rename(tmpfile, path) < 0 ) {
+        saved_errno = errno;
+    }
+    if ( saved_errno != 0 ) {
+        unlink(tmpfile);
+    }
+
+    arena_restore(mark);
+    if ( saved_errno != 0 ) {
+        errno = saved_errno;
+        return(-1);
+    }
+    return(0);
+}
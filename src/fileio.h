@@ -0,0 +1,46 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+
+#ifndef __FILEIO_H_
+#define __FILEIO_H_
+
+#include <sys/types.h>
+
+// Bulk file I/O behind the file.c helpers.  Copies are done by the kernel
+// where it can (reflink, copy_file_range(), sendfile()), reads are a
+// single read() into a buffer sized from fstat(), and writes replace the
+// target atomically.  All return -1 with errno set on failure, and leave
+// reporting to the caller.
+
+// Copy everything from src_fd's offset to dst_fd's offset
+int fileio_copy(int src_fd, int dst_fd);
+
+// Read the rest of fd into a NUL terminated buffer; *length may be NULL
+char *fileio_read(int fd, size_t *length);
+
+// Write all of buf at offset
+int fileio_pwrite(int fd, const char *buf, size_t length, off_t offset);
+
+// Replace path with buf through a temporary file and rename()
+int fileio_replace(char *path, const char *buf, size_t length, mode_t mode);
+
+#endif /* __FILEIO_H_ */
@@ -0,0 +1,358 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <dirent.h>
+#include <elf.h>
+#include <limits.h>
+#include <stddef.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "hostlibs.h"
+#include "config_parser.h"
+#include "util.h"
+#include "arena.h"
+#include "file.h"
+#include "message.h"
+
+
+/*
+ * Host libraries (interconnect providers, a tuned MPI) are only useful in a
+ * container when they can be loaded by its dynamic linker: same ELF class
+ * and machine as the container's libc, and no GLIBC symbol versions newer
+ * than that libc defines.  Working that out means reading every library of
+ * every 'host lib path' directory, so the answer is kept per image in a
+ * cache file, keyed on the container's libc and the host directories'
+ * mtimes, and later launches only stat() those.
+ */
+
+struct hostlibs_abi {
+    unsigned char class;
+    unsigned short machine;
+    unsigned long glibc;
+};
+
+
+// Places a container's libc may live, relative to its root
+static const char *hostlibs_libc[] = {
+    "/lib64/libc.so.6",
+    "/lib/*/libc.so.6",
+    "/lib/libc.so.6",
+    "/usr/lib64/libc.so.6",
+    "/usr/lib/*/libc.so.6",
+    "/usr/lib/libc.so.6",
+    NULL
+};
+
+
+// Turn "2.17" or "2.2.5" into something that compares as a number
+static unsigned long hostlibs_version(const char *p, const char *end) {
+    unsigned long part[3] = { 0, 0, 0 };
+    int i = 0;
+
+    if ( p >= end || *p < '0' || *p > '9' ) {
+        return(0);
+    }
+    while ( p < end && i < 3 ) {
+        if ( *p >= '0' && *p <= '9' ) {
+            part[i] = part[i] * 10 + ( *p - '0' );
+        } else if ( *p == '.' && p + 1 < end && p[1] >= '0' && p[1] <= '9' ) {
+            i++;
+        } else {
+            break;
+        }
+        p++;
+    }
+
+    return(( part[0] << 16 ) | ( ( part[1] & 0xff ) << 8 ) | ( part[2] & 0xff ));
+}
+
+
+// Read the ELF class and machine of path, and the highest GLIBC_ version
+// named in it: those libc defines, or those a library needs
+static int hostlibs_elf_abi(char *path, struct hostlibs_abi *abi) {
+    struct stat filestat;
+    const char *map;
+    const char *p;
+    const char *end;
+    int fd;
+
+    if ( ( fd = open(path, O_RDONLY | O_CLOEXEC) ) < 0 ) { // Flawfinder: ignore
+        return(-1);
+    }
+    if ( fstat(fd, &filestat) < 0 || filestat.st_size < (off_t) sizeof(Elf32_Ehdr) ) {
+        close(fd);
+        return(-1);
+    }
+    map = mmap(NULL, filestat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( map == MAP_FAILED ) {
+        return(-1);
+    }
+    if ( memcmp(map, ELFMAG, SELFMAG) != 0 ) {
+        munmap((void *) map, filestat.st_size);
+        return(-1);
+    }
+
+    abi->class = (unsigned char) map[EI_CLASS];
+    memcpy(&abi->machine, map + offsetof(Elf32_Ehdr, e_machine), sizeof(abi->machine));
+    abi->glibc = 0;
+
+    end = map + filestat.st_size;
+    for ( p = map; ( p = memmem(p, end - p, "GLIBC_", 6) ) != NULL; p += 6 ) {
+        unsigned long version = hostlibs_version(p + 6, end);
+        if ( version > abi->glibc ) {
+            abi->glibc = version;
+        }
+    }
+
+    munmap((void *) map, filestat.st_size);
+    return(0);
+}
+
+
+// The container's libc, with a symlink resolved inside rootpath
+static char *hostlibs_find_libc(char *rootpath) {
+    int i;
+
+    for ( i = 0; hostlibs_libc[i] != NULL; i++ ) {
+        glob_t found;
+        size_t j;
+
+        if ( glob(joinpath(rootpath, (char *) hostlibs_libc[i]), 0, NULL, &found) != 0 ) {
+            continue;
+        }
+        for ( j = 0; j < found.gl_pathc; j++ ) {
+            char target[PATH_MAX]; // Flawfinder: ignore
+            char *libc = xstrdup(found.gl_pathv[j]);
+            ssize_t len;
+
+            if ( ( len = readlink(libc, target, sizeof(target) - 1) ) > 0 ) { // Flawfinder: ignore
+                target[len] = '\0';
+                if ( target[0] == '/' ) {
+                    libc = joinpath(rootpath, target);
+                }
+            }
+            if ( is_file(libc) == 0 ) {
+                globfree(&found);
+                return(libc);
+            }
+        }
+        globfree(&found);
+    }
+
+    return(NULL);
+}
+
+
+// Every ELF library in dir must match the container's ABI
+static int hostlibs_check_dir(char *dir, struct hostlibs_abi *container) {
+    struct dirent *entry;
+    DIR *dp;
+    int ret = 0;
+
+    if ( ( dp = opendir(dir) ) == NULL ) {
+        message(WARNING, "Could not open 'host lib path' %s: %s\n", dir, strerror(errno));
+        return(-1);
+    }
+
+    while ( ret == 0 && ( entry = readdir(dp) ) != NULL ) {
+        struct hostlibs_abi abi;
+        struct stat filestat;
+        struct arena_mark mark;
+        char *path;
+
+        if ( strstr(entry->d_name, ".so") == NULL ) {
+            continue;
+        }
+        mark = arena_save();
+        path = joinpath(dir, entry->d_name);
+        // Links to a library are checked with the library itself
+        if ( lstat(path, &filestat) < 0 || ! S_ISREG(filestat.st_mode) ) {
+            arena_restore(mark);
+            continue;
+        }
+        if ( hostlibs_elf_abi(path, &abi) == 0 ) {
+            if ( abi.class != container->class || abi.machine != container->machine ) {
+                message(WARNING, "Not injecting %s: %s is built for another architecture than the container\n", dir, entry->d_name);
+                ret = -1;
+            } else if ( abi.glibc > container->glibc ) {
+                message(WARNING, "Not injecting %s: %s needs GLIBC %lu.%lu, the container has %lu.%lu\n", dir, entry->d_name,
+                        abi.glibc >> 16, ( abi.glibc >> 8 ) & 0xff, container->glibc >> 16, ( container->glibc >> 8 ) & 0xff);
+                ret = -1;
+            }
+        }
+        arena_restore(mark);
+    }
+
+    closedir(dp);
+    return(ret);
+}
+
+
+// What the cached answer depends on: the container's libc and the host
+// directories, each changing mtime as it is updated
+static char *hostlibs_cache_key(char *libc, char **dirs, int count) {
+    struct stat filestat;
+    char *key;
+    int i;
+
+    if ( stat(libc, &filestat) < 0 ) {
+        return(NULL);
+    }
+    key = (char *) xmalloc(64);
+    snprintf(key, 64, "%lu.%lu.%lu", (unsigned long) filestat.st_ino, (unsigned long) filestat.st_size, (unsigned long) filestat.st_mtime); // Flawfinder: ignore
+
+    for ( i = 0; i < count; i++ ) {
+        unsigned long mtime = 0;
+        if ( stat(dirs[i], &filestat) == 0 ) {
+            mtime = (unsigned long) filestat.st_mtime;
+        }
+        key = strjoin(key, strjoin(" ", strjoin(dirs[i], strjoin(":", int2str((int) mtime)))));
+    }
+
+    return(key);
+}
+
+
+/*
+ * Return those of the 'host lib path' directories whose libraries the
+ * container rooted at rootpath can load, using and refreshing cachefile.
+ */
+char **hostlibs_compatible(char *rootpath, char *cachefile, int *count) {
+    struct hostlibs_abi container;
+    char line[PATH_MAX + 2] = ""; // Flawfinder: ignore
+    char **dirs;
+    char **ok;
+    char *libc;
+    char *key;
+    FILE *cache_fp;
+    int dir_count;
+    int i;
+
+    *count = 0;
+    if ( ( dir_count = config_get_key_list("host lib path", &dirs) ) <= 0 ) {
+        return(NULL);
+    }
+    for ( i = 0; i < dir_count; i++ ) {
+        chomp(dirs[i]);
+    }
+    ok = (char **) xmalloc(sizeof(char *) * ( dir_count + 1 ));
+
+    if ( ( libc = hostlibs_find_libc(rootpath) ) == NULL ) {
+        message(WARNING, "Container has no dynamic libc, not injecting host libraries\n");
+        return(NULL);
+    }
+    key = hostlibs_cache_key(libc, dirs, dir_count);
+
+    message(DEBUG, "Checking host library cache: %s\n", cachefile);
+    if ( key != NULL && ( cache_fp = fopen(cachefile, "re") ) != NULL ) { // Flawfinder: ignore
+        if ( fgets(line, sizeof(line), cache_fp) != NULL ) {
+            chomp(line);
+        }
+        if ( strcmp(line, key) == 0 ) {
+            while ( fgets(line, sizeof(line), cache_fp) != NULL && *count < dir_count ) {
+                chomp(line);
+                ok[(*count)++] = xstrdup(line);
+            }
+            fclose(cache_fp);
+            ok[*count] = NULL;
+            message(VERBOSE2, "Using %d cached host library directories\n", *count);
+            return(ok);
+        }
+        fclose(cache_fp);
+    }
+
+    message(VERBOSE, "Checking host libraries against the container's libc: %s\n", libc);
+    if ( hostlibs_elf_abi(libc, &container) < 0 || container.glibc == 0 ) {
+        message(WARNING, "Could not read the ABI of the container's libc, not injecting host libraries\n");
+        return(NULL);
+    }
+    for ( i = 0; i < dir_count; i++ ) {
+        if ( is_dir(dirs[i]) != 0 ) {
+            message(WARNING, "Non existent 'host lib path': %s\n", dirs[i]);
+        } else if ( hostlibs_check_dir(dirs[i], &container) == 0 ) {
+            ok[(*count)++] = dirs[i];
+        }
+    }
+    ok[*count] = NULL;
+
+    if ( key != NULL && s_mkpath(dirname(xstrdup(cachefile)), 0755) == 0 ) {
+        char *tmpfile = strjoin(cachefile, ".XXXXXX");
+        int fd;
+
+        // Not the pid for a name: the container process is pid 1 of its
+        // namespace in every launch
+        if ( ( fd = mkostemp(tmpfile, O_CLOEXEC) ) >= 0 && ( cache_fp = fdopen(fd, "w") ) != NULL ) {
+            fprintf(cache_fp, "%s\n", key);
+            for ( i = 0; i < *count; i++ ) {
+                fprintf(cache_fp, "%s\n", ok[i]);
+            }
+            if ( fclose(cache_fp) != 0 || rename(tmpfile, cachefile) < 0 ) {
+                message(VERBOSE, "Could not write host library cache %s: %s\n", cachefile, strerror(errno));
+                unlink(tmpfile);
+            }
+        }
+    }
+
+    return(ok);
+}
+
+
+/*
+ * Put the host library directories mounted in this container, if any,
+ * first in the dynamic linker's search path.  Called after the chroot.
+ */
+void hostlibs_environment(void) {
+    char *dir;
+    char *path = NULL;
+    char *old;
+    int i;
+
+    if ( ( dir = config_get_key_value("host lib dir") ) == NULL ) {
+        dir = HOSTLIBS_DIR;
+    }
+
+    for ( i = 0; is_dir(joinpath(dir, int2str(i))) == 0; i++ ) {
+        path = ( path == NULL ) ? joinpath(dir, int2str(i)) : strjoin(path, strjoin(":", joinpath(dir, int2str(i))));
+    }
+    if ( path == NULL ) {
+        return;
+    }
+
+    if ( ( old = getenv("LD_LIBRARY_PATH") ) != NULL && old[0] != '\0' ) { // Flawfinder: ignore (prepending to the user's own value)
+        path = strjoin(path, strjoin(":", old));
+    }
+    message(DEBUG, "Setting LD_LIBRARY_PATH=%s\n", path);
+    setenv("LD_LIBRARY_PATH", path, 1);
+}
@@ -0,0 +1,288 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pwd.h>
+#include <grp.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "identity.h"
+#include "config_parser.h"
+#include "util.h"
+#include "file.h"
+#include "message.h"
+
+#ifndef LOCALSTATEDIR
+#define LOCALSTATEDIR "/etc"
+#endif
+
+
+/*
+ * At sites where passwd and group come from LDAP or SSSD every getpwuid()
+ * and getgrgid() can be a directory query, and a job array starting
+ * thousands of containers at once makes a storm of them.  The answers for
+ * a (uid, gid, supplementary groups) set are looked up once per process,
+ * and kept for 'identity cache ttl' seconds in a root owned file below
+ * 'identity cache' that later launches on the node read instead.  The file
+ * holds the key followed by the passwd line and one name:x:gid line per
+ * group, just what the staged passwd and group files need.
+ */
+
+static struct identity *identity = NULL;
+
+
+static char *identity_key(uid_t uid, gid_t gid, gid_t *gids, int count) {
+    char *key = strjoin(int2str(uid), strjoin(" ", int2str(gid)));
+    int i;
+
+    for ( i = 0; i < count; i++ ) {
+        key = strjoin(key, strjoin(" ", int2str(gids[i])));
+    }
+
+    return(key);
+}
+
+// FNV-1a, to name the cache file after a key of any length
+static char *identity_file(char *key) {
+    unsigned long hash = 2166136261UL;
+    char *name = (char *) xmalloc(32);
+    char *p;
+
+    for ( p = key; *p != '\0'; p++ ) {
+        hash = ( hash ^ (unsigned char) *p ) * 16777619UL;
+    }
+    snprintf(name, 32, "%s.%08lx", strtok(xstrdup(key), " "), hash & 0xffffffffUL); // Flawfinder: ignore
+
+    return(name);
+}
+
+
+static void identity_add_group(struct identity *id, gid_t gid, char *name) {
+    int i;
+
+    for ( i = 0; i < id->group_count; i++ ) {
+        if ( id->groups[i].gid == gid ) {
+            return;
+        }
+    }
+    id->groups[id->group_count].gid = gid;
+    id->groups[id->group_count].name = xstrdup(name);
+    id->group_count++;
+}
+
+
+static struct identity *identity_lookup(gid_t *gids, int count) {
+    struct identity *id = (struct identity *) xmalloc(sizeof(struct identity));
+    struct passwd *pwent;
+    struct group *grent;
+    int i;
+
+    id->uid = getuid();
+    id->gid = getgid();
+
+    message(DEBUG, "Looking up account information for uid %ld\n", (long) id->uid);
+    if ( ( pwent = getpwuid(id->uid) ) == NULL ) {
+        message(ERROR, "Could not get account information for uid %ld: %s\n", (long) id->uid, strerror(errno));
+        ABORT(255);
+    }
+    id->name = xstrdup(pwent->pw_name);
+    id->gecos = xstrdup(pwent->pw_gecos);
+    id->dir = xstrdup(pwent->pw_dir);
+    id->shell = xstrdup(pwent->pw_shell);
+
+    id->groups = (struct identity_group *) xmalloc(sizeof(struct identity_group) * ( count + 1 ));
+    id->group_count = 0;
+
+    if ( ( grent = getgrgid(id->gid) ) == NULL ) {
+        message(ERROR, "Could not get group information for gid %ld: %s\n", (long) id->gid, strerror(errno));
+        ABORT(255);
+    }
+    identity_add_group(id, grent->gr_gid, grent->gr_name);
+
+    for ( i = 0; i < count; i++ ) {
+        message(VERBOSE3, "Found supplementary group membership in: %d\n", gids[i]);
+        if ( ( grent = getgrgid(gids[i]) ) == NULL ) {
+            message(ERROR, "Could not get supplementary group information for gid %ld: %s\n", (long) gids[i], strerror(errno));
+            ABORT(255);
+        }
+        identity_add_group(id, grent->gr_gid, grent->gr_name);
+    }
+
+    return(id);
+}
+
+
+// Split a ':' separated line in place, keeping empty fields
+static int identity_fields(char *line, char **fields, int max) {
+    int count = 0;
+    char *p;
+
+    chomp(line);
+    while ( count < max && ( p = strsep(&line, ":") ) != NULL ) {
+        fields[count++] = p;
+    }
+
+    return(count);
+}
+
+
+static struct identity *identity_read(char *path, char *key, long ttl, int max_groups) {
+    struct identity *id;
+    struct stat filestat;
+    char line[4096]; // Flawfinder: ignore
+    char *fields[7];
+    FILE *cache_fp;
+
+    if ( ( cache_fp = fopen(path, "re") ) == NULL ) { // Flawfinder: ignore
+        return(NULL);
+    }
+    // Only trust what root wrote, and only while it is fresh
+    if ( fstat(fileno(cache_fp), &filestat) < 0 || ! S_ISREG(filestat.st_mode) || filestat.st_uid != 0 ||
+            ( filestat.st_mode & ( S_IWGRP | S_IWOTH ) ) != 0 || time(NULL) - filestat.st_mtime > ttl ) {
+        fclose(cache_fp);
+        return(NULL);
+    }
+
+    if ( fgets(line, sizeof(line), cache_fp) == NULL ) {
+        fclose(cache_fp);
+        return(NULL);
+    }
+    chomp(line);
+    if ( strcmp(line, key) != 0 || fgets(line, sizeof(line), cache_fp) == NULL || identity_fields(line, fields, 7) != 7 ) {
+        fclose(cache_fp);
+        return(NULL);
+    }
+
+    id = (struct identity *) xmalloc(sizeof(struct identity));
+    id->uid = getuid();
+    id->gid = getgid();
+    id->name = xstrdup(fields[0]);
+    id->gecos = xstrdup(fields[4]);
+    id->dir = xstrdup(fields[5]);
+    id->shell = xstrdup(fields[6]);
+    id->groups = (struct identity_group *) xmalloc(sizeof(struct identity_group) * ( max_groups + 1 ));
+    id->group_count = 0;
+
+    while ( id->group_count < max_groups + 1 && fgets(line, sizeof(line), cache_fp) != NULL ) {
+        if ( identity_fields(line, fields, 3) == 3 ) {
+            identity_add_group(id, (gid_t) strtoul(fields[2], NULL, 10), fields[0]);
+        }
+    }
+    fclose(cache_fp);
+
+    if ( id->group_count == 0 || id->groups[0].gid != id->gid ) {
+        return(NULL);
+    }
+    return(id);
+}
+
+
+static void identity_write(char *path, char *key, struct identity *id) {
+    char *tmpfile = strjoin(path, ".XXXXXX");
+    FILE *cache_fp;
+    int fd;
+    int i;
+
+    if ( s_mkpath(dirname(xstrdup(path)), 0755) < 0 ) {
+        return;
+    }
+    // Not the pid for a name: the container process is pid 1 of its
+    // namespace in every launch
+    if ( ( fd = mkostemp(tmpfile, O_CLOEXEC) ) < 0 ) {
+        return;
+    }
+    fchmod(fd, 0644);
+    if ( ( cache_fp = fdopen(fd, "w") ) == NULL ) {
+        close(fd);
+        unlink(tmpfile);
+        return;
+    }
+
+    fprintf(cache_fp, "%s\n%s:x:%d:%d:%s:%s:%s\n", key, id->name, id->uid, id->gid, id->gecos, id->dir, id->shell);
+    for ( i = 0; i < id->group_count; i++ ) {
+        fprintf(cache_fp, "%s:x:%d\n", id->groups[i].name, id->groups[i].gid);
+    }
+    if ( fclose(cache_fp) != 0 || rename(tmpfile, path) < 0 ) {
+        message(VERBOSE, "Could not write identity cache %s: %s\n", path, strerror(errno));
+        unlink(tmpfile);
+    }
+}
+
+
+/*
+ * Return the calling user's account and groups, looking them up at most
+ * once per process and, with privileges, at most once per TTL per node.
+ */
+struct identity *identity_get(void) {
+    int maxgroups = sysconf(_SC_NGROUPS_MAX) + 1;
+    gid_t gids[maxgroups];
+    char *cachedir;
+    char *path = NULL;
+    char *key;
+    char *name;
+    long ttl;
+    int count;
+
+    if ( identity != NULL ) {
+        return(identity);
+    }
+
+    if ( ( count = getgroups(maxgroups, gids) ) < 0 ) {
+        message(ERROR, "Failed to get supplementary group list: %s\n", strerror(errno));
+        ABORT(255);
+    }
+    key = identity_key(getuid(), getgid(), gids, count);
+    name = identity_file(key);
+
+    if ( ( ttl = config_get_key_int("identity cache ttl", 300) ) > 0 ) {
+        if ( ( cachedir = config_get_key_value("identity cache") ) == NULL ) {
+            cachedir = LOCALSTATEDIR "/singularity/identity";
+        }
+        path = joinpath(cachedir, name);
+
+        message(DEBUG, "Checking identity cache: %s\n", path);
+        if ( ( identity = identity_read(path, key, ttl, count) ) != NULL ) {
+            message(VERBOSE2, "Using cached account information for %s\n", identity->name);
+            identity->key = name;
+            return(identity);
+        }
+    }
+
+    identity = identity_lookup(gids, count);
+    identity->key = name;
+
+    if ( path != NULL && geteuid() == 0 ) {
+        identity_write(path, key, identity);
+    }
+
+    return(identity);
+}
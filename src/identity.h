@@ -0,0 +1,44 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+
+#include <sys/types.h>
+
+struct identity_group {
+    gid_t gid;
+    char *name;
+};
+
+// The calling user as the container's passwd and group files see it;
+// groups[0] is the primary group.  key names the (uid, gid, groups) set.
+struct identity {
+    char *key;
+    uid_t uid;
+    gid_t gid;
+    char *name;
+    char *gecos;
+    char *dir;
+    char *shell;
+    int group_count;
+    struct identity_group *groups;
+};
+
+struct identity *identity_get(void);
@@ -151,7 +151,7 @@ int main(int argc, char ** argv) {
         }
 
 
-        if ( mount_image(loop_dev, mountpoint, 1) < 0 ) {
+        if ( mount_image(loop_dev, mountpoint, 1, NULL) < 0 ) {
             message(ERROR, "Failed mounting image...\n");
             ABORT(255);
         }
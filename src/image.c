@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 
+#include "config.h"
 #include "file.h"
 #include "image.h"
 #include "util.h"
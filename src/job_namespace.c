@@ -0,0 +1,250 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "job_namespace.h"
+#include "namespaces.h"
+#include "config_parser.h"
+#include "privilege.h"
+#include "util.h"
+#include "file.h"
+#include "message.h"
+
+
+/*
+ * Containers of one job, even of different images, can share a PID and an
+ * IPC namespace and a /dev/shm, so that shared memory and cross memory
+ * attach between them work as they would on the bare host.  The namespaces
+ * belong to a holder process, the init of the job's PID namespace, that
+ * does nothing but reap.  Every container of the job holds a shared lock on
+ * jobdir/members while it runs; once the holder can lock it exclusively
+ * the job is over, and the holder removes the job's shm directory and
+ * exits.  jobdir/holder carries the holder's pid and its shared lock, and
+ * the lock on jobdir itself serializes the members looking for a holder.
+ */
+
+#define JOB_HOLDER_STACK_SIZE (64 * 1024)
+
+struct job_holder_args {
+    char *jobdir;
+    char *shmdir;
+    int ready_fd;
+};
+
+// Held for as long as we run, so the holder stays up
+static int job_members_fd = -1;
+
+
+static int job_namespace_holder(void *arg) {
+    struct job_holder_args *args = (struct job_holder_args *) arg;
+    int holder_fd;
+    int members_fd;
+    int null_fd;
+    int fd;
+
+    if ( ( holder_fd = open(joinpath(args->jobdir, "holder"), O_RDONLY) ) < 0 || flock(holder_fd, LOCK_SH) < 0 ) { // Flawfinder: ignore
+        ABORT(255);
+    }
+    if ( ( members_fd = open(joinpath(args->jobdir, "members"), O_RDONLY) ) < 0 ) { // Flawfinder: ignore
+        ABORT(255);
+    }
+
+    // Hold on to nothing of the launching process, least of all its stdio,
+    // which an MPI launcher waits on
+    if ( ( null_fd = open("/dev/null", O_RDWR) ) < 0 ) { // Flawfinder: ignore
+        ABORT(255);
+    }
+    for ( fd = 0; fd < 3; fd++ ) {
+        dup2(null_fd, fd);
+    }
+    for ( fd = 3; fd < sysconf(_SC_OPEN_MAX); fd++ ) {
+        if ( fd != holder_fd && fd != members_fd && fd != args->ready_fd ) {
+            close(fd);
+        }
+    }
+    setsid();
+    if ( chdir("/") < 0 ) {
+        ABORT(255);
+    }
+
+    priv_drop_perm();
+
+    if ( mkdir(args->shmdir, 0700) < 0 && errno != EEXIST ) {
+        ABORT(255);
+    }
+    if ( write(args->ready_fd, "1", 1) != 1 ) {
+        ABORT(255);
+    }
+    close(args->ready_fd);
+
+    while ( flock(members_fd, LOCK_EX | LOCK_NB) < 0 ) {
+        sleep(1);
+        while ( waitpid(-1, NULL, WNOHANG) > 0 );
+    }
+
+    s_rmdir(args->shmdir);
+    return(0);
+}
+
+
+// Start the holder of a new job, returning its pid
+static pid_t job_namespace_start(char *jobdir, char *shmdir) {
+    struct job_holder_args args;
+    void *stack;
+    char ready;
+    int ready_pipe[2];
+    int flags = CLONE_NEWIPC;
+    pid_t pid;
+
+    if ( config_get_key_bool("allow pid ns", 1) > 0 ) {
+        flags |= CLONE_NEWPID;
+    }
+
+    if ( pipe2(ready_pipe, O_CLOEXEC) < 0 ) {
+        message(ERROR, "Could not create pipe: %s\n", strerror(errno));
+        ABORT(255);
+    }
+    if ( ( stack = mmap(NULL, JOB_HOLDER_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0) ) == MAP_FAILED ) {
+        message(ERROR, "Could not allocate job holder stack: %s\n", strerror(errno));
+        ABORT(255);
+    }
+
+    args.jobdir = jobdir;
+    args.shmdir = shmdir;
+    args.ready_fd = ready_pipe[1];
+    if ( ( pid = clone(job_namespace_holder, (char *) stack + JOB_HOLDER_STACK_SIZE, flags | SIGCHLD, &args) ) < 0 ) {
+        message(ERROR, "Could not create job namespaces: %s\n", strerror(errno));
+        ABORT(255);
+    }
+    munmap(stack, JOB_HOLDER_STACK_SIZE);
+    close(ready_pipe[1]);
+
+    if ( read(ready_pipe[0], &ready, 1) != 1 ) { // Flawfinder: ignore (one byte)
+        message(ERROR, "Job namespace holder failed to start\n");
+        ABORT(255);
+    }
+    close(ready_pipe[0]);
+
+    message(VERBOSE, "Started job namespace holder: %d\n", pid);
+    return(pid);
+}
+
+
+// Join the PID and IPC namespaces of the job in jobdir, starting them if
+// we are its first container.  Called with privileges escalated; returns
+// the job's shm directory, for job_namespace_shm().
+char *job_namespace_join(char *jobdir, char *shmdir) {
+    FILE *holder_fp;
+    pid_t pid = -1;
+    int dir_fd;
+    int holder_fd;
+    int proc_fd;
+
+    message(DEBUG, "Called job_namespace_join(%s, %s)\n", jobdir, shmdir);
+
+    if ( s_mkpath(jobdir, 0755) < 0 || is_owner(jobdir, 0, 0) < 0 ) {
+        message(ERROR, "Could not create job directory: %s\n", jobdir);
+        ABORT(255);
+    }
+
+    // Wait for a holder that is on its way out to be gone
+    if ( ( job_members_fd = open(joinpath(jobdir, "members"), O_RDONLY | O_CREAT | O_CLOEXEC, 0644) ) < 0 || flock(job_members_fd, LOCK_SH) < 0 ) { // Flawfinder: ignore
+        message(ERROR, "Could not lock job members file: %s\n", strerror(errno));
+        ABORT(255);
+    }
+    if ( ( dir_fd = open(jobdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) ) < 0 || flock(dir_fd, LOCK_EX) < 0 ) { // Flawfinder: ignore
+        message(ERROR, "Could not lock job directory: %s\n", strerror(errno));
+        ABORT(255);
+    }
+    if ( ( holder_fd = open(joinpath(jobdir, "holder"), O_RDWR | O_CREAT | O_CLOEXEC, 0644) ) < 0 || ( holder_fp = fdopen(holder_fd, "r+") ) == NULL ) { // Flawfinder: ignore
+        message(ERROR, "Could not open job holder file: %s\n", strerror(errno));
+        ABORT(255);
+    }
+
+    if ( flock(holder_fd, LOCK_EX | LOCK_NB) == 0 ) {
+        // Nobody holds the namespaces, so this is a new job
+        if ( ftruncate(holder_fd, 0) < 0 ) {
+            message(ERROR, "Could not truncate job holder file: %s\n", strerror(errno));
+            ABORT(255);
+        }
+        flock(holder_fd, LOCK_UN);
+        pid = job_namespace_start(jobdir, shmdir);
+        if ( namespace_record(holder_fp, pid) < 0 ) {
+            ABORT(255);
+        }
+        rewind(holder_fp);
+    }
+    if ( ( proc_fd = namespace_open(holder_fp, &pid, getuid()) ) < 0 ) {
+        message(ERROR, "Could not find the job namespace holder\n");
+        ABORT(255);
+    }
+    fclose(holder_fp);
+
+    message(VERBOSE, "Joining job namespaces of holder %d\n", pid);
+    namespace_join_ipc(pid, proc_fd);
+    namespace_join_pid(pid, proc_fd);
+    close(proc_fd);
+    close(dir_fd);
+
+    message(DEBUG, "Return job_namespace_join() = %s\n", shmdir);
+    return(shmdir);
+}
+
+
+// Open the job's shm directory to bind from /proc/self/fd, or return -1 if
+// it is not a directory of the user.  The user can replace the entry in
+// /dev/shm at any time, so the directory checked has to be the one bound:
+// call this in the mount namespace the bind goes into, as a mount of any
+// other one can not be bound through its fd.
+int job_namespace_shm(char *shmdir) {
+    struct stat shmstat;
+    int shm_fd;
+
+    message(DEBUG, "Called job_namespace_shm(%s)\n", shmdir);
+
+    if ( ( shm_fd = open(shmdir, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) ) < 0 ) { // Flawfinder: ignore
+        message(WARNING, "Not sharing job /dev/shm, could not open %s: %s\n", shmdir, strerror(errno));
+        return(-1);
+    }
+    if ( fstat(shm_fd, &shmstat) < 0 || ! S_ISDIR(shmstat.st_mode) || shmstat.st_uid != getuid() ) {
+        message(WARNING, "Not sharing job /dev/shm, %s is not a directory of the user\n", shmdir);
+        close(shm_fd);
+        return(-1);
+    }
+
+    message(DEBUG, "Return job_namespace_shm(%s) = %d\n", shmdir, shm_fd);
+    return(shm_fd);
+}
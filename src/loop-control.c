@@ -29,6 +29,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include "config.h"
 #include "loop-control.h"
@@ -36,11 +37,16 @@
 #include "file.h"
 #include "image.h"
 #include "message.h"
+#include "probes.h"
 
 #ifndef LO_FLAGS_AUTOCLEAR
 #define LO_FLAGS_AUTOCLEAR 4
 #endif
 
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
 #define MAX_LOOP_DEVS 128
 
 
@@ -73,8 +79,10 @@ int loop_bind(FILE *image_fp, char **loop_dev, int autoclear) {
         }
 
         message(VERBOSE2, "Attempting to associate image pointer to loop device\n");
+        PROBE2(loop__attach, test_loopdev, i);
         if ( ioctl(fileno(loop_fp), LOOP_SET_FD, fileno(image_fp)) < 0 ) {
             if ( errno == 16 ) {
+                PROBE2(loop__busy, test_loopdev, i);
                 message(VERBOSE3, "Loop device is in use: %s\n", test_loopdev);
                 if (fclose(loop_fp)) {
                     message(ERROR, "Could not close loop device: %s\n",
@@ -103,6 +111,7 @@ int loop_bind(FILE *image_fp, char **loop_dev, int autoclear) {
             ABORT(255);
         }
         *loop_dev = xstrdup(test_loopdev);
+        PROBE2(loop__attached, *loop_dev, i);
 
         message(VERBOSE, "Using loop device: %s\n", *loop_dev);
 
@@ -146,6 +155,54 @@ int loop_free(char *loop_dev) {
 }
 
 
+int loop_set_direct_io(char *loop_dev) {
+    int loop_fd;
+
+    message(DEBUG, "Called loop_set_direct_io(%s)\n", loop_dev);
+
+    if ( ( loop_fd = open(loop_dev, O_RDONLY) ) < 0 ) { // Flawfinder: ignore (only opening read only, and must be a block device)
+        message(WARNING, "Could not open loop device %s: %s\n", loop_dev, strerror(errno));
+        return(-1);
+    }
+
+    message(VERBOSE2, "Enabling direct I/O on loop device: %s\n", loop_dev);
+    if ( ioctl(loop_fd, LOOP_SET_DIRECT_IO, 1) < 0 ) {
+        // Needs a recent kernel and a backing file system supporting O_DIRECT
+        message(WARNING, "Could not enable direct I/O on %s: %s\n", loop_dev, strerror(errno));
+        close(loop_fd);
+        return(-1);
+    }
+
+    close(loop_fd);
+    message(DEBUG, "Returning loop_set_direct_io(%s) = 0\n", loop_dev);
+    return(0);
+}
+
+
+int loop_set_read_ahead(char *loop_dev, long kbytes) {
+    int loop_fd;
+
+    message(DEBUG, "Called loop_set_read_ahead(%s, %ld)\n", loop_dev, kbytes);
+
+    if ( ( loop_fd = open(loop_dev, O_RDONLY) ) < 0 ) { // Flawfinder: ignore (only opening read only, and must be a block device)
+        message(WARNING, "Could not open loop device %s: %s\n", loop_dev, strerror(errno));
+        return(-1);
+    }
+
+    // BLKRASET takes 512 byte sectors
+    message(VERBOSE2, "Setting read ahead on loop device %s to %ld KiB\n", loop_dev, kbytes);
+    if ( ioctl(loop_fd, BLKRASET, (unsigned long) kbytes * 2) < 0 ) {
+        message(WARNING, "Could not set read ahead on %s: %s\n", loop_dev, strerror(errno));
+        close(loop_fd);
+        return(-1);
+    }
+
+    close(loop_fd);
+    message(DEBUG, "Returning loop_set_read_ahead(%s, %ld) = 0\n", loop_dev, kbytes);
+    return(0);
+}
+
+
 // Leaving the below code intact for comparasion and reference
 /*
 char * obtain_loop_dev(void) {
@@ -21,3 +21,5 @@
 
 int loop_bind(FILE *image_fp, char **loop_dev, int autoclear);
 int loop_free(char *loop_dev);
+int loop_set_direct_io(char *loop_dev);
+int loop_set_read_ahead(char *loop_dev, long kbytes);
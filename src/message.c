@@ -38,7 +38,8 @@ extern const char *__progname;
 void init(void) {
     char *messagelevel_string = getenv("MESSAGELEVEL"); // Flawfinder: ignore (need to get string, validation in atol())
 
-    openlog("Singularity", LOG_CONS | LOG_NDELAY, LOG_LOCAL0);
+    // No LOG_NDELAY: syslog() connects with the first record it sends
+    openlog("Singularity", LOG_CONS, LOG_LOCAL0);
 
     if ( messagelevel_string == NULL ) {
         messagelevel = 1;
@@ -58,42 +59,47 @@ void init(void) {
 void _message(int level, const char *function, const char *file, int line, char *format, ...) {
     int syslog_level = LOG_NOTICE;
     char message[512]; // Flawfinder: ignore (messages are truncated to 512 chars)
-    char *prefix = "";
+    char header_string[200]; // Flawfinder: ignore (bounded by sizeof)
+    const char *prefix;
     va_list args;
-    va_start (args, format);
-
-    vsnprintf(message, 512, format, args); // Flawfinder: ignore (format is internally defined)
-
-    va_end (args);
 
     if ( messagelevel == -1 ) {
         init();
     }
 
+    // Only syslog takes messages above the level being printed, and only
+    // those at LOG or more severe, so most calls stop here unformatted
+    if ( level > messagelevel && level > LOG ) {
+        return;
+    }
+    va_start (args, format);
+    vsnprintf(message, sizeof(message), format, args); // Flawfinder: ignore (format is internally defined)
+    va_end (args);
+
     switch (level) {
         case ABRT:
-            prefix = xstrdup("ABORT");
+            prefix = "ABORT";
             syslog_level = LOG_ALERT;
             break;
         case ERROR:
-            prefix = xstrdup("ERROR");
+            prefix = "ERROR";
             syslog_level = LOG_ERR;
             break;
         case  WARNING:
-            prefix = xstrdup("WARNING");
+            prefix = "WARNING";
             syslog_level = LOG_WARNING;
             break;
         case LOG:
-            prefix = xstrdup("LOG");
+            prefix = "LOG";
             break;
         case DEBUG:
-            prefix = xstrdup("DEBUG");
+            prefix = "DEBUG";
             break;
         case INFO:
-            prefix = xstrdup("INFO");
+            prefix = "INFO";
             break;
         default:
-            prefix = xstrdup("VERBOSE");
+            prefix = "VERBOSE";
             break;
     }
 
@@ -105,33 +111,27 @@ void _message(int level, const char *function, const char *file, int line, char
     }
 
     if ( level <= messagelevel ) {
-        char *header_string;
-
         if ( messagelevel >= DEBUG ) {
-            char *debug_string = (char *) xmalloc(25);
-            char *location_string = (char *) xmalloc(60);
-            char *tmp_header_string = (char *) xmalloc(80);
-            header_string = (char *) xmalloc(80);
-            snprintf(location_string, 60, "%s:%d:%s()", file, line, function); // Flawfinder: ignore
-            snprintf(debug_string, 25, "[U=%d,P=%d]", geteuid(), getpid()); // Flawfinder: ignore
-            snprintf(tmp_header_string, 80, "%-18s %s", debug_string, location_string); // Flawfinder: ignore
-            snprintf(header_string, 80, "%-7s %-62s: ", prefix, tmp_header_string); // Flawfinder: ignore
-            free(debug_string);
-            free(location_string);
-            free(tmp_header_string);
+            // Room for any file:line:function() location without cutting it
+            char debug_string[25]; // Flawfinder: ignore (bounded by sizeof)
+            char location_string[160]; // Flawfinder: ignore (bounded by sizeof)
+            char tmp_header_string[185]; // Flawfinder: ignore (bounded by sizeof)
+            snprintf(location_string, sizeof(location_string), "%s:%d:%s()", file, line, function); // Flawfinder: ignore
+            snprintf(debug_string, sizeof(debug_string), "[U=%d,P=%d]", geteuid(), getpid()); // Flawfinder: ignore
+            snprintf(tmp_header_string, sizeof(tmp_header_string), "%-18s %s", debug_string, location_string); // Flawfinder: ignore
+            snprintf(header_string, sizeof(header_string), "%-7s %-62s: ", prefix, tmp_header_string); // Flawfinder: ignore
         } else {
-            header_string = (char *) xmalloc(11);
             snprintf(header_string, 10, "%-7s: ", prefix); // Flawfinder: ignore
         }
 
         if ( level == INFO && messagelevel == INFO ) {
             printf("%s", message);
         } else if ( level == INFO ) {
-            printf("%s", strjoin(header_string, message));
+            printf("%s%s", header_string, message);
         } else if ( level == LOG && messagelevel <= INFO ) {
             // Don't print anything...
         } else {
-            fprintf(stderr, "%s", strjoin(header_string, message));
+            fprintf(stderr, "%s%s", header_string, message);
         }
 
 
@@ -34,5 +34,11 @@
 void _message(int level, const char *function, const char *file, int line, char *format, ...)  __attribute__ ((format (printf, 5, 6)));
 void singularity_abort(int retval);
 
+#ifdef SINGULARITY_NO_DEBUG_MESSAGES
+// Built with --disable-debug-messages: DEBUG calls, arguments and all,
+// compile to nothing
+#define message(a,b...) do { if ( (a) != DEBUG ) _message(a, __func__, __FILE__, __LINE__, b); } while (0)
+#else
 #define message(a,b...) _message(a, __func__, __FILE__, __LINE__, b)
+#endif
 
@@ -37,18 +37,108 @@
 #include "mounts.h"
 #include "file.h"
 #include "util.h"
+#include "arena.h"
 #include "loop-control.h"
 #include "message.h"
 #include "config_parser.h"
+#include "probes.h"
+#include "hostlibs.h"
+#include "identity.h"
 
 #ifndef MS_REC
 #define MS_REC 16384
 #endif
 
 
-int mount_image(char * loop_device, char * mount_point, int writable) {
+// Every mount goes through here so a tracer sees its flags and can time it
+static int s_mount(const char *source, const char *target, const char *type, unsigned long flags, const void *data) {
+    int ret;
 
-    message(DEBUG, "Called mount_image(%s, %s, %d)\n", loop_device, mount_point, writable);
+    PROBE4(mount__start, source, target, type, flags);
+    ret = mount(source, target, type, flags, data);
+    PROBE2(mount__done, target, ( ret < 0 ) ? errno : 0);
+
+    return(ret);
+}
+
+
+// Mount options that map to mount(2) flags rather than filesystem data
+static const struct {
+    const char *name;
+    unsigned long flag;
+} mount_flag_options[] = {
+    { "noatime",        MS_NOATIME },
+    { "nodiratime",     MS_NODIRATIME },
+#ifdef MS_RELATIME
+    { "relatime",       MS_RELATIME },
+#endif
+#ifdef MS_STRICTATIME
+    { "strictatime",    MS_STRICTATIME },
+#endif
+    { "sync",           MS_SYNCHRONOUS },
+    { "dirsync",        MS_DIRSYNC },
+    { "nodev",          MS_NODEV },
+    { "noexec",         MS_NOEXEC },
+    { NULL, 0 }
+};
+
+// Split a comma separated option string into mount(2) flags and the
+// filesystem specific data string (e.g. "nobarrier").
+static void mount_parse_options(char *options, unsigned long *flags, char **data) {
+    char *tmp;
+    char *opt;
+    char *saveptr = NULL;
+    size_t len;
+
+    *flags = 0;
+    *data = NULL;
+
+    if ( options == NULL ) {
+        return;
+    }
+
+    len = strlen(options) + 1;
+    *data = (char *) xmalloc(len);
+    (*data)[0] = '\0';
+
+    tmp = xstrdup(options);
+    for ( opt = strtok_r(tmp, ",", &saveptr); opt != NULL; opt = strtok_r(NULL, ",", &saveptr) ) {
+        int i;
+
+        while ( *opt == ' ' ) {
+            opt++;
+        }
+        chomp(opt);
+        if ( opt[0] == '\0' ) {
+            continue;
+        }
+
+        for ( i = 0; mount_flag_options[i].name != NULL; i++ ) {
+            if ( strcmp(mount_flag_options[i].name, opt) == 0 ) {
+                *flags |= mount_flag_options[i].flag;
+                break;
+            }
+        }
+
+        if ( mount_flag_options[i].name == NULL ) {
+            if ( (*data)[0] != '\0' ) {
+                strncat(*data, ",", len - strlen(*data) - 1); // Flawfinder: ignore (bounded by len)
+            }
+            strncat(*data, opt, len - strlen(*data) - 1); // Flawfinder: ignore (bounded by len)
+        }
+    }
+    free(tmp);
+
+    message(DEBUG, "Parsed mount options '%s' to flags 0x%lx, data '%s'\n", options, *flags, *data);
+}
+
+
+int mount_image(char * loop_device, char * mount_point, int writable, char *options) {
+    unsigned long flags;
+    char *data;
+    char *discard_data;
+
+    message(DEBUG, "Called mount_image(%s, %s, %d, %s)\n", loop_device, mount_point, writable, options ? options : "");
 
     message(DEBUG, "Checking mount point is present\n");
     if ( is_dir(mount_point) < 0 ) {
@@ -62,13 +152,22 @@ int mount_image(char * loop_device, char * mount_point, int writable) {
         ABORT(255);
     }
 
+    mount_parse_options(options, &flags, &data);
+    if ( data == NULL || data[0] == '\0' ) {
+        data = "";
+        discard_data = "discard";
+    } else {
+        discard_data = strjoin("discard,", data);
+    }
+    flags |= MS_NOSUID;
+
     if ( writable > 0 ) {
         message(DEBUG, "Trying to mount read/write as ext4 with discard option\n");
-        if ( mount(loop_device, mount_point, "ext4", MS_NOSUID, "discard") < 0 ) {
+        if ( s_mount(loop_device, mount_point, "ext4", flags, discard_data) < 0 ) {
             message(DEBUG, "Trying to mount read/write as ext4 without discard option\n");
-            if ( mount(loop_device, mount_point, "ext4", MS_NOSUID, "") < 0 ) {
+            if ( s_mount(loop_device, mount_point, "ext4", flags, data) < 0 ) {
                 message(DEBUG, "Trying to mount read/write as ext3\n");
-                if ( mount(loop_device, mount_point, "ext3", MS_NOSUID, "") < 0 ) {
+                if ( s_mount(loop_device, mount_point, "ext3", flags, data) < 0 ) {
                     message(ERROR, "Failed to mount (rw) '%s' at '%s': %s\n", loop_device, mount_point, strerror(errno));
                     ABORT(255);
                 }
@@ -76,11 +175,11 @@ int mount_image(char * loop_device, char * mount_point, int writable) {
         }
     } else {
         message(DEBUG, "Trying to mount read only as ext4 with discard option\n");
-        if ( mount(loop_device, mount_point, "ext4", MS_NOSUID|MS_RDONLY, "discard") < 0 ) {
+        if ( s_mount(loop_device, mount_point, "ext4", flags|MS_RDONLY, discard_data) < 0 ) {
             message(DEBUG, "Trying to mount read only as ext4 without discard option\n");
-            if ( mount(loop_device, mount_point, "ext4", MS_NOSUID|MS_RDONLY, "") < 0 ) {
+            if ( s_mount(loop_device, mount_point, "ext4", flags|MS_RDONLY, data) < 0 ) {
                 message(DEBUG, "Trying to mount read only as ext3\n");
-                if ( mount(loop_device, mount_point, "ext3", MS_NOSUID|MS_RDONLY, "") < 0 ) {
+                if ( s_mount(loop_device, mount_point, "ext3", flags|MS_RDONLY, data) < 0 ) {
                     message(ERROR, "Failed to mount (ro) '%s' at '%s': %s\n", loop_device, mount_point, strerror(errno));
                     ABORT(255);
                 }
@@ -99,26 +198,26 @@ void mount_bind(char * source, char * dest, int writable) {
     message(DEBUG, "Called mount_bind(%s, %s, %d)\n", source, dest, writable);
 
     message(DEBUG, "Checking that source exists and is a file or directory\n");
-    if ( is_dir(source) != 0 && is_file(source) != 0 ) {
+    if ( is_file_or_dir_at(AT_FDCWD, source) != 0 ) {
         message(ERROR, "Bind source path is not a file or directory: '%s'\n", source);
         ABORT(255);
     }
 
     message(DEBUG, "Checking that destination exists and is a file or directory\n");
-    if ( is_dir(dest) != 0 && is_file(dest) != 0 ) {
+    if ( is_file_or_dir_at(AT_FDCWD, dest) != 0 ) {
         message(ERROR, "Container bind path is not a file or directory: '%s'\n", dest);
         ABORT(255);
     }
 
     message(DEBUG, "Calling mount(%s, %s, ...)\n", source, dest);
-    if ( mount(source, dest, NULL, MS_BIND|MS_NOSUID|MS_REC, NULL) < 0 ) {
+    if ( s_mount(source, dest, NULL, MS_BIND|MS_NOSUID|MS_REC, NULL) < 0 ) {
         message(ERROR, "Could not bind %s: %s\n", dest, strerror(errno));
         ABORT(255);
     }
 
     if ( writable <= 0 ) {
         message(VERBOSE2, "Making mount read only: %s\n", dest);
-        if ( mount(NULL, dest, NULL, MS_BIND|MS_REC|MS_REMOUNT|MS_RDONLY, NULL) < 0 ) {
+        if ( s_mount(NULL, dest, NULL, MS_BIND|MS_REC|MS_REMOUNT|MS_RDONLY, NULL) < 0 ) {
             message(ERROR, "Could not bind read only %s: %s\n", dest, strerror(errno));
             ABORT(255);
         }
@@ -127,25 +226,18 @@ void mount_bind(char * source, char * dest, int writable) {
 }
 
 
-void mount_home(char *rootpath) {
+void mount_home(char *rootpath, int rootfd) {
     char *homedir;
     char *homedir_base;
-    struct passwd *pw;
-
-    // TODO: Functionize this
-    if ( !(pw = getpwuid(getuid())) ) {
-        message(ERROR, "Failed to get passwd info: %s\n", strerror(errno));
-        ABORT(255);
-    }
 
     message(DEBUG, "Obtaining user's homedir\n");
-    homedir = pw->pw_dir;
+    homedir = identity_get()->dir;
 
-    if ( ( homedir_base = container_basedir(rootpath, homedir) ) != NULL ) {
+    if ( ( homedir_base = container_basedir(rootfd, homedir) ) != NULL ) {
         if ( is_dir(homedir_base) == 0 ) {
-            if ( is_dir(joinpath(rootpath, homedir_base)) == 0 ) {
+            if ( is_dir_at(rootfd, homedir_base) == 0 ) {
                 message(VERBOSE, "Mounting home directory base path: %s\n", homedir_base);
-                if ( mount(homedir_base, joinpath(rootpath, homedir_base), NULL, MS_BIND|MS_NOSUID|MS_REC, NULL) < 0 ) {
+                if ( s_mount(homedir_base, joinpath(rootpath, homedir_base), NULL, MS_BIND|MS_NOSUID|MS_REC, NULL) < 0 ) {
                     ABORT(255);
                 }
             } else {
@@ -154,57 +246,117 @@ void mount_home(char *rootpath) {
         } else {
             message(WARNING, "Home directory base source path does not exist: %s\n", homedir_base);
         }
+        free(homedir_base);
     }
 
 }
 
 
-void bind_paths(char *rootpath) {
-    char *tmp_config_string;
-    message(DEBUG, "Checking configuration file for 'bind path'\n");
-    config_rewind();
-    while ( ( tmp_config_string = config_get_key_value("bind path") ) != NULL ) {
-        char *source = strtok(tmp_config_string, ",");
-        char *dest = strtok(NULL, ",");
-        chomp(source);
-        if ( dest == NULL ) {
-            dest = xstrdup(source);
-        } else {
-            if ( dest[0] == ' ' ) {
-                dest++;
-            }
-            chomp(dest);
-        }
+static void bind_path(char *rootpath, int rootfd, char *source, char *dest) {
+    struct arena_mark mark;
 
-        message(VERBOSE2, "Found 'bind path' = %s, %s\n", source, dest);
+    message(VERBOSE2, "Found 'bind path' = %s, %s\n", source, dest);
 
 // TODO: Make sure this isn't already mounted
 //        if ( ( homedir_base != NULL ) && ( strncmp(dest, homedir_base, strlength(homedir_base, 256)) == 0 )) {
 //            // Skipping path as it was already mounted as homedir_base
 //            message(VERBOSE2, "Skipping '%s' as it is part of home path and already mounted\n", dest);
-//            continue;
+//            return;
 //        }
 
-        if ( ( is_file(source) != 0 ) && ( is_dir(source) != 0 ) ) {
-            message(WARNING, "Non existent 'bind path' source: '%s'\n", source);
-            continue;
-        }
-        if ( ( is_file(joinpath(rootpath, dest)) != 0 ) && ( is_dir(joinpath(rootpath, dest)) != 0 ) ) {
-            message(WARNING, "Non existent 'bind point' in container: '%s'\n", dest);
-            continue;
-        }
+    if ( is_file_or_dir_at(AT_FDCWD, source) != 0 ) {
+        message(WARNING, "Non existent 'bind path' source: '%s'\n", source);
+        return;
+    }
+    if ( is_file_or_dir_at(rootfd, dest) != 0 ) {
+        message(WARNING, "Non existent 'bind point' in container: '%s'\n", dest);
+        return;
+    }
 
-        message(VERBOSE, "Binding '%s' to '%s/%s'\n", source, rootpath, dest);
-        if ( mount(source, joinpath(rootpath, dest), NULL, MS_BIND|MS_NOSUID|MS_REC, NULL) < 0 ) {
-            ABORT(255);
-        }
+    message(VERBOSE, "Binding '%s' to '%s/%s'\n", source, rootpath, dest);
+    mark = arena_save();
+    if ( s_mount(source, joinpath(rootpath, dest), NULL, MS_BIND|MS_NOSUID|MS_REC, NULL) < 0 ) {
+        ABORT(255);
+    }
+    arena_restore(mark);
 //        message(VERBOSE2, "Making mount read only: %s\n", dest);
 //        if ( mount(NULL, dest, NULL, MS_BIND|MS_REC|MS_REMOUNT|MS_RDONLY, NULL) < 0 ) {
 //            message(ERROR, "Could not bind read only %s: %s\n", dest, strerror(errno));
 //            ABORT(255);
 //        }
+}
+
+void bind_paths(char *rootpath, int rootfd) {
+    char **bind_list;
+    int bind_count;
+    int i;
+
+    message(DEBUG, "Checking configuration file for 'bind path'\n");
+    bind_count = config_get_key_list("bind path", &bind_list);
+    for ( i = 0; i < bind_count; i++ ) {
+        char *tmp_config_string = xstrdup(bind_list[i]);
+        char *source = strtok(tmp_config_string, ",");
+        char *dest = strtok(NULL, ",");
+
+        if ( source == NULL ) {
+            message(WARNING, "Ignoring empty 'bind path' entry\n");
+        } else {
+            chomp(source);
+            if ( dest == NULL ) {
+                dest = source;
+            } else {
+                if ( dest[0] == ' ' ) {
+                    dest++;
+                }
+                chomp(dest);
+            }
+            bind_path(rootpath, rootfd, source, dest);
+        }
+
+        // Everything above points into this copy of the entry
+        free(tmp_config_string);
     }
 
 }
 
 
+void mount_hostlibs(char *rootpath, int rootfd, char *cachefile) {
+    char **dirs;
+    char *dest;
+    char *base;
+    int count;
+    int i;
+
+    if ( ( dirs = hostlibs_compatible(rootpath, cachefile, &count) ) == NULL || count == 0 ) {
+        return;
+    }
+
+    message(DEBUG, "Checking configuration file for 'host lib dir'\n");
+    if ( ( dest = config_get_key_value("host lib dir") ) == NULL ) {
+        dest = HOSTLIBS_DIR;
+    }
+    if ( is_dir_at(rootfd, dest) != 0 ) {
+        message(WARNING, "Container has no %s to inject host libraries into\n", dest);
+        return;
+    }
+
+    // The image is read only, so the numbered bind points go on a tmpfs
+    message(DEBUG, "Mounting tmpfs for host libraries on %s\n", dest);
+    base = joinpath(rootpath, dest);
+    if ( s_mount("tmpfs", base, "tmpfs", MS_NOSUID|MS_NODEV, "mode=0755,size=64k") < 0 ) {
+        message(ERROR, "Could not mount tmpfs on %s: %s\n", dest, strerror(errno));
+        ABORT(255);
+    }
+    for ( i = 0; i < count; i++ ) {
+        struct arena_mark mark = arena_save();
+        char *point = joinpath(base, int2str(i));
+
+        if ( mkdir(point, 0755) < 0 ) {
+            message(ERROR, "Could not create host library bind point %s: %s\n", point, strerror(errno));
+            ABORT(255);
+        }
+        message(VERBOSE, "Binding host libraries '%s' to '%s/%s'\n", dirs[i], dest, int2str(i));
+        mount_bind(dirs[i], point, 0);
+        arena_restore(mark);
+    }
+}
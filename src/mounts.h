@@ -19,7 +19,10 @@
  */
 
 
-int mount_image(char * image_path, char * mount_point, int writable);
+int mount_image(char * image_path, char * mount_point, int writable, char *options);
 void mount_bind(char * source, char * dest, int writable);
-void mount_home(char *rootpath);
-void bind_paths(char *rootpath);
+// rootfd is rootpath opened as a directory; checks are made relative to
+// it, and rootpath is only used to name mount points
+void mount_home(char *rootpath, int rootfd);
+void bind_paths(char *rootpath, int rootfd);
+void mount_hostlibs(char *rootpath, int rootfd, char *cachefile);
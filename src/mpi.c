@@ -0,0 +1,163 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/file.h>
+
+#include "config.h"
+#include "mpi.h"
+#include "util.h"
+#include "message.h"
+#include "namespaces.h"
+
+
+/*
+ * Node local sharing of one container setup between the ranks of an MPI
+ * job.  Ranks find each other through a job file in the session directory,
+ * named after the user and the job identifier their launcher exports, so
+ * naming another user's job joins nothing.  The first rank to take an
+ * exclusive lock on it builds the container, records its container process
+ * and downgrades the lock to shared once the mount namespace is complete;
+ * every later rank waits for a shared lock, checks that process is still
+ * the one recorded and joins its namespace.
+ */
+
+// Set by the launchers we know for every rank, with the node local rank
+static const char *mpi_rank_vars[] = {
+    "OMPI_COMM_WORLD_LOCAL_RANK",   // Open MPI
+    "MPI_LOCALRANKID",              // MPICH and Intel MPI (Hydra)
+    "MV2_COMM_WORLD_LOCAL_RANK",    // MVAPICH2
+    "PMIX_LOCAL_RANK",              // PMIx
+    "SLURM_LOCALID",                // srun
+    NULL
+};
+
+// The same for every rank of one job, and different between jobs
+static const char *mpi_job_vars[] = {
+    "PMIX_NAMESPACE",
+    "OMPI_MCA_ess_base_jobid",
+    "OMPI_MCA_orte_ess_jobid",
+    "PMI_KVSNAME",
+    "SLURM_STEP_ID",
+    NULL
+};
+
+
+// The job identifier of this rank, safe to use in a file name, or NULL
+// when we were not started by a launcher we know.  SINGULARITY_JOB_ID
+// names the job explicitly.
+char *mpi_job_id(void) {
+    char *rank = NULL;
+    char *job = NULL;
+    char *id;
+    int i;
+    int j;
+
+    if ( ( job = getenv("SINGULARITY_JOB_ID") ) != NULL && job[0] != '\0' ) { // Flawfinder: ignore (only used as a file name, sanitized below)
+        id = xstrdup(job);
+    } else {
+        job = NULL;
+        for ( i = 0; mpi_rank_vars[i] != NULL && rank == NULL; i++ ) {
+            rank = getenv(mpi_rank_vars[i]); // Flawfinder: ignore
+        }
+        for ( j = 0; mpi_job_vars[j] != NULL && job == NULL; j++ ) {
+            job = getenv(mpi_job_vars[j]); // Flawfinder: ignore
+        }
+        if ( rank == NULL || job == NULL || job[0] == '\0' ) {
+            message(VERBOSE, "Not started by a known MPI launcher, not sharing the container setup\n");
+            return(NULL);
+        }
+        message(DEBUG, "MPI job %s, local rank %s\n", job, rank);
+
+        // A job step is only unique within its job
+        if ( strcmp(mpi_job_vars[j - 1], "SLURM_STEP_ID") == 0 && getenv("SLURM_JOB_ID") != NULL ) { // Flawfinder: ignore
+            id = strjoin(getenv("SLURM_JOB_ID"), strjoin(".", job)); // Flawfinder: ignore
+        } else {
+            id = xstrdup(job);
+        }
+    }
+
+    for ( i = 0; id[i] != '\0'; i++ ) {
+        if ( ! ( ( id[i] >= 'a' && id[i] <= 'z' ) || ( id[i] >= 'A' && id[i] <= 'Z' ) || ( id[i] >= '0' && id[i] <= '9' ) || id[i] == '.' || id[i] == '-' ) ) {
+            id[i] = '_';
+        }
+    }
+
+    return(id);
+}
+
+
+// Open the job file, returning it locked exclusively if we are the first
+// rank here, or NULL with the leader's container pid and an fd for it from
+// namespace_open() (-1 if it is gone)
+FILE *mpi_job_open(char *path, pid_t *leader_pid, int *leader_fd) {
+    FILE *job_fp;
+    int fd;
+
+    message(DEBUG, "Called mpi_job_open(%s)\n", path);
+    *leader_pid = -1;
+    *leader_fd = -1;
+
+    if ( ( fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644) ) < 0 ) { // Flawfinder: ignore (in the root owned session directory)
+        message(WARNING, "Could not open MPI job file %s: %s\n", path, strerror(errno));
+        return(NULL);
+    }
+    if ( ( job_fp = fdopen(fd, "r+") ) == NULL ) {
+        message(WARNING, "Could not open MPI job file %s: %s\n", path, strerror(errno));
+        close(fd);
+        return(NULL);
+    }
+
+    if ( flock(fd, LOCK_EX | LOCK_NB) == 0 ) {
+        message(VERBOSE, "First rank of this MPI job, setting up the container\n");
+        if ( ftruncate(fd, 0) < 0 ) {
+            message(WARNING, "Could not truncate MPI job file: %s\n", strerror(errno));
+        }
+        return(job_fp);
+    }
+
+    // Wait for the first rank to finish the setup, or to fail
+    message(VERBOSE, "Waiting for the first rank of this MPI job\n");
+    while ( flock(fd, LOCK_SH) < 0 ) {
+        if ( errno != EINTR ) {
+            message(WARNING, "Could not lock MPI job file: %s\n", strerror(errno));
+            fclose(job_fp);
+            return(NULL);
+        }
+    }
+    // The leader's container process may have exited since, and its PID
+    // been reused; namespace_open() only opens the very process recorded,
+    // and only if it is the calling user's
+    if ( ( *leader_fd = namespace_open(job_fp, leader_pid, getuid()) ) < 0 ) {
+        message(VERBOSE, "First rank of this MPI job is gone, setting up the container\n");
+    }
+    fclose(job_fp);
+
+    message(DEBUG, "Return mpi_job_open() = %d\n", *leader_pid);
+    return(NULL);
+}
@@ -28,7 +28,11 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <sched.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <poll.h>
 
+#include "config.h"
 #include "message.h"
 #include "config_parser.h"
 #include "util.h"
@@ -36,122 +40,269 @@
 #include "namespaces.h"
 
 
-void namespace_unshare(void) {
-    namespace_unshare_pid();
-    namespace_unshare_fs();
-    namespace_unshare_mount();
-}
-
-void namespace_join(pid_t daemon_pid) {
-    namespace_join_pid(daemon_pid);
-    namespace_join_mount(daemon_pid);
-    namespace_unshare_fs();
-}
+// Namespace flags for clone() when creating a fresh container process
+int namespace_clone_flags(void) {
+    int flags = CLONE_NEWNS;
 
-void namespace_unshare_pid(void) {
-    config_rewind();
 #ifdef NS_CLONE_NEWPID
     if ( ( getenv("SINGULARITY_NO_NAMESPACE_PID") == NULL ) && // Flawfinder: ignore (only checking for existance of envar)
             ( config_get_key_bool("allow pid ns", 1) > 0 ) ) {
-        unsetenv("SINGULARITY_NO_NAMESPACE_PID");
         message(DEBUG, "Virtualizing PID namespace\n");
-        if ( unshare(CLONE_NEWPID) < 0 ) {
-            message(ERROR, "Could not virtualize PID namespace: %s\n", strerror(errno));
-            ABORT(255);
-        }
+        flags |= CLONE_NEWPID;
     } else {
         message(VERBOSE, "Not virtualizing PID namespace\n");
     }
-#else
-#ifdef NS_CLONE_PID
-    if ( ( getenv("SINGULARITY_NO_NAMESPACE_PID") == NULL ) && // Flawfinder: ignore (only checking for existance of envar)
-            ( config_get_key_bool("allow pid ns", 1) > 0 ) ) {
-        unsetenv("SINGULARITY_NO_NAMESPACE_PID");
-        message(DEBUG, "Virtualizing PID namespace\n");
-        if ( unshare(CLONE_NEWPID) < 0 ) {
-            message(ERROR, "Could not virtualize PID namespace: %s\n", strerror(errno));
-            ABORT(255);
+#endif
+
+    message(DEBUG, "Virtualizing mount namespace\n");
+    return(flags);
+}
+
+
+// Check /proc/<pid>/status to see whether pid has a handler for sig, or
+// has it blocked: the kernel queues a blocked signal for a namespace init
+// as well, for it to take with sigwait() or a signalfd
+static int namespace_signal_caught(pid_t pid, int sig) {
+    char path[64]; // Flawfinder: ignore
+    char line[256]; // Flawfinder: ignore (bounded by fgets)
+    unsigned long long blocked = 0;
+    unsigned long long mask = 0;
+    FILE *status_fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid); // Flawfinder: ignore
+    if ( ( status_fp = fopen(path, "r") ) == NULL ) { // Flawfinder: ignore
+        return(-1);
+    }
+    while ( fgets(line, sizeof(line), status_fp) != NULL ) {
+        if ( sscanf(line, "SigBlk: %llx", &blocked) == 1 ) {
+            continue;
         }
+        if ( sscanf(line, "SigCgt: %llx", &mask) == 1 ) {
+            break;
+        }
+    }
+    fclose(status_fp);
+
+    mask |= blocked;
+    return( ( mask & ( 1ULL << ( sig - 1 ) ) ) ? 1 : 0 );
+}
+
+// Pass sig on to a container process.  The init of a new PID namespace
+// never sees signals it neither handles nor blocks, so escalate those to
+// SIGKILL rather than leaving it running.
+void namespace_signal(pid_t pid, int sig, int pid_ns) {
+    if ( pid_ns && namespace_signal_caught(pid, sig) == 0 ) {
+        message(VERBOSE, "Container init does not handle signal %d, sending SIGKILL\n", sig);
+        kill(pid, SIGKILL);
     } else {
-        message(VERBOSE, "Not virtualizing PID namespace\n");
+        message(VERBOSE, "Forwarding signal %d to container process %d\n", sig, pid);
+        kill(pid, sig);
     }
-#endif
-#endif
 }
 
-void namespace_unshare_fs(void) {
-#ifdef NS_CLONE_FS
-    // Setup FS namespaces
-    message(DEBUG, "Virtualizing FS namespace\n");
-    if ( unshare(CLONE_FS) < 0 ) {
-        message(ERROR, "Could not virtualize file system namespace: %s\n", strerror(errno));
-        ABORT(255);
+
+// Start time of the process behind the /proc/<pid> directory procfd, in
+// clock ticks since boot, or 0 if it can not be read.  Unlike the PID it
+// tells a process from a later one that reuses its PID.
+static unsigned long long namespace_proc_starttime(int procfd) {
+    char buf[512]; // Flawfinder: ignore (bounded by read)
+    unsigned long long starttime = 0;
+    ssize_t len;
+    char *field;
+    int fd;
+    int i;
+
+    if ( ( fd = openat(procfd, "stat", O_RDONLY | O_CLOEXEC) ) < 0 ) {
+        return(0);
     }
-#endif
+    len = read(fd, buf, sizeof(buf) - 1); // Flawfinder: ignore (bounded by sizeof)
+    close(fd);
+    if ( len <= 0 ) {
+        return(0);
+    }
+    buf[len] = '\0';
+
+    // The command name may hold spaces and parentheses, so count fields
+    // from its closing one: the start time is field 22, the state field 3
+    if ( ( field = strrchr(buf, ')') ) == NULL ) {
+        return(0);
+    }
+    for ( i = 2; i < 22 && field != NULL; i++ ) {
+        field = strchr(field + 1, ' ');
+    }
+    if ( field == NULL || sscanf(field + 1, "%llu", &starttime) != 1 ) {
+        return(0);
+    }
+
+    return(starttime);
 }
 
-void namespace_unshare_mount(void) {
-    // Setup mount namespaces
-    message(DEBUG, "Virtualizing mount namespace\n");
-    if ( unshare(CLONE_NEWNS) < 0 ) {
-        message(ERROR, "Could not virtualize mount namespace: %s\n", strerror(errno));
-        ABORT(255);
+// Real uid of the process behind the /proc/<pid> directory procfd
+static int namespace_proc_uid(int procfd, uid_t *uid) {
+    char line[256]; // Flawfinder: ignore (bounded by fgets)
+    unsigned int ruid;
+    FILE *status_fp;
+    int fd;
+    int ret = -1;
+
+    if ( ( fd = openat(procfd, "status", O_RDONLY | O_CLOEXEC) ) < 0 ) {
+        return(-1);
     }
+    if ( ( status_fp = fdopen(fd, "r") ) == NULL ) {
+        close(fd);
+        return(-1);
+    }
+    while ( fgets(line, sizeof(line), status_fp) != NULL ) {
+        if ( sscanf(line, "Uid: %u", &ruid) == 1 ) {
+            *uid = (uid_t) ruid;
+            ret = 0;
+            break;
+        }
+    }
+    fclose(status_fp);
+
+    return(ret);
 }
 
+static int namespace_proc_open(pid_t pid) {
+    char path[64]; // Flawfinder: ignore (bounded by snprintf)
 
-void namespace_join_pid(pid_t daemon_pid) {
-#ifdef NO_SETNS
-    message(ERROR, "This host does not support joining existing name spaces\n");
-    ABORT(1);
-#else
-    char *nsjoin= (char *)xmalloc(64);
+    snprintf(path, sizeof(path), "/proc/%d", pid); // Flawfinder: ignore
+    return(open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)); // Flawfinder: ignore
+}
 
-    snprintf(nsjoin, 64, "/proc/%d/ns/pid", daemon_pid); // Flawfinder: ignore
 
-    if ( is_file(nsjoin) == 0 ) {
-        message(DEBUG, "Connecting to existing PID namespace\n");
-        int fd = open(nsjoin, O_RDONLY); // Flawfinder: ignore
-        if ( setns(fd, CLONE_NEWPID) < 0 ) {
-            message(ERROR, "Could not join existing PID namespace: %s\n", strerror(errno));
-            ABORT(255);
-        }
-        close(fd);
+// Write pid to fp, along with its start time for namespace_open()
+int namespace_record(FILE *fp, pid_t pid) {
+    unsigned long long starttime = 0;
+    int procfd;
 
-    } else {
-        message(ERROR, "Could not identify PID namespace: %s\n", nsjoin);
-        ABORT(255);
+    if ( ( procfd = namespace_proc_open(pid) ) >= 0 ) {
+        starttime = namespace_proc_starttime(procfd);
+        close(procfd);
+    }
+    if ( starttime == 0 ) {
+        message(ERROR, "Could not read the start time of process %d\n", pid);
+        return(-1);
+    }
+
+    if ( fprintf(fp, "%d %llu\n", pid, starttime) < 0 || fflush(fp) != 0 ) {
+        message(ERROR, "Could not record process %d: %s\n", pid, strerror(errno));
+        return(-1);
+    }
+
+    return(0);
+}
+
+
+// Open the process namespace_record() wrote to fp, setting *pid.  It has
+// to be the very process recorded, not one that reused its PID, and has
+// to belong to uid.  Returns a pidfd, or a /proc/<pid> directory fd when
+// the kernel has no pidfd_open(); either one keeps referring to that
+// process.  Returns -1 with *pid set to -1 when it is gone.
+int namespace_open(FILE *fp, pid_t *pid, uid_t uid) {
+    unsigned long long starttime;
+    uid_t owner;
+    int pidfd = -1;
+    int procfd;
+
+    if ( fscanf(fp, "%d %llu", pid, &starttime) != 2 || *pid <= 0 ) {
+        message(VERBOSE, "No process recorded\n");
+        *pid = -1;
+        return(-1);
+    }
+
+#ifdef SYS_pidfd_open
+    if ( ( pidfd = syscall(SYS_pidfd_open, *pid, 0) ) < 0 ) {
+        message(DEBUG, "Could not open pidfd for %d: %s\n", *pid, strerror(errno));
     }
 #endif
+
+    // Checked after the pidfd is open: if /proc/<pid> is still the
+    // recorded process now, that is also what the pidfd refers to
+    if ( ( procfd = namespace_proc_open(*pid) ) < 0 ) {
+        message(VERBOSE, "Recorded process %d is gone\n", *pid);
+    } else if ( namespace_proc_starttime(procfd) != starttime ) {
+        message(VERBOSE, "Recorded process %d is gone, its PID has been reused\n", *pid);
+    } else if ( namespace_proc_uid(procfd, &owner) < 0 || owner != uid ) {
+        message(WARNING, "Recorded process %d does not belong to the calling user\n", *pid);
+    } else if ( pidfd >= 0 ) {
+        close(procfd);
+        return(pidfd);
+    } else {
+        return(procfd);
+    }
+
+    if ( procfd >= 0 ) {
+        close(procfd);
+    }
+    if ( pidfd >= 0 ) {
+        close(pidfd);
+    }
+    *pid = -1;
+    return(-1);
 }
 
 
-void namespace_join_mount(pid_t daemon_pid) {
+// proc_fd is what namespace_open() returned for daemon_pid
+static void namespace_join_ns(pid_t daemon_pid, int proc_fd, int nstype, char *ns, char *name) {
 #ifdef NO_SETNS
     message(ERROR, "This host does not support joining existing name spaces\n");
     ABORT(1);
 #else
-    char *nsjoin= (char *)xmalloc(64);
+    char nsjoin[64]; // Flawfinder: ignore (bounded by snprintf)
+    struct pollfd exited;
+    int fd;
 
-    snprintf(nsjoin, 64, "/proc/%d/ns/mnt", daemon_pid); // Flawfinder: ignore
+    message(DEBUG, "Connecting to existing %s namespace\n", name);
 
-    if ( is_file(nsjoin) == 0 ) {
-        message(DEBUG, "Connecting to existing mount namespace\n");
-        int fd = open(nsjoin, O_RDONLY); // Flawfinder: ignore
-        if ( setns(fd, CLONE_NEWNS) < 0 ) {
-            message(ERROR, "Could not join existing mount namespace: %s\n", strerror(errno));
-            ABORT(255);
-        }
-        close(fd);
+    if ( setns(proc_fd, nstype) == 0 ) {
+        return;
+    }
+    // A /proc/<pid> directory, or a pidfd on a kernel before 5.8 that
+    // only takes namespace file descriptors
+    if ( errno != EINVAL ) {
+        message(ERROR, "Could not join existing %s namespace: %s\n", name, strerror(errno));
+        ABORT(255);
+    }
 
-    } else {
-        message(ERROR, "Could not identify mount namespace: %s\n", nsjoin);
+    snprintf(nsjoin, sizeof(nsjoin), "ns/%s", ns); // Flawfinder: ignore
+    if ( ( fd = openat(proc_fd, nsjoin, O_RDONLY | O_CLOEXEC) ) < 0 && errno == ENOTDIR ) {
+        snprintf(nsjoin, sizeof(nsjoin), "/proc/%d/ns/%s", daemon_pid, ns); // Flawfinder: ignore
+        fd = open(nsjoin, O_RDONLY | O_CLOEXEC); // Flawfinder: ignore
+
+        // The PID could only have been reused if the pidfd's process
+        // had exited by now
+        exited.fd = proc_fd;
+        exited.events = POLLIN;
+        if ( fd >= 0 && poll(&exited, 1, 0) != 0 ) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if ( fd < 0 ) {
+        message(ERROR, "Could not identify %s namespace of process %d\n", name, daemon_pid);
+        ABORT(255);
+    }
+    if ( setns(fd, nstype) < 0 ) {
+        message(ERROR, "Could not join existing %s namespace: %s\n", name, strerror(errno));
         ABORT(255);
     }
+    close(fd);
 #endif
 }
 
 
+void namespace_join_pid(pid_t daemon_pid, int proc_fd) {
+    namespace_join_ns(daemon_pid, proc_fd, CLONE_NEWPID, "pid", "PID");
+}
 
 
+void namespace_join_mount(pid_t daemon_pid, int proc_fd) {
+    namespace_join_ns(daemon_pid, proc_fd, CLONE_NEWNS, "mnt", "mount");
+}
 
+
+void namespace_join_ipc(pid_t daemon_pid, int proc_fd) {
+    namespace_join_ns(daemon_pid, proc_fd, CLONE_NEWIPC, "ipc", "IPC");
+}
@@ -19,10 +19,10 @@
 */
 
 
-void namespace_unshare(void);
-void namespace_unshare_pid(void);
-void namespace_unshare_fs(void);
-void namespace_unshare_mount(void);
-void namespace_join(pid_t daemon_pid);
-void namespace_join_pid(pid_t daemon_pid);
-void namespace_join_mount(pid_t daemon_pid);
+int namespace_clone_flags(void);
+int namespace_record(FILE *fp, pid_t pid);
+int namespace_open(FILE *fp, pid_t *pid, uid_t uid);
+void namespace_signal(pid_t pid, int sig, int pid_ns);
+void namespace_join_pid(pid_t daemon_pid, int proc_fd);
+void namespace_join_mount(pid_t daemon_pid, int proc_fd);
+void namespace_join_ipc(pid_t daemon_pid, int proc_fd);
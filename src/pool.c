@@ -0,0 +1,415 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+
+#include "config.h"
+#include "pool.h"
+#include "daemon_socket.h"
+#include "namespaces.h"
+#include "privilege.h"
+#include "util.h"
+#include "file.h"
+#include "message.h"
+
+
+/*
+ * A warm pool is a manager process (the `start --pool` supervisor) and a
+ * number of container processes that have already done the whole launch
+ * and sit in accept() on pool.sock, whose name carries the options the
+ * pool was started with (pool_socket_path() in sexec.c).  The member that
+ * takes a connection passes it to the manager over its private channel
+ * and execs the request; the manager reports the exit status to the
+ * client, relays signals, and clones a replacement member.
+ */
+
+struct pool_member {
+    pid_t pid;
+    int channel_fd;
+    int client_fd;
+    int taken;
+};
+
+
+static time_t pool_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec);
+}
+
+static int pool_fd_send(int channel_fd, int fd) {
+    struct msghdr msghdr;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    char byte = 0;
+
+    memset(&msghdr, 0, sizeof(msghdr));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msghdr.msg_iov = &iov;
+    msghdr.msg_iovlen = 1;
+    msghdr.msg_control = control.buf;
+    msghdr.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msghdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int)); // Flawfinder: ignore (fixed size)
+
+    return( sendmsg(channel_fd, &msghdr, MSG_NOSIGNAL) == 1 ? 0 : -1 );
+}
+
+static int pool_fd_recv(int channel_fd) {
+    struct msghdr msghdr;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    char byte;
+    int fd;
+
+    memset(&msghdr, 0, sizeof(msghdr));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msghdr.msg_iov = &iov;
+    msghdr.msg_iovlen = 1;
+    msghdr.msg_control = control.buf;
+    msghdr.msg_controllen = sizeof(control.buf);
+
+    if ( recvmsg(channel_fd, &msghdr, MSG_CMSG_CLOEXEC) != 1 ) {
+        return(-1);
+    }
+    cmsg = CMSG_FIRSTHDR(&msghdr);
+    if ( cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)) ) {
+        return(-1);
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int)); // Flawfinder: ignore (fixed size)
+
+    return(fd);
+}
+
+
+int pool_member(int sock_fd, int channel_fd) {
+    struct daemon_request *request;
+    int client_fd;
+
+    message(DEBUG, "Called pool_member(%d, %d)\n", sock_fd, channel_fd);
+
+    // Take the first well formed request from our own user
+    while ( 1 ) {
+        if ( ( client_fd = daemon_socket_accept(sock_fd) ) < 0 ) {
+            continue;
+        }
+        if ( ( request = daemon_socket_recv(client_fd) ) == NULL ) {
+            close(client_fd);
+            continue;
+        }
+        break;
+    }
+
+    if ( pool_fd_send(channel_fd, client_fd) < 0 ) {
+        message(ERROR, "Could not hand pool connection to the manager: %s\n", strerror(errno));
+        ABORT(255);
+    }
+    close(channel_fd);
+    close(client_fd);
+    close(sock_fd);
+
+    daemon_socket_apply(request);
+
+    return(-1);
+}
+
+
+int pool_serve(int sock_fd, int size, int idle_timeout, pid_t (*spawn)(int channel_fd)) {
+    struct pool_member *members = NULL;
+    struct pollfd *pfds = NULL;
+    sigset_t sigset;
+    sigset_t oldmask;
+    time_t last_used = pool_now();
+    int nmembers = 0;
+    int warm = 0;
+    int sig_fd;
+    int retval = 0;
+    int done = 0;
+    int i;
+
+    message(DEBUG, "Called pool_serve(%d, %d, %d)\n", sock_fd, size, idle_timeout);
+
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGCHLD);
+    sigaddset(&sigset, SIGTERM);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGHUP);
+    sigprocmask(SIG_BLOCK, &sigset, &oldmask);
+    if ( ( sig_fd = signalfd(-1, &sigset, SFD_CLOEXEC) ) < 0 ) {
+        message(ERROR, "Could not create signalfd: %s\n", strerror(errno));
+        ABORT(255);
+    }
+
+    while ( done == 0 ) {
+        int timeout = -1;
+        int busy = nmembers - warm;
+
+        // Refill in the background of whatever the busy members are doing
+        while ( warm < size ) {
+            int channel[2];
+
+            if ( socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, channel) < 0 ) {
+                message(ERROR, "Could not create pool channel: %s\n", strerror(errno));
+                ABORT(255);
+            }
+            members = (struct pool_member *) realloc(members, sizeof(struct pool_member) * ( nmembers + 1 ));
+            if ( members == NULL ) {
+                message(ERROR, "Could not allocate memory: %s\n", strerror(errno));
+                ABORT(255);
+            }
+            members[nmembers].pid = spawn(channel[1]);
+            members[nmembers].channel_fd = channel[0];
+            members[nmembers].client_fd = -1;
+            members[nmembers].taken = 0;
+            close(channel[1]);
+            message(VERBOSE, "Started pool member %d\n", members[nmembers].pid);
+            nmembers++;
+            warm++;
+        }
+
+        if ( idle_timeout > 0 && busy == 0 ) {
+            time_t idle = pool_now() - last_used;
+
+            if ( idle >= idle_timeout ) {
+                message(VERBOSE, "Pool idle for %d seconds, shutting down\n", idle_timeout);
+                break;
+            }
+            timeout = ( idle_timeout - idle ) * 1000;
+        }
+
+        pfds = (struct pollfd *) realloc(pfds, sizeof(struct pollfd) * ( 1 + nmembers ));
+        if ( pfds == NULL ) {
+            message(ERROR, "Could not allocate memory: %s\n", strerror(errno));
+            ABORT(255);
+        }
+        pfds[0].fd = sig_fd;
+        pfds[0].events = POLLIN;
+        pfds[0].revents = 0;
+        for ( i = 0; i < nmembers; i++ ) {
+            pfds[1 + i].fd = members[i].taken ? members[i].client_fd : members[i].channel_fd;
+            pfds[1 + i].events = POLLIN;
+            pfds[1 + i].revents = 0;
+        }
+
+        if ( poll(pfds, 1 + nmembers, timeout) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            message(ERROR, "Could not poll pool descriptors: %s\n", strerror(errno));
+            ABORT(255);
+        }
+
+        // A member took a connection, or a client sent a signal or went away
+        for ( i = 0; i < nmembers; i++ ) {
+            if ( pfds[1 + i].revents == 0 ) {
+                continue;
+            }
+            if ( members[i].taken == 0 ) {
+                if ( ( members[i].client_fd = pool_fd_recv(members[i].channel_fd) ) < 0 ) {
+                    // The member died, which SIGCHLD will tell us about
+                    close(members[i].channel_fd);
+                    members[i].channel_fd = -1;
+                    continue;
+                }
+                close(members[i].channel_fd);
+                members[i].channel_fd = -1;
+                members[i].taken = 1;
+                warm--;
+                last_used = pool_now();
+                message(VERBOSE, "Pool member %d took a request\n", members[i].pid);
+                daemon_socket_send(members[i].client_fd, DAEMON_MSG_STARTED, members[i].pid);
+            } else {
+                struct daemon_msg msg;
+                ssize_t len;
+
+                if ( ( len = recv(members[i].client_fd, &msg, sizeof(msg), MSG_DONTWAIT) ) != sizeof(msg) ) {
+                    if ( len < 0 && errno == EAGAIN ) {
+                        continue;
+                    }
+                    message(VERBOSE, "Client of pool member %d went away\n", members[i].pid);
+                    namespace_signal(members[i].pid, SIGHUP, 1);
+                    close(members[i].client_fd);
+                    members[i].client_fd = -1;
+                } else if ( msg.type == DAEMON_MSG_SIGNAL && msg.value > 0 && msg.value < NSIG ) {
+                    namespace_signal(members[i].pid, msg.value, 1);
+                }
+            }
+        }
+
+        if ( pfds[0].revents & POLLIN ) {
+            struct signalfd_siginfo info;
+            int status;
+            pid_t pid;
+
+            if ( read(sig_fd, &info, sizeof(info)) != sizeof(info) ) { // Flawfinder: ignore (fixed size)
+                continue;
+            }
+            if ( info.ssi_signo != SIGCHLD ) {
+                message(VERBOSE, "Got signal %d, stopping pool\n", info.ssi_signo);
+                break;
+            }
+
+            while ( ( pid = waitpid(-1, &status, WNOHANG) ) > 0 ) {
+                for ( i = 0; i < nmembers && members[i].pid != pid; i++ );
+                if ( i == nmembers ) {
+                    continue;
+                }
+                status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+
+                if ( members[i].taken == 0 ) {
+                    // Never got as far as accept(), so the launch itself is
+                    // failing; do not keep cloning replacements.
+                    message(ERROR, "Pool member %d failed during setup (%d), stopping pool\n", pid, status);
+                    warm--;
+                    retval = 255;
+                    done = 1;
+                } else {
+                    message(VERBOSE, "Pool member %d returned: %d\n", pid, status);
+                    if ( members[i].client_fd >= 0 ) {
+                        daemon_socket_send(members[i].client_fd, DAEMON_MSG_EXIT, status);
+                    }
+                }
+                if ( members[i].channel_fd >= 0 ) {
+                    close(members[i].channel_fd);
+                }
+                if ( members[i].client_fd >= 0 ) {
+                    close(members[i].client_fd);
+                }
+                members[i] = members[--nmembers];
+            }
+        }
+    }
+
+    // Waiting members go away quietly; running ones are hung up on
+    for ( i = 0; i < nmembers; i++ ) {
+        if ( members[i].taken == 0 ) {
+            kill(members[i].pid, SIGKILL);
+        } else {
+            namespace_signal(members[i].pid, SIGHUP, 1);
+        }
+    }
+    for ( i = 0; i < nmembers; i++ ) {
+        int status;
+
+        while ( waitpid(members[i].pid, &status, 0) < 0 && errno == EINTR );
+        if ( members[i].client_fd >= 0 ) {
+            status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+            daemon_socket_send(members[i].client_fd, DAEMON_MSG_EXIT, status);
+            close(members[i].client_fd);
+        }
+        if ( members[i].channel_fd >= 0 ) {
+            close(members[i].channel_fd);
+        }
+    }
+
+    free(members);
+    free(pfds);
+    close(sig_fd);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+    message(DEBUG, "Return pool_serve() = %d\n", retval);
+    return(retval);
+}
+
+
+int pool_stop(char *sessiondir, uid_t uid) {
+    char *pool_pid = joinpath(sessiondir, "pool.pid");
+    FILE *pool_fp;
+    pid_t pid = -1;
+    int pool_fd;
+
+    message(DEBUG, "Called pool_stop(%s, %d)\n", sessiondir, uid);
+
+    if ( is_file(pool_pid) < 0 ) {
+        return(0);
+    }
+    if ( ( pool_fp = fopen(pool_pid, "r") ) == NULL ) { // Flawfinder: ignore
+        message(ERROR, "Could not open pool pid file %s: %s\n", pool_pid, strerror(errno));
+        ABORT(255);
+    }
+
+    if ( flock(fileno(pool_fp), LOCK_SH | LOCK_NB) == 0 ) {
+        message(DEBUG, "No active container pool\n");
+        fclose(pool_fp);
+        return(0);
+    }
+    // Only the very pool manager the user started, not whatever has its
+    // PID by now
+    if ( ( pool_fd = namespace_open(pool_fp, &pid, uid) ) < 0 ) {
+        message(ERROR, "Could not find the container pool process\n");
+        ABORT(255);
+    }
+    fclose(pool_fp);
+
+    message(VERBOSE, "Sending stop to container pool: %d\n", pid);
+#ifdef SYS_pidfd_send_signal
+    // Takes the /proc/<pid> fallback of namespace_open() as well
+    if ( syscall(SYS_pidfd_send_signal, pool_fd, SIGTERM, NULL, 0) == 0 ) {
+        close(pool_fd);
+        message(DEBUG, "Return pool_stop(%s, %d) = 1\n", sessiondir, uid);
+        return(1);
+    }
+    message(DEBUG, "Could not signal container pool through its pidfd: %s\n", strerror(errno));
+#endif
+    close(pool_fd);
+
+    // Without the fd, signal it as the user: then at worst it reaches
+    // one of their own processes
+    priv_drop();
+    if ( kill(pid, SIGTERM) < 0 ) {
+        message(ERROR, "Could not stop container pool %d: %s\n", pid, strerror(errno));
+        ABORT(255);
+    }
+    priv_escalate();
+
+    message(DEBUG, "Return pool_stop(%s, %d) = 1\n", sessiondir, uid);
+    return(1);
+}
@@ -0,0 +1,41 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+// Optional USDT (sys/sdt.h) static tracepoints, enabled with
+// --enable-usdt.  An enabled probe is a single nop until a tracer such as
+// bpftrace or perf attaches; otherwise the macros compile to nothing.
+// Probe names use the usual '__' for '-', e.g. usdt:sexec:singularity:mount__start
+
+#ifdef SINGULARITY_USDT
+#include <sys/sdt.h>
+
+#define PROBE0(name) DTRACE_PROBE(singularity, name)
+#define PROBE1(name, a) DTRACE_PROBE1(singularity, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(singularity, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(singularity, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(singularity, name, a, b, c, d)
+#else
+#define PROBE0(name) do { } while (0)
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+#endif
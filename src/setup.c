@@ -0,0 +1,84 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "setup.h"
+#include "util.h"
+#include "message.h"
+
+#define SETUP_MAX_STEPS 8
+
+
+static struct {
+    const char *name;
+    void (*step)(void);
+    pthread_t thread;
+} setup_steps[SETUP_MAX_STEPS];
+static int setup_count = 0;
+
+
+static void *setup_thread(void *arg) {
+    int i = (intptr_t) arg;
+
+    setup_steps[i].step();
+
+    return(NULL);
+}
+
+
+void setup_start(const char *name, void (*step)(void)) {
+    int ret;
+
+    if ( setup_count < SETUP_MAX_STEPS ) {
+        setup_steps[setup_count].name = name;
+        setup_steps[setup_count].step = step;
+        message(DEBUG, "Starting setup step: %s\n", name);
+        if ( ( ret = pthread_create(&setup_steps[setup_count].thread, NULL, setup_thread, (void *)(intptr_t) setup_count) ) == 0 ) {
+            setup_count++;
+            return;
+        }
+        message(DEBUG, "Could not start thread for setup step %s: %s\n", name, strerror(ret));
+    }
+
+    message(DEBUG, "Running setup step in place: %s\n", name);
+    step();
+}
+
+
+void setup_join(void) {
+    int ret;
+
+    while ( setup_count > 0 ) {
+        setup_count--;
+        if ( ( ret = pthread_join(setup_steps[setup_count].thread, NULL) ) != 0 ) {
+            message(ERROR, "Could not wait for setup step %s: %s\n", setup_steps[setup_count].name, strerror(ret));
+            ABORT(255);
+        }
+        message(DEBUG, "Finished setup step: %s\n", setup_steps[setup_count].name);
+    }
+}
@@ -0,0 +1,34 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+
+#ifndef __SETUP_H_
+#define __SETUP_H_
+
+// Launch setup steps that do not depend on each other.  setup_start()
+// runs a step on its own thread, or in place if no thread is available;
+// setup_join() waits for every started step.  A step reports errors and
+// aborts exactly as it would have in line.  Steps run with the caller's
+// privileges, so the caller must not change them before setup_join().
+void setup_start(const char *name, void (*step)(void));
+void setup_join(void);
+
+#endif /* __SETUP_H_ */
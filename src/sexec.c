@@ -29,9 +29,8 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/param.h>
-#ifdef SINGULARITY_NO_NEW_PRIVS
+#include <sys/mman.h>
 #include <sys/prctl.h>
-#endif
 #include <errno.h> 
 #include <signal.h>
 #include <sched.h>
@@ -40,6 +39,7 @@
 #include <grp.h>
 #include <libgen.h>
 #include <pwd.h>
+#include <limits.h>
 
 #include "config.h"
 #include "mounts.h"
@@ -49,10 +49,20 @@
 #include "container_files.h"
 #include "config_parser.h"
 #include "container_actions.h"
+#include "daemon_socket.h"
+#include "pool.h"
+#include "checkpoint.h"
+#include "mpi.h"
+#include "job_namespace.h"
+#include "hostlibs.h"
+#include "identity.h"
+#include "setup.h"
 #include "privilege.h"
 #include "message.h"
 #include "util.h"
 #include "namespaces.h"
+#include "timing.h"
+#include "probes.h"
 
 /* GNU libc takes steps to sanitize environment variables when running
    setuid.  I don't know if others (musl, ulibc?) do, and we're
@@ -76,47 +86,630 @@
 #define MS_REC 16384
 #endif
 
-pid_t exec_fork_pid = 0;
+#define CLONE_STACK_SIZE (1024 * 1024)
+
+// Session directories, tried in order when 'sessiondir prefix' is not set
+static const char *sessiondir_defaults[] = {
+    "/run/singularity/session-",
+    "/dev/shm/.singularity-session-",
+    "/tmp/.singularity-session-",
+    NULL
+};
+
+// Launch state set up by main() and inherited by the container process
+static char *containerimage;
+static char *containername;
+static char *containerdir;
+static char *command;
+static char *sessiondir;
+static char *checkpointdir;
+static char *hostlibs_cache;
+static char *stagedir;
+static long stage_ttl;
+static char *staged_passwd = NULL;
+static char *staged_group = NULL;
+static int files_staged = 0;
+static char *loop_dev = 0;
+static char cwd[PATH_MAX]; // Flawfinder: ignore
+static int cwd_fd = 0;
+static int daemon_pid = -1;
+static uid_t uid;
+static int container_is_image = -1;
+static int container_is_dir = -1;
+static mode_t process_mask;
+static int container_argc;
+static char **container_argv;
+static sigset_t container_sigmask;
+static sigset_t supervisor_sigset;
+static FILE *tasks_fp = NULL;
+static int task_jobs = 0;
+static int task_null_fd = -1;
+static int task_output_fd = -1;
+static int daemon_comm_fd = -1;
+static int daemon_sock_fd = -1;
+static int daemon_ns_fd = -1;
+static int pool_size = 0;
+static int pool_idle = 900;
+static int pool_sock_fd = -1;
+static char *pool_sock_path = NULL;
+static int pool_channel_fd = -1;
+static int pool_clone_flags = 0;
+static FILE *mpi_fp = NULL;
+static int job_namespace = 0;
+static char *job_shmdir = NULL;
+
+// Signals the supervisor passes on to the container process
+static const int forward_signals[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2, 0 };
+
+
+// Block the signals we forward, and SIGCHLD, for supervise() to pick up
+// with sigwaitinfo().  The container process restores container_sigmask.
+static void supervisor_block(void) {
+    int i;
+
+    sigemptyset(&supervisor_sigset);
+    for ( i = 0; forward_signals[i] != 0; i++ ) {
+        sigaddset(&supervisor_sigset, forward_signals[i]);
+    }
+    sigaddset(&supervisor_sigset, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &supervisor_sigset, &container_sigmask);
+}
+
+
+// Wait for the container process, forwarding signals, and return its exit
+// status shell style (128 + signal if it was killed).
+static int supervise(pid_t pid, int pid_ns) {
+    int status;
+
+    while ( 1 ) {
+        int sig = sigwaitinfo(&supervisor_sigset, NULL);
+
+        if ( sig < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            message(ERROR, "Failed waiting for signals: %s\n", strerror(errno));
+            kill(pid, SIGKILL);
+            return(255);
+        }
 
-// TODO: This is broke, and needs some love!
-void sighandler(int sig) {
-    signal(sig, sighandler);
+        if ( sig == SIGCHLD ) {
+            pid_t ret = waitpid(pid, &status, WNOHANG);
+
+            if ( ret < 0 ) {
+                message(ERROR, "Failed waiting for container process: %s\n", strerror(errno));
+                return(255);
+            } else if ( ret == pid ) {
+                break;
+            }
+            continue;
+        }
 
-    if ( exec_fork_pid > 0 ) {
-        fprintf(stderr, "Singularity is sending SIGKILL to child pid: %d\n", exec_fork_pid);
+        namespace_signal(pid, sig, pid_ns);
+    }
 
-        kill(exec_fork_pid, SIGKILL);
+    if ( WIFEXITED(status) ) {
+        return(WEXITSTATUS(status));
+    } else if ( WIFSIGNALED(status) ) {
+        return(128 + WTERMSIG(status));
     }
+    return(255);
 }
 
 
+// Every launch takes its locks and reads its state in the session
+// directory, so keep it off disk: the first default on a memory file
+// system, /tmp as the last resort.
+static char *sessiondir_default(void) {
+    int i;
+
+    for ( i = 0; sessiondir_defaults[i + 1] != NULL; i++ ) {
+        if ( is_tmpfs((char *) sessiondir_defaults[i]) == 0 ) {
+            break;
+        }
+    }
+
+    return(xstrdup(sessiondir_defaults[i]));
+}
+
+
+// The warm pool socket for the options that decide how a container is
+// set up, so a launch only ever reaches a pool started with the same
+// ones: pool.sock, or e.g. pool-cw.sock for --contain --writable
+static char *pool_socket_path(void) {
+    char options[4]; // Flawfinder: ignore (at most three letters)
+    int i = 0;
+
+    if ( getenv("SINGULARITY_CONTAIN") != NULL ) { // Flawfinder: ignore (only checking for existance of envar)
+        options[i++] = 'c';
+    }
+    if ( getenv("SINGULARITY_WRITABLE") != NULL ) { // Flawfinder: ignore (only checking for existance of envar)
+        options[i++] = 'w';
+    }
+    if ( getenv("SINGULARITY_NO_NAMESPACE_PID") != NULL ) { // Flawfinder: ignore (only checking for existance of envar)
+        options[i++] = 'p';
+    }
+    options[i] = '\0';
+
+    if ( i == 0 ) {
+        return(joinpath(sessiondir, "pool.sock"));
+    }
+    return(joinpath(sessiondir, strjoin(strjoin("pool-", options), ".sock")));
+}
+
+
+// Stage the container's passwd and group files for the calling user
+static void stage_files(char *rootpath) {
+    int rootfd;
+
+    message(DEBUG, "Creating/Verifying staging directory: %s\n", stagedir);
+    if ( s_mkpath(stagedir, 0755) < 0 || is_owner(stagedir, 0, 0) < 0 ) {
+        message(ERROR, "Could not create root owned staging directory: %s\n", stagedir);
+        ABORT(255);
+    }
+
+    if ( ( rootfd = open(rootpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC) ) < 0 ) { // Flawfinder: ignore
+        message(ERROR, "Could not open container root %s: %s\n", rootpath, strerror(errno));
+        ABORT(255);
+    }
+
+    message(DEBUG, "Checking configuration file for 'config passwd'\n");
+    if ( config_get_key_bool("config passwd", 1) > 0 ) {
+        staged_passwd = stage_container_file(rootfd, "/etc/passwd", joinpath(stagedir, strjoin(identity_get()->key, ".passwd")), stage_ttl, update_passwd_file);
+    } else {
+        message(VERBOSE, "Not staging /etc/passwd per config\n");
+    }
+
+    message(DEBUG, "Checking configuration file for 'config group'\n");
+    if ( config_get_key_bool("config group", 1) > 0 ) {
+        staged_group = stage_container_file(rootfd, "/etc/group", joinpath(stagedir, strjoin(identity_get()->key, ".group")), stage_ttl, update_group_file);
+    } else {
+        message(VERBOSE, "Not staging /etc/group per config\n");
+    }
+
+    close(rootfd);
+    files_staged = 1;
+}
+
+
+// Setup step run alongside the loop device attach: NSS lookups and, when
+// the container's files can be read without mounting it, the staging
+static void setup_identity(void) {
+    identity_get();
+
+    if ( uid != 0 && container_is_dir > 0 ) {
+        stage_files(containerimage);
+    }
+}
+
+
+// Runs as the single container process created by clone(): finishes the
+// mount namespace, stages passwd/group, enters the container and execs.
+// arg is the synchronization pipe from container_clone().
+static int container_init(void *arg) {
+    int *sync_pipe = (int *) arg;
+    char sync_byte;
+
+    message(DEBUG, "Hello from container process\n");
+    timing_mark("clone");
+
+    // Restore the signal mask the supervisor blocked for sigwaitinfo()
+    sigprocmask(SIG_SETMASK, &container_sigmask, NULL);
+
+    // Wait until the supervisor has finished its bookkeeping (daemon.pid)
+    close(sync_pipe[1]);
+    if ( read(sync_pipe[0], &sync_byte, 1) != 1 ) {
+        message(ERROR, "Supervisor process went away during container setup\n");
+        ABORT(255);
+    }
+    close(sync_pipe[0]);
+
+    // Look the user up while NSS still sees the host's files and sockets
+    identity_get();
+
+    if ( daemon_pid == -1 ) {
+        int slave = config_get_key_bool("mount slave", 0);
+        int rootfd;
+        // Privatize the mount namespaces
+#ifdef SINGULARITY_MS_SLAVE
+        message(DEBUG, "Making mounts %s\n", (slave ? "slave" : "private"));
+        if ( mount(NULL, "/", NULL, (slave ? MS_SLAVE : MS_PRIVATE)|MS_REC, NULL) < 0 ) {
+            message(ERROR, "Could not make mountspaces %s: %s\n", (slave ? "slave" : "private"), strerror(errno));
+            ABORT(255);
+        }
+#else
+        if ( slave > 0 ) {
+            message(WARNING, "Requested option 'mount slave' is not available on this host, using private\n");
+        }
+        message(DEBUG, "Making mounts private\n");
+        if ( mount(NULL, "/", NULL, MS_PRIVATE | MS_REC, NULL) < 0 ) {
+            message(ERROR, "Could not make mountspaces %s: %s\n", (slave ? "slave" : "private"), strerror(errno));
+            ABORT(255);
+        }
+#endif
+
+        if ( container_is_image > 0 ) {
+            if ( getenv("SINGULARITY_WRITABLE") == NULL ) { // Flawfinder: ignore (only checking for existance of envar)
+                message(DEBUG, "Mounting Singularity image file read only\n");
+                if ( mount_image(loop_dev, containerdir, 0, config_get_key_value("image mount options")) < 0 ) {
+                    ABORT(255);
+                }
+            } else {
+                unsetenv("SINGULARITY_WRITABLE");
+                message(DEBUG, "Mounting Singularity image file read/write\n");
+                if ( mount_image(loop_dev, containerdir, 1, config_get_key_value("image mount options")) < 0 ) {
+                    ABORT(255);
+                }
+            }
+        } else if ( container_is_dir > 0 ) {
+        // TODO: container directories should also be mountable readwrite?
+            message(DEBUG, "Mounting Singularity chroot read only\n");
+            mount_bind(containerimage, containerdir, 0);
+        }
+
+
+        timing_mark("mount");
+
+        // Checks inside the container start from its root rather than
+        // walking containerdir again for each path
+        if ( ( rootfd = open(containerdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) ) < 0 ) { // Flawfinder: ignore
+            message(ERROR, "Could not open container root %s: %s\n", containerdir, strerror(errno));
+            ABORT(255);
+        }
+
+        // /bin/sh MUST exist as the minimum requirements for a container
+        message(DEBUG, "Checking if container has /bin/sh\n");
+        if ( is_exec_at(rootfd, "/bin/sh") < 0 ) {
+            message(ERROR, "Container image does not have a valid /bin/sh\n");
+            ABORT(1);
+        }
+
+
+        // Bind mounts
+        message(DEBUG, "Checking to see if we are running contained\n");
+        if ( getenv("SINGULARITY_CONTAIN") == NULL ) { // Flawfinder: ignore (only checking for existance of envar)
+            unsetenv("SINGULARITY_CONTAIN");
+
+            message(DEBUG, "Checking configuration file for 'mount home'\n");
+            if ( config_get_key_bool("mount home", 1) > 0 ) {
+                mount_home(containerdir, rootfd);
+            } else {
+                message(VERBOSE2, "Not mounting home directory per config\n");
+            }
+
+            bind_paths(containerdir, rootfd);
+
+        }
+
+        if ( job_shmdir != NULL ) {
+            int shm_fd;
+
+            if ( is_dir_at(rootfd, "/dev/shm") < 0 ) {
+                message(WARNING, "Container has no /dev/shm to share with the job\n");
+            } else if ( ( shm_fd = job_namespace_shm(job_shmdir) ) >= 0 ) {
+                message(VERBOSE, "Binding job /dev/shm: %s\n", job_shmdir);
+                mount_bind(joinpath("/proc/self/fd", int2str(shm_fd)), joinpath(containerdir, "/dev/shm"), 1);
+                close(shm_fd);
+            }
+        }
+
+        mount_hostlibs(containerdir, rootfd, hostlibs_cache);
+        close(rootfd);
+        timing_mark("binds");
+
+    } else {
+        PROBE1(join__start, daemon_pid);
+        namespace_join_mount(daemon_pid, daemon_ns_fd);
+        PROBE1(join__done, daemon_pid);
+        timing_mark("join");
+    }
+
+    if ( uid != 0 && daemon_pid == -1 ) { // If we are root, no need to mess with passwd or group
+        // Joined namespaces have theirs already.  Directory containers
+        // were staged from their source during setup.
+        if ( files_staged == 0 ) {
+            stage_files(containerdir);
+        }
+        if ( staged_passwd != NULL ) {
+            message(VERBOSE, "Binding staged /etc/passwd into container\n");
+            mount_bind(staged_passwd, joinpath(containerdir, "/etc/passwd"), 0);
+        }
+        if ( staged_group != NULL ) {
+            message(VERBOSE, "Binding staged /etc/group into container\n");
+            mount_bind(staged_group, joinpath(containerdir, "/etc/group"), 0);
+        }
+    } else if ( uid == 0 ) {
+        message(VERBOSE, "Not staging passwd or group (running as root)\n");
+    }
+    timing_mark("passwd");
+
+    // The mount namespace is complete, so other ranks of the MPI job may
+    // join it now
+    if ( mpi_fp != NULL ) {
+        flock(fileno(mpi_fp), LOCK_SH);
+        fclose(mpi_fp);
+        mpi_fp = NULL;
+    }
+
+
+    message(VERBOSE, "Entering container file system space\n");
+    PROBE1(chroot, containerdir);
+    if ( chroot(containerdir) < 0 ) { // Flawfinder: ignore (yep, yep, yep... we know!)
+        message(ERROR, "failed enter CONTAINERIMAGE: %s\n", containerdir);
+        ABORT(255);
+    }
+    message(DEBUG, "Changing dir to '/' within the new root\n");
+    if ( chdir("/") < 0 ) {
+        message(ERROR, "Could not chdir after chroot to /: %s\n", strerror(errno));
+        ABORT(1);
+    }
+
+
+    if ( daemon_pid < 0 ) {
+        // Mount /proc if we are configured
+        message(DEBUG, "Checking configuration file for 'mount proc'\n");
+        if ( config_get_key_bool("mount proc", 1) > 0 ) {
+            if ( is_dir("/proc") == 0 ) {
+                message(VERBOSE, "Mounting /proc\n");
+                if ( mount("proc", "/proc", "proc", 0, NULL) < 0 ) {
+                    message(ERROR, "Could not mount /proc: %s\n", strerror(errno));
+                    ABORT(255);
+                }
+            } else {
+                message(WARNING, "Not mounting /proc, container has no bind directory\n");
+            }
+        } else {
+            message(VERBOSE, "Skipping /proc mount\n");
+        }
+
+        // Mount /sys if we are configured
+        message(DEBUG, "Checking configuration file for 'mount sys'\n");
+        if ( config_get_key_bool("mount sys", 1) > 0 ) {
+            if ( is_dir("/sys") == 0 ) {
+                message(VERBOSE, "Mounting /sys\n");
+                if ( mount("sysfs", "/sys", "sysfs", 0, NULL) < 0 ) {
+                    message(ERROR, "Could not mount /sys: %s\n", strerror(errno));
+                    ABORT(255);
+                }
+            } else {
+                message(WARNING, "Not mounting /sys, container has no bind directory\n");
+            }
+        } else {
+            message(VERBOSE, "Skipping /sys mount\n");
+        }
+    }
+    timing_mark("chroot");
+
+
+    // Drop all privileges for good
+    message(VERBOSE3, "Dropping all privileges\n");
+    priv_drop_perm();
+
+    // Change to the proper directory
+    message(VERBOSE2, "Changing to correct working directory: %s\n", cwd);
+    if ( is_dir(cwd) == 0 ) {
+       if ( chdir(cwd) < 0 ) {
+            message(ERROR, "Could not chdir to: %s: %s\n", cwd, strerror(errno));
+            ABORT(1);
+        }
+    } else {
+        if ( fchdir(cwd_fd) < 0 ) {
+            message(ERROR, "Could not fchdir to cwd: %s\n", strerror(errno));
+            ABORT(1);
+        }
+    }
+
+    // Resetting umask
+    umask(process_mask); // Flawfinder: ignore (resetting back to original umask)
+
+    // After this, we exist only within the container... Let's make it known!
+    message(DEBUG, "Setting environment variable 'SINGULARITY_CONTAINER=1'\n");
+    if ( setenv("SINGULARITY_CONTAINER", containername, 1) != 0 ) {
+        message(ERROR, "Could not set SINGULARITY_CONTAINER to '%s'\n", containername);
+        ABORT(1);
+    }
+    hostlibs_environment();
+
+#ifdef SINGULARITY_NO_NEW_PRIVS
+    // Prevent this container from gaining any future privileges.
+    message(DEBUG, "Setting NO_NEW_PRIVS to prevent future privilege escalations.\n");
+    if ( prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0 ) {
+        message(ERROR, "Could not set NO_NEW_PRIVS safeguard: %s\n", strerror(errno));
+        ABORT(1);
+    }
+#else  // SINGULARITY_NO_NEW_PRIVS
+    message(VERBOSE2, "Not enabling NO_NEW_PRIVS flag due to lack of compile-time support.\n");
+#endif
+    // Do what we came here to do!
+    if ( command == NULL ) {
+        message(WARNING, "No command specified, launching 'shell'\n");
+        command = xstrdup("shell");
+    }
+    timing_report(command);
+    PROBE1(exec, command);
+    if ( strcmp(command, "run") == 0 ) {
+        message(VERBOSE, "COMMAND=run\n");
+        if ( container_run(container_argc, container_argv) < 0 ) {
+            ABORT(255);
+        }
+    }
+    if ( strcmp(command, "exec") == 0 && tasks_fp != NULL ) {
+        message(VERBOSE, "COMMAND=exec (tasks)\n");
+        return(container_tasks(tasks_fp, task_jobs, task_null_fd, task_output_fd));
+    }
+    if ( strcmp(command, "exec") == 0 ) {
+        message(VERBOSE, "COMMAND=exec\n");
+        if ( container_exec(container_argc, container_argv) < 0 ) {
+            ABORT(255);
+        }
+    }
+    if ( strcmp(command, "shell") == 0 ) {
+        message(VERBOSE, "COMMAND=shell\n");
+        if ( container_shell(container_argc, container_argv) < 0 ) {
+            ABORT(255);
+        }
+    }
+    if ( strcmp(command, "start") == 0 && pool_channel_fd >= 0 ) {
+        message(VERBOSE, "COMMAND=start (pool member)\n");
+        if ( pool_member(pool_sock_fd, pool_channel_fd) < 0 ) {
+            ABORT(255);
+        }
+    }
+    if ( strcmp(command, "start") == 0 ) {
+        int fd;
+
+        message(VERBOSE, "COMMAND=start\n");
+
+        // Keep nothing from the launch but the control channels, so that a
+        // checkpoint of the daemon refers to nothing outside its namespaces
+        for ( fd = 3; fd < sysconf(_SC_OPEN_MAX); fd++ ) {
+            if ( fd != daemon_comm_fd && fd != daemon_sock_fd ) {
+                close(fd);
+            }
+        }
+
+        if ( container_daemon_start(daemon_comm_fd, daemon_sock_fd) < 0 ) {
+            ABORT(255);
+        }
+        return(0);
+    }
+
+    message(ERROR, "Unknown command: %s\n", command);
+    ABORT(255);
+
+    return(-1);
+}
+
+// Clone the container process with the given namespace flags, record it
+// in daemon_fp if given and release it into container_init().
+static pid_t container_clone(int clone_flags, FILE *daemon_fp) {
+    void *clone_stack;
+    pid_t container_pid;
+    int sync_pipe[2];
+
+    if ( pipe2(sync_pipe, O_CLOEXEC) < 0 ) {
+        message(ERROR, "Could not create synchronization pipe: %s\n", strerror(errno));
+        ABORT(255);
+    }
+
+    if ( ( clone_stack = mmap(NULL, CLONE_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0) ) == MAP_FAILED ) {
+        message(ERROR, "Could not allocate container process stack: %s\n", strerror(errno));
+        ABORT(255);
+    }
+
+    timing_set_pid(getpid());
+    PROBE1(clone, clone_flags);
+    if ( ( container_pid = clone(container_init, (char *) clone_stack + CLONE_STACK_SIZE, clone_flags | SIGCHLD, sync_pipe) ) < 0 ) {
+        message(ERROR, "Could not create container process: %s\n", strerror(errno));
+        ABORT(255);
+    }
+    munmap(clone_stack, CLONE_STACK_SIZE);
+    close(sync_pipe[0]);
+    if ( daemon_sock_fd >= 0 ) {
+        close(daemon_sock_fd);
+        close(daemon_comm_fd);
+    }
+
+    if ( daemon_fp != NULL && namespace_record(daemon_fp, container_pid) < 0 ) {
+        ABORT(255);
+    }
+
+    if ( write(sync_pipe[1], "1", 1) != 1 ) {
+        message(ERROR, "Could not release container process: %s\n", strerror(errno));
+        ABORT(255);
+    }
+    close(sync_pipe[1]);
+
+    return(container_pid);
+}
+
+// Clone the container process and supervise it, returning its exit
+// status.  Called with privileges escalated; returns with them dropped.
+static int container_launch(int clone_flags, FILE *daemon_fp) {
+    pid_t container_pid;
+    int retval;
+
+    // Block the signals we forward before cloning, so none can slip in
+    // between the clone and the supervisor loop
+    supervisor_block();
+
+    container_pid = container_clone(clone_flags, daemon_fp);
+
+    container_argv[0] = xstrdup("Singularity: supervisor");
+
+    message(VERBOSE3, "Dropping privilege...\n");
+    priv_drop();
+
+    message(VERBOSE2, "Waiting for container process...\n");
+    retval = supervise(container_pid, clone_flags & CLONE_NEWPID);
+    message(VERBOSE, "Container process returned: %d\n", retval);
+
+    return(retval);
+}
+
+// Bring a checkpointed namespace daemon back with CRIU and supervise it
+// as if we had cloned it.  Called with privileges escalated; returns with
+// them dropped.
+static int container_restore(FILE *daemon_fp) {
+    pid_t container_pid;
+    int retval;
+
+    supervisor_block();
+
+    // CRIU restores detached, leaving the daemon to us
+    if ( prctl(PR_SET_CHILD_SUBREAPER, 1) < 0 ) {
+        message(ERROR, "Could not become subreaper for the restored daemon: %s\n", strerror(errno));
+        ABORT(255);
+    }
+    if ( ( container_pid = checkpoint_restore(checkpointdir, loop_dev, joinpath(sessiondir, "restore.pid")) ) < 0 ) {
+        ABORT(255);
+    }
+
+    if ( namespace_record(daemon_fp, container_pid) < 0 ) {
+        ABORT(255);
+    }
+
+    container_argv[0] = xstrdup("Singularity: supervisor");
+
+    message(VERBOSE3, "Dropping privilege...\n");
+    priv_drop();
+
+    message(VERBOSE2, "Waiting for restored container process...\n");
+    retval = supervise(container_pid, 1);
+    message(VERBOSE, "Container process returned: %d\n", retval);
+
+    return(retval);
+}
+
+// Clone one warm pool member, called by pool_serve() with privileges dropped
+static pid_t pool_spawn(int channel_fd) {
+    pid_t pid;
+
+    pool_channel_fd = channel_fd;
+    priv_escalate();
+    pid = container_clone(pool_clone_flags, NULL);
+    priv_drop();
+
+    return(pid);
+}
 
 int main(int argc, char ** argv) {
     FILE *containerimage_fp = NULL;
     FILE *daemon_fp = NULL;
-    char *containerimage;
-    char *containername;
-    char *containerdir;
-    char *command;
-    char *sessiondir;
+    FILE *pool_fp = NULL;
     char *sessiondir_prefix;
-    char *loop_dev_lock = NULL;
     char *loop_dev_cache = NULL;
-    char *loop_dev = 0;
     char *config_path;
-    char cwd[PATH_MAX]; // Flawfinder: ignore
-    int cwd_fd = 0;
     int sessiondirlock_fd = 0;
     int containerimage_fd = 0;
     int loop_dev_fd = 0;
     int loop_dev_lock_fd = 0;
-    int daemon_pid = -1;
+    long loop_read_ahead;
     int retval = 0;
-    uid_t uid;
-    pid_t namespace_fork_pid = 0;
-    int container_is_image = -1;
-    int container_is_dir = -1;
-    mode_t process_mask = umask(0); // Flawfinder: ignore (we must reset umask to ensure appropriate permissions)
+
+    process_mask = umask(0); // Flawfinder: ignore (we must reset umask to ensure appropriate permissions)
+    container_argc = argc;
+    container_argv = argv;
 
 
 
@@ -124,10 +717,8 @@ int main(int argc, char ** argv) {
 // Init
 //****************************************************************************//
 
-    signal(SIGINT, sighandler);
-    signal(SIGQUIT, sighandler);
-    signal(SIGTERM, sighandler);
-    signal(SIGKILL, sighandler);
+    timing_start();
+    PROBE0(launch__start);
 
     // Get all user/group info
     uid = getuid();
@@ -141,6 +732,9 @@ int main(int argc, char ** argv) {
     message(VERBOSE3, "Setting privileges back to calling user\n");
     priv_drop();
 
+    timing_init();
+    timing_mark("privilege");
+
     // Figure out where we start
     message(DEBUG, "Obtaining file descriptor to current directory\n");
     if ( (cwd_fd = open(".", O_RDONLY)) < 0 ) { // Flawfinder: ignore (need current directory FD)
@@ -160,6 +754,43 @@ int main(int argc, char ** argv) {
     }
     unsetenv("SINGULARITY_COMMAND");
 
+    if ( strcmp(command, "exec") == 0 && getenv("SINGULARITY_TASKS") != NULL ) { // Flawfinder: ignore (opened as the calling user)
+        char *tasks = getenv("SINGULARITY_TASKS"); // Flawfinder: ignore
+        char *jobs = getenv("SINGULARITY_TASK_JOBS"); // Flawfinder: ignore
+        char *output = getenv("SINGULARITY_TASK_OUTPUT"); // Flawfinder: ignore
+
+        // Everything the task runner needs from the host is opened here,
+        // as the calling user, since it runs after the chroot.
+        message(DEBUG, "Opening task list: %s\n", tasks);
+        if ( strcmp(tasks, "-") == 0 ) {
+            tasks_fp = stdin;
+        } else if ( ( tasks_fp = fopen(tasks, "re") ) == NULL ) { // Flawfinder: ignore
+            message(ERROR, "Could not open task list %s: %s\n", tasks, strerror(errno));
+            ABORT(1);
+        }
+        if ( ( task_null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC) ) < 0 ) { // Flawfinder: ignore
+            message(ERROR, "Could not open /dev/null: %s\n", strerror(errno));
+            ABORT(1);
+        }
+        if ( output != NULL && output[0] != '\0' ) {
+            if ( ( task_output_fd = open(output, O_RDONLY | O_DIRECTORY | O_CLOEXEC) ) < 0 ) { // Flawfinder: ignore
+                message(ERROR, "Could not open task output directory %s: %s\n", output, strerror(errno));
+                ABORT(1);
+            }
+        }
+        if ( jobs != NULL && jobs[0] != '\0' ) {
+            task_jobs = strtol(jobs, NULL, 10);
+        }
+        if ( task_jobs < 1 ) {
+            task_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        message(VERBOSE, "Running tasks from %s with %d workers\n", tasks, task_jobs);
+
+        unsetenv("SINGULARITY_TASKS");
+        unsetenv("SINGULARITY_TASK_JOBS");
+        unsetenv("SINGULARITY_TASK_OUTPUT");
+    }
+
     message(DEBUG, "Obtaining SINGULARITY_IMAGE from environment\n");
     if ( ( containerimage = getenv("SINGULARITY_IMAGE") ) == NULL ) { // Flawfinder: ignore (we need the image name, and open it as the calling user)
         message(ERROR, "SINGULARITY_IMAGE undefined!\n");
@@ -210,6 +841,10 @@ int main(int argc, char ** argv) {
         ABORT(255);
     }
 
+    message(DEBUG, "Checking for an image specific configuration profile\n");
+    config_select_image(containerimage);
+    timing_mark("config");
+
     // TODO: Offer option to only run containers owned by root (so root can approve
     // containers)
 //    if ( uid == 0 && is_owner(containerimage, 0) < 0 ) {
@@ -218,19 +853,42 @@ int main(int argc, char ** argv) {
 //    }
 
     message(DEBUG, "Checking Singularity configuration for 'sessiondir prefix'\n");
-    config_rewind();
-    if ( ( sessiondir_prefix = config_get_key_value("sessiondir prefix") ) != NULL ) {
-        sessiondir = strjoin(sessiondir_prefix, file_id(containerimage));
-    } else {
-        sessiondir = strjoin("/tmp/.singularity-session-", file_id(containerimage));
+    if ( ( sessiondir_prefix = config_get_key_value("sessiondir prefix") ) == NULL ) {
+        sessiondir_prefix = sessiondir_default();
+    } else if ( is_tmpfs(sessiondir_prefix) < 0 ) {
+        message(VERBOSE2, "Session directory prefix is not on tmpfs: %s\n", sessiondir_prefix);
     }
+    sessiondir = strjoin(sessiondir_prefix, file_id(containerimage));
     message(DEBUG, "Set sessiondir to: %s\n", sessiondir);
 
+    if ( ( checkpointdir = config_get_key_value("checkpoint dir") ) == NULL ) {
+        checkpointdir = xstrdup(LOCALSTATEDIR "/singularity/checkpoint");
+    }
+    checkpointdir = joinpath(checkpointdir, file_id(containerimage));
+    message(DEBUG, "Set checkpointdir to: %s\n", checkpointdir);
+
+    if ( ( hostlibs_cache = config_get_key_value("host lib cache") ) == NULL ) {
+        hostlibs_cache = xstrdup(LOCALSTATEDIR "/singularity/hostlibs");
+    }
+    hostlibs_cache = joinpath(hostlibs_cache, file_id(containerimage));
+
+    // Staged passwd and group files live as long as the identity they
+    // were made for; without that cache, as long as the session
+    if ( ( stage_ttl = config_get_key_int("identity cache ttl", 300) ) > 0 ) {
+        if ( ( stagedir = config_get_key_value("staged file cache") ) == NULL ) {
+            stagedir = xstrdup(LOCALSTATEDIR "/singularity/staged");
+        }
+        stagedir = joinpath(stagedir, file_id(containerimage));
+    } else {
+        stagedir = sessiondir;
+        stage_ttl = LONG_MAX;
+    }
+    message(DEBUG, "Set stagedir to: %s\n", stagedir);
+
     
     containername = basename(xstrdup(containerimage));
     message(DEBUG, "Set containername to: %s\n", containername);
 
-    config_rewind();
     if ( ( containerdir = config_get_key_value("container dir") ) == NULL ) {
         //containerdir = (char *) xmalloc(21);
         containerdir = xstrdup("/var/singularity/mnt");
@@ -239,6 +897,145 @@ int main(int argc, char ** argv) {
 
     message(LOG, "Command=%s, Container=%s, CWD=%s, Arg1=%s\n", command, containerimage, cwd, argv[1] ? argv[1] : "");
 
+    message(DEBUG, "Checking for namespace daemon pidfile\n");
+    if ( is_file(joinpath(sessiondir, "daemon.pid")) == 0 ) {
+        FILE *test_daemon_fp;
+
+        if ( ( test_daemon_fp = fopen(joinpath(sessiondir, "daemon.pid"), "r") ) == NULL ) { // Flawfinder: ignore
+            message(ERROR, "Could not open daemon pid file %s: %s\n", joinpath(sessiondir, "daemon.pid"), strerror(errno));
+            ABORT(255);
+        }
+
+        message(DEBUG, "Checking if namespace daemon is running\n");
+        if ( flock(fileno(test_daemon_fp), LOCK_SH | LOCK_NB) != 0 ) {
+            // Held open so the daemon can not be swapped for whatever
+            // reuses its PID before we join it
+            if ( ( daemon_ns_fd = namespace_open(test_daemon_fp, &daemon_pid, uid) ) < 0 ) {
+                message(WARNING, "Singularity namespace daemon pid exists, but daemon not alive?\n");
+            }
+        } else {
+            message(WARNING, "Singularity namespace daemon pid exists, but daemon not alive?\n");
+        }
+        if ( fclose(test_daemon_fp) ) {
+            message(ERROR, "Could not close file %s: %s\n", joinpath(sessiondir, "daemon.pid"), strerror(errno));
+            ABORT(255);
+        }
+    }
+
+    if ( strcmp(command, "checkpoint") == 0 ) {
+        char *loop_dev_path = NULL;
+
+        if ( daemon_pid <= 0 ) {
+            message(ERROR, "No namespace daemon is running for this container\n");
+            ABORT(1);
+        }
+        if ( container_is_image > 0 && ( loop_dev_path = filecat(joinpath(sessiondir, "loop_dev")) ) == NULL ) {
+            message(ERROR, "Could not find the loop device of the namespace daemon\n");
+            ABORT(255);
+        }
+
+        message(VERBOSE, "Checkpointing namespace daemon %d to %s\n", daemon_pid, checkpointdir);
+        priv_escalate();
+        retval = checkpoint_dump(checkpointdir, daemon_pid, loop_dev_path, getenv("SINGULARITY_CHECKPOINT_LEAVE") != NULL); // Flawfinder: ignore (only checking for existance)
+        priv_drop();
+
+        close(cwd_fd);
+        return(retval < 0 ? 255 : 0);
+    }
+    if ( strcmp(command, "restore") == 0 ) {
+        int restorable;
+
+        if ( daemon_pid > 0 ) {
+            message(ERROR, "A namespace daemon is already running for this container\n");
+            ABORT(1);
+        }
+
+        // The restore itself only runs once we are in the background,
+        // where nobody would see it fail
+        priv_escalate();
+        restorable = checkpoint_check(checkpointdir);
+        priv_drop();
+        if ( restorable < 0 ) {
+            ABORT(1);
+        }
+    }
+
+    // A warm pool hands the request to a container process that has
+    // already been set up; without one this is a failed connect().  Its
+    // members are in no job's namespaces, so job launches set up their own.
+    if ( tasks_fp == NULL && getenv("SINGULARITY_JOB_NS") == NULL && getenv("SINGULARITY_MPI") == NULL && ( strcmp(command, "run") == 0 || strcmp(command, "exec") == 0 || strcmp(command, "shell") == 0 ) ) { // Flawfinder: ignore (only checking for existance of envar)
+        if ( ( retval = daemon_socket_exec(pool_socket_path(), command, argc, argv, cwd, cwd_fd, process_mask) ) >= 0 ) {
+            return(retval);
+        }
+        retval = 0;
+    }
+
+    // A running daemon can start the process for us inside its namespaces,
+    // which skips the rest of the launch entirely
+    if ( daemon_pid > 0 && tasks_fp == NULL && ( strcmp(command, "run") == 0 || strcmp(command, "exec") == 0 || strcmp(command, "shell") == 0 ) ) {
+        message(VERBOSE, "Requesting %s from namespace daemon\n", command);
+        if ( ( retval = daemon_socket_exec(joinpath(sessiondir, "daemon.sock"), command, argc, argv, cwd, cwd_fd, process_mask) ) >= 0 ) {
+            return(retval);
+        }
+        message(VERBOSE, "Namespace daemon socket not available, joining namespaces\n");
+        retval = 0;
+    }
+
+    // Containers of one job share its PID and IPC namespaces and /dev/shm
+    if ( getenv("SINGULARITY_JOB_NS") != NULL && ( strcmp(command, "run") == 0 || strcmp(command, "exec") == 0 || strcmp(command, "shell") == 0 ) ) { // Flawfinder: ignore (only checking for existance of envar)
+        char *job = mpi_job_id();
+        char *jobname;
+
+        unsetenv("SINGULARITY_JOB_NS");
+        if ( daemon_pid > 0 ) {
+            message(WARNING, "Not sharing job namespaces with a namespace daemon running\n");
+        } else if ( job == NULL ) {
+            message(WARNING, "No job identifier (SINGULARITY_JOB_ID), not sharing job namespaces\n");
+        } else {
+            jobname = strjoin(int2str(uid), strjoin(".", job));
+            priv_escalate();
+            job_shmdir = job_namespace_join(strjoin(sessiondir_prefix, strjoin("job-", jobname)), strjoin("/dev/shm/.singularity-job-", jobname));
+            job_namespace = 1;
+            priv_drop();
+        }
+    }
+
+    // Ranks of one MPI job on this node share the container set up by
+    // whichever of them gets here first
+    if ( daemon_pid <= 0 && tasks_fp == NULL && getenv("SINGULARITY_MPI") != NULL && ( strcmp(command, "run") == 0 || strcmp(command, "exec") == 0 || strcmp(command, "shell") == 0 ) ) { // Flawfinder: ignore (only checking for existance of envar)
+        char *job = mpi_job_id();
+
+        unsetenv("SINGULARITY_MPI");
+        if ( job != NULL ) {
+            priv_escalate();
+            if ( s_mkpath(sessiondir, 0755) < 0 || is_owner(sessiondir, 0, 0) < 0 ) {
+                message(ERROR, "Could not create session directory: %s\n", sessiondir);
+                ABORT(255);
+            }
+            mpi_fp = mpi_job_open(joinpath(sessiondir, strjoin(strjoin("mpi.", int2str(uid)), strjoin(".", job))), &daemon_pid, &daemon_ns_fd);
+            priv_drop();
+            free(job);
+        }
+    }
+
+    // Joining a running daemon needs nothing from the image, loop device or
+    // session directory; the daemon's namespaces already hold all of that.
+    if ( daemon_pid > 0 && ( strcmp(command, "run") == 0 || strcmp(command, "exec") == 0 || strcmp(command, "shell") == 0 ) ) {
+        message(VERBOSE, "Joining namespaces of container process: %d\n", daemon_pid);
+
+        message(VERBOSE3, "Entering privileged runtime\n");
+        priv_escalate();
+
+        // Joining a PID namespace only applies to our children, so do it
+        // here; the container process joins the mount namespace itself.
+        namespace_join_pid(daemon_pid, daemon_ns_fd);
+
+        retval = container_launch(0, NULL);
+
+        close(cwd_fd);
+        return(retval);
+    }
+
     if (container_is_image > 0 ) {
         message(DEBUG, "Checking if we are opening image as read/write\n");
         if ( getenv("SINGULARITY_WRITABLE") == NULL ) { // Flawfinder: ignore (only checking for existance of getenv)
@@ -270,30 +1067,7 @@ int main(int argc, char ** argv) {
         }
     }
 
-    message(DEBUG, "Checking for namespace daemon pidfile\n");
-    if ( is_file(joinpath(sessiondir, "daemon.pid")) == 0 ) {
-        FILE *test_daemon_fp;
-
-        if ( ( test_daemon_fp = fopen(joinpath(sessiondir, "daemon.pid"), "r") ) == NULL ) { // Flawfinder: ignore
-            message(ERROR, "Could not open daemon pid file %s: %s\n", joinpath(sessiondir, "daemon.pid"), strerror(errno));
-            ABORT(255);
-        }
-
-        message(DEBUG, "Checking if namespace daemon is running\n");
-        if ( flock(fileno(test_daemon_fp), LOCK_SH | LOCK_NB) != 0 ) {
-            if ( fscanf(test_daemon_fp, "%d", &daemon_pid) <= 0 ) {
-                message(ERROR, "Could not read daemon process ID\n");
-                ABORT(255);
-            }
-
-        } else {
-            message(WARNING, "Singularity namespace daemon pid exists, but daemon not alive?\n");
-        }
-        if ( fclose(test_daemon_fp) ) {
-            message(ERROR, "Could not close file %s: %s\n", joinpath(sessiondir, "daemon.pid"), strerror(errno));
-            ABORT(255);
-        }
-    }
+    timing_mark("image");
 
 
 //****************************************************************************//
@@ -317,6 +1091,7 @@ int main(int argc, char ** argv) {
         ABORT(255);
     }
 
+    // Files in the session directory are opened relative to this too
     message(DEBUG, "Opening sessiondir file descriptor\n");
     if ( ( sessiondirlock_fd = open(sessiondir, O_RDONLY) ) < 0 ) { // Flawfinder: ignore
         message(ERROR, "Could not obtain file descriptor on %s: %s\n", sessiondir, strerror(errno));
@@ -328,18 +1103,17 @@ int main(int argc, char ** argv) {
         ABORT(255);
     }
 
-    message(DEBUG, "Caching info into sessiondir\n");
-    if ( fileput(joinpath(sessiondir, "image"), containername) < 0 ) {
-        message(ERROR, "Could not write container name to %s\n", joinpath(sessiondir, "image"));
-        ABORT(255);
+    timing_mark("sessiondir");
+
+    if ( strcmp(command, "stop") != 0 && strcmp(command, "restore") != 0 ) {
+        setup_start("identity", setup_identity);
     }
 
     if ( container_is_image > 0 ) {
         message(DEBUG, "Checking for set loop device\n");
-        loop_dev_lock = joinpath(sessiondir, "loop_dev.lock");
         loop_dev_cache = joinpath(sessiondir, "loop_dev");
-        if ( ( loop_dev_lock_fd = open(loop_dev_lock, O_CREAT | O_RDWR, 0644) ) < 0 ) { // Flawfinder: ignore
-            message(ERROR, "Could not open loop_dev_lock %s: %s\n", loop_dev_lock, strerror(errno));
+        if ( ( loop_dev_lock_fd = openat(sessiondirlock_fd, "loop_dev.lock", O_CREAT | O_RDWR, 0644) ) < 0 ) { // Flawfinder: ignore
+            message(ERROR, "Could not open loop_dev_lock %s/loop_dev.lock: %s\n", sessiondir, strerror(errno));
             ABORT(255);
         }
 
@@ -353,6 +1127,15 @@ int main(int argc, char ** argv) {
                 ABORT(255);
             }
 
+            // Only the process attaching the loop device tunes it; later
+            // launches in this session share the same device.
+            if ( config_get_key_bool("loop direct io", 0) > 0 ) {
+                loop_set_direct_io(loop_dev);
+            }
+            if ( ( loop_read_ahead = config_get_key_int("loop read ahead", -1) ) >= 0 ) {
+                loop_set_read_ahead(loop_dev, loop_read_ahead);
+            }
+
             message(DEBUG, "Writing loop device name to loop_dev: %s\n", loop_dev);
             if ( fileput(loop_dev_cache, loop_dev) < 0 ) {
                 message(ERROR, "Could not write to loop_dev_cache %s: %s\n", loop_dev_cache, strerror(errno));
@@ -377,7 +1160,7 @@ int main(int argc, char ** argv) {
             }
 
             message(DEBUG, "Exclusive lock on loop_dev lockfile released, getting loop_dev\n");
-            if ( ( loop_dev = filecat(loop_dev_cache) ) == NULL ) {
+            if ( ( loop_dev = filecat_at(sessiondirlock_fd, "loop_dev") ) == NULL ) {
                 message(ERROR, "Could not retrieve loop_dev_cache from %s\n", loop_dev_cache);
                 ABORT(255);
             }
@@ -389,6 +1172,7 @@ int main(int argc, char ** argv) {
             message(ERROR, "Could not open loop device %s: %s\n", loop_dev, strerror(errno));
             ABORT(255);
         }
+        timing_mark("loop");
     }
 
     message(DEBUG, "Creating container image mount path: %s\n", containerdir);
@@ -401,10 +1185,59 @@ int main(int argc, char ** argv) {
         ABORT(255);
     }
 
+    // Everything from here on may change privileges or fork
+    setup_join();
+    timing_mark("setup");
+
 
 
     // Manage the daemon bits early
-    if ( strcmp(command, "start") == 0 ) {
+    if ( strcmp(command, "start") == 0 && getenv("SINGULARITY_POOL") != NULL ) { // Flawfinder: ignore (pool size, checked below)
+        int pool_fd;
+
+        message(DEBUG, "Container pool requested\n");
+
+        pool_size = strtol(getenv("SINGULARITY_POOL"), NULL, 10); // Flawfinder: ignore
+        if ( pool_size < 1 ) {
+            message(ERROR, "Invalid container pool size: %s\n", getenv("SINGULARITY_POOL")); // Flawfinder: ignore
+            ABORT(1);
+        }
+        if ( getenv("SINGULARITY_POOL_IDLE") != NULL ) { // Flawfinder: ignore
+            pool_idle = strtol(getenv("SINGULARITY_POOL_IDLE"), NULL, 10); // Flawfinder: ignore
+        }
+        unsetenv("SINGULARITY_POOL");
+        unsetenv("SINGULARITY_POOL_IDLE");
+
+        message(DEBUG, "Creating container pool pidfile: %s\n", joinpath(sessiondir, "pool.pid"));
+        if ( ( pool_fd = openat(sessiondirlock_fd, "pool.pid", O_RDWR | O_CREAT, 0644) ) < 0 || ( pool_fp = fdopen(pool_fd, "r+") ) == NULL ) { // Flawfinder: ignore
+            message(ERROR, "Could not open pool pid file for writing %s: %s\n", joinpath(sessiondir, "pool.pid"), strerror(errno));
+            ABORT(255);
+        }
+        if ( flock(pool_fd, LOCK_EX | LOCK_NB) != 0 ) {
+            message(ERROR, "Could not obtain lock, another container pool running?\n");
+            ABORT(255);
+        }
+        // Only now that the lock is ours, or a running pool's record goes
+        if ( ftruncate(pool_fd, 0) < 0 ) {
+            message(ERROR, "Could not truncate pool pid file: %s\n", strerror(errno));
+            ABORT(255);
+        }
+
+        pool_sock_path = xstrdup(pool_socket_path());
+        message(VERBOSE, "Creating pool control socket: %s\n", pool_sock_path);
+        if ( ( pool_sock_fd = daemon_socket_create(pool_sock_path, uid, getgid()) ) < 0 ) {
+            ABORT(255);
+        }
+
+        message(DEBUG, "Forking background pool manager process\n");
+        if ( daemon(0, 0) < 0 ) {
+            message(ERROR, "Could not daemonize: %s\n", strerror(errno));
+            ABORT(255);
+        }
+        if ( namespace_record(pool_fp, getpid()) < 0 ) {
+            ABORT(255);
+        }
+    } else if ( strcmp(command, "start") == 0 || strcmp(command, "restore") == 0 ) {
 #ifdef NO_SETNS
         message(ERROR, "This host does not support joining existing name spaces\n");
         ABORT(1);
@@ -414,16 +1247,16 @@ int main(int argc, char ** argv) {
         message(DEBUG, "Namespace daemon function requested\n");
 
         message(DEBUG, "Creating namespace daemon pidfile: %s\n", joinpath(sessiondir, "daemon.pid"));
-        if ( is_file(joinpath(sessiondir, "daemon.pid")) == 0 ) {
-            if ( ( daemon_fp = fopen(joinpath(sessiondir, "daemon.pid"), "r+") ) == NULL ) { // Flawfinder: ignore
-                message(ERROR, "Could not open daemon pid file for writing %s: %s\n", joinpath(sessiondir, "daemon.pid"), strerror(errno));
-                ABORT(255);
-            }
-        } else {
-            if ( ( daemon_fp = fopen(joinpath(sessiondir, "daemon.pid"), "w") ) == NULL ) { // Flawfinder: ignore
-                message(ERROR, "Could not open daemon pid file for writing %s: %s\n", joinpath(sessiondir, "daemon.pid"), strerror(errno));
-                ABORT(255);
-            }
+        if ( ( daemon_fd = openat(sessiondirlock_fd, "daemon.pid", O_RDWR | O_CREAT, 0666) ) < 0 || ( daemon_fp = fdopen(daemon_fd, "r+") ) == NULL ) { // Flawfinder: ignore
+            message(ERROR, "Could not open daemon pid file for writing %s: %s\n", joinpath(sessiondir, "daemon.pid"), strerror(errno));
+            ABORT(255);
+        }
+
+        // Only 'singularity status' wants the name, for running daemons
+        message(DEBUG, "Caching info into sessiondir\n");
+        if ( fileput(joinpath(sessiondir, "image"), containername) < 0 ) {
+            message(ERROR, "Could not write container name to %s\n", joinpath(sessiondir, "image"));
+            ABORT(255);
         }
 
         message(VERBOSE, "Creating daemon.comm fifo\n");
@@ -434,12 +1267,28 @@ int main(int argc, char ** argv) {
             }
         }
 
-        daemon_fd = fileno(daemon_fp);
         if ( flock(daemon_fd, LOCK_EX | LOCK_NB) != 0 ) {
             message(ERROR, "Could not obtain lock, another daemon process running?\n");
             ABORT(255);
         }
 
+        if ( strcmp(command, "restore") == 0 ) {
+            // CRIU binds the daemon's socket again itself
+            unlink(joinpath(sessiondir, "daemon.sock"));
+        } else {
+            // Opened read/write so neither the open nor the reads see EOF
+            // between `singularity stop` writers
+            if ( ( daemon_comm_fd = openat(sessiondirlock_fd, "daemon.comm", O_RDWR | O_CLOEXEC) ) < 0 ) { // Flawfinder: ignore
+                message(ERROR, "Could not open communication fifo: %s\n", strerror(errno));
+                ABORT(255);
+            }
+
+            message(VERBOSE, "Creating daemon.sock control socket\n");
+            if ( ( daemon_sock_fd = daemon_socket_create(joinpath(sessiondir, "daemon.sock"), uid, getgid()) ) < 0 ) {
+                ABORT(255);
+            }
+        }
+
         message(DEBUG, "Forking background daemon process\n");
         if ( daemon(0, 0) < 0 ) {
             message(ERROR, "Could not daemonize: %s\n", strerror(errno));
@@ -448,6 +1297,9 @@ int main(int argc, char ** argv) {
 #endif
     } else if ( strcmp(command, "stop") == 0 ) {
         message(DEBUG, "Stopping namespace daemon process\n");
+        if ( pool_stop(sessiondir, uid) > 0 && is_file(joinpath(sessiondir, "daemon.pid")) < 0 ) {
+            return(0);
+        }
         return(container_daemon_stop(sessiondir));
     }
 
@@ -458,299 +1310,27 @@ int main(int argc, char ** argv) {
 //****************************************************************************//
 
 
-    message(VERBOSE, "Creating namespace process\n");
-    // Fork off namespace process
-    namespace_fork_pid = fork();
-    if ( namespace_fork_pid == 0 ) {
-
-        message(DEBUG, "Hello from namespace child process\n");
-        if ( daemon_pid == -1 ) {
-            namespace_unshare();
-
-            config_rewind();
-            int slave = config_get_key_bool("mount slave", 0);
-            // Privatize the mount namespaces
-#ifdef SINGULARITY_MS_SLAVE
-            message(DEBUG, "Making mounts %s\n", (slave ? "slave" : "private"));
-            if ( mount(NULL, "/", NULL, (slave ? MS_SLAVE : MS_PRIVATE)|MS_REC, NULL) < 0 ) {
-                message(ERROR, "Could not make mountspaces %s: %s\n", (slave ? "slave" : "private"), strerror(errno));
-                ABORT(255);
-            }
-#else
-            if ( slave > 0 ) {
-                message(WARNING, "Requested option 'mount slave' is not available on this host, using private\n");
-            }
-            message(DEBUG, "Making mounts private\n");
-            if ( mount(NULL, "/", NULL, MS_PRIVATE | MS_REC, NULL) < 0 ) {
-                message(ERROR, "Could not make mountspaces %s: %s\n", (slave ? "slave" : "private"), strerror(errno));
-                ABORT(255);
-            }
-#endif
-
-            if ( container_is_image > 0 ) {
-                if ( getenv("SINGULARITY_WRITABLE") == NULL ) { // Flawfinder: ignore (only checking for existance of envar)
-                    message(DEBUG, "Mounting Singularity image file read only\n");
-                    if ( mount_image(loop_dev, containerdir, 0) < 0 ) {
-                        ABORT(255);
-                    }
-                } else {
-                    unsetenv("SINGULARITY_WRITABLE");
-                    message(DEBUG, "Mounting Singularity image file read/write\n");
-                    if ( mount_image(loop_dev, containerdir, 1) < 0 ) {
-                        ABORT(255);
-                    }
-                }
-            } else if ( container_is_dir > 0 ) {
-            // TODO: container directories should also be mountable readwrite?
-                message(DEBUG, "Mounting Singularity chroot read only\n");
-                mount_bind(containerimage, containerdir, 0);
-            }
-
-
-            // /bin/sh MUST exist as the minimum requirements for a container
-            message(DEBUG, "Checking if container has /bin/sh\n");
-            if ( is_exec(joinpath(containerdir, "/bin/sh")) < 0 ) {
-                message(ERROR, "Container image does not have a valid /bin/sh\n");
-                ABORT(1);
-            }
-
-
-            // Bind mounts
-            message(DEBUG, "Checking to see if we are running contained\n");
-            if ( getenv("SINGULARITY_CONTAIN") == NULL ) { // Flawfinder: ignore (only checking for existance of envar)
-                unsetenv("SINGULARITY_CONTAIN");
-
-                message(DEBUG, "Checking configuration file for 'mount home'\n");
-                config_rewind();
-                if ( config_get_key_bool("mount home", 1) > 0 ) {
-                    mount_home(containerdir);
-                } else {
-                    message(VERBOSE2, "Not mounting home directory per config\n");
-                }
-
-                bind_paths(containerdir);
-
-            }
-
-        } else {
-            namespace_join(daemon_pid);
-        }
-
-        if ( uid != 0 ) { // If we are root, no need to mess with passwd or group
-            message(DEBUG, "Checking configuration file for 'config passwd'\n");
-            config_rewind();
-            if ( config_get_key_bool("config passwd", 1) > 0 ) {
-                if ( is_file(joinpath(sessiondir, "/passwd")) < 0 ) {
-                    if (is_file(joinpath(containerdir, "/etc/passwd")) == 0 ) {
-                        message(VERBOSE2, "Creating template of /etc/passwd for containment\n");
-                        if ( ( copy_file(joinpath(containerdir, "/etc/passwd"), joinpath(sessiondir, "/passwd")) ) < 0 ) {
-                            message(ERROR, "Failed copying template passwd file to sessiondir\n");
-                            ABORT(255);
-                        }
-                    }
-                    message(VERBOSE2, "Staging /etc/passwd with user info\n");
-                    update_passwd_file(joinpath(sessiondir, "/passwd"));
-                    message(VERBOSE, "Binding staged /etc/passwd into container\n");
-                    mount_bind(joinpath(sessiondir, "/passwd"), joinpath(containerdir, "/etc/passwd"), 0);
-                }
-            } else {
-                message(VERBOSE, "Not staging /etc/passwd per config\n");
-            }
-
-            message(DEBUG, "Checking configuration file for 'config group'\n");
-            config_rewind();
-            if ( config_get_key_bool("config group", 1) > 0 ) {
-                if ( is_file(joinpath(sessiondir, "/group")) < 0 ) {
-                    if (is_file(joinpath(containerdir, "/etc/group")) == 0 ) {
-                        message(VERBOSE2, "Creating template of /etc/group for containment\n");
-                        if ( ( copy_file(joinpath(containerdir, "/etc/group"), joinpath(sessiondir, "/group")) ) < 0 ) {
-                            message(ERROR, "Failed copying template group file to sessiondir\n");
-                            ABORT(255);
-                        }
-                    }
-                    message(VERBOSE2, "Staging /etc/group with user info\n");
-                    update_group_file(joinpath(sessiondir, "/group"));
-                    message(VERBOSE, "Binding staged /etc/group into container\n");
-                    mount_bind(joinpath(sessiondir, "/group"), joinpath(containerdir, "/etc/group"), 0);
-                }
-            } else {
-                message(VERBOSE, "Not staging /etc/group per config\n");
-            }
-        } else {
-            message(VERBOSE, "Not staging passwd or group (running as root)\n");
-        }
-
-        // Fork off exec process
-        message(VERBOSE, "Forking exec process\n");
-
-        exec_fork_pid = fork();
-        if ( exec_fork_pid == 0 ) {
-            message(DEBUG, "Hello from exec child process\n");
-
-            message(VERBOSE, "Entering container file system space\n");
-            if ( chroot(containerdir) < 0 ) { // Flawfinder: ignore (yep, yep, yep... we know!)
-                message(ERROR, "failed enter CONTAINERIMAGE: %s\n", containerdir);
-                ABORT(255);
-            }
-            message(DEBUG, "Changing dir to '/' within the new root\n");
-            if ( chdir("/") < 0 ) {
-                message(ERROR, "Could not chdir after chroot to /: %s\n", strerror(errno));
-                ABORT(1);
-            }
-
-
-            if ( daemon_pid < 0 ) {
-                // Mount /proc if we are configured
-                message(DEBUG, "Checking configuration file for 'mount proc'\n");
-                config_rewind();
-                if ( config_get_key_bool("mount proc", 1) > 0 ) {
-                    if ( is_dir("/proc") == 0 ) {
-                        message(VERBOSE, "Mounting /proc\n");
-                        if ( mount("proc", "/proc", "proc", 0, NULL) < 0 ) {
-                            message(ERROR, "Could not mount /proc: %s\n", strerror(errno));
-                            ABORT(255);
-                        }
-                    } else {
-                        message(WARNING, "Not mounting /proc, container has no bind directory\n");
-                    }
-                } else {
-                    message(VERBOSE, "Skipping /proc mount\n");
-                }
-
-                // Mount /sys if we are configured
-                message(DEBUG, "Checking configuration file for 'mount sys'\n");
-                config_rewind();
-                if ( config_get_key_bool("mount sys", 1) > 0 ) {
-                    if ( is_dir("/sys") == 0 ) {
-                        message(VERBOSE, "Mounting /sys\n");
-                        if ( mount("sysfs", "/sys", "sysfs", 0, NULL) < 0 ) {
-                            message(ERROR, "Could not mount /sys: %s\n", strerror(errno));
-                            ABORT(255);
-                        }
-                    } else {
-                        message(WARNING, "Not mounting /sys, container has no bind directory\n");
-                    }
-                } else {
-                    message(VERBOSE, "Skipping /sys mount\n");
-                }
-            }
-
-
-            // Drop all privileges for good
-            message(VERBOSE3, "Dropping all privileges\n");
-            priv_drop_perm();
-
-            // Change to the proper directory
-            message(VERBOSE2, "Changing to correct working directory: %s\n", cwd);
-            if ( is_dir(cwd) == 0 ) {
-               if ( chdir(cwd) < 0 ) {
-                    message(ERROR, "Could not chdir to: %s: %s\n", cwd, strerror(errno));
-                    ABORT(1);
-                }
-            } else {
-                if ( fchdir(cwd_fd) < 0 ) {
-                    message(ERROR, "Could not fchdir to cwd: %s\n", strerror(errno));
-                    ABORT(1);
-                }
-            }
-
-            // Resetting umask
-            umask(process_mask); // Flawfinder: ignore (resetting back to original umask)
-
-            // After this, we exist only within the container... Let's make it known!
-            message(DEBUG, "Setting environment variable 'SINGULARITY_CONTAINER=1'\n");
-            if ( setenv("SINGULARITY_CONTAINER", containername, 1) != 0 ) {
-                message(ERROR, "Could not set SINGULARITY_CONTAINER to '%s'\n", containername);
-                ABORT(1);
-            }
-
-#ifdef SINGULARITY_NO_NEW_PRIVS
-            // Prevent this container from gaining any future privileges.
-            message(DEBUG, "Setting NO_NEW_PRIVS to prevent future privilege escalations.\n");
-            if ( prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0 ) {
-                message(ERROR, "Could not set NO_NEW_PRIVS safeguard: %s\n", strerror(errno));
-                ABORT(1);
-            }
-#else  // SINGULARITY_NO_NEW_PRIVS
-            message(VERBOSE2, "Not enabling NO_NEW_PRIVS flag due to lack of compile-time support.\n");
-#endif
-            // Do what we came here to do!
-            if ( command == NULL ) {
-                message(WARNING, "No command specified, launching 'shell'\n");
-                command = xstrdup("shell");
-            }
-            if ( strcmp(command, "run") == 0 ) {
-                message(VERBOSE, "COMMAND=run\n");
-                if ( container_run(argc, argv) < 0 ) {
-                    ABORT(255);
-                }
-            }
-            if ( strcmp(command, "exec") == 0 ) {
-                message(VERBOSE, "COMMAND=exec\n");
-                if ( container_exec(argc, argv) < 0 ) {
-                    ABORT(255);
-                }
-            }
-            if ( strcmp(command, "shell") == 0 ) {
-                message(VERBOSE, "COMMAND=shell\n");
-                if ( container_shell(argc, argv) < 0 ) {
-                    ABORT(255);
-                }
-            }
-            if ( strcmp(command, "start") == 0 ) {
-                message(VERBOSE, "COMMAND=start\n");
-                if ( container_daemon_start(sessiondir) < 0 ) {
-                    ABORT(255);
-                }
-                return(0);
-            }
-
-            message(ERROR, "Unknown command: %s\n", command);
-            ABORT(255);
-
-
-        // Wait for exec process to finish
-        } else if ( exec_fork_pid > 0 ) {
-            int tmpstatus;
-
-            if ( strcmp(command, "start") == 0 ) {
-                if ( fprintf(daemon_fp, "%d", exec_fork_pid) < 0 ) {
-                    message(ERROR, "Could not write to daemon pid file: %s\n", strerror(errno));
-                    ABORT(255);
-                }
-                fflush(daemon_fp);
-            }
-
-            argv[0] = xstrdup("Singularity: exec");
-
-            message(VERBOSE3, "Dropping privilege...\n");
-            priv_drop();
-
-            message(VERBOSE2, "Waiting for Exec process...\n");
-
-            waitpid(exec_fork_pid, &tmpstatus, 0);
-            retval = WEXITSTATUS(tmpstatus);
-        } else {
-            message(ERROR, "Could not fork exec process: %s\n", strerror(errno));
-            ABORT(255);
-        }
-
-        message(VERBOSE, "Exec parent process returned: %d\n", retval);
-        return(retval);
-
-    // Wait for namespace process to finish
-    } else if ( namespace_fork_pid > 0 ) {
-        int tmpstatus;
-        argv[0] = xstrdup("Singularity: namespace");
-
-        message(VERBOSE3, "Dropping privilege...\n");
+    if ( pool_sock_fd >= 0 ) {
+        message(VERBOSE, "Starting container pool of %d\n", pool_size);
+        pool_clone_flags = namespace_clone_flags();
+        sigprocmask(SIG_SETMASK, NULL, &container_sigmask);
         priv_drop();
+        retval = pool_serve(pool_sock_fd, pool_size, pool_idle, pool_spawn);
 
-        waitpid(namespace_fork_pid, &tmpstatus, 0);
-        retval = WEXITSTATUS(tmpstatus);
+        priv_escalate();
+        unlink(pool_sock_path);
+        priv_drop();
+    } else if ( strcmp(command, "restore") == 0 ) {
+        message(VERBOSE, "Restoring namespace daemon from %s\n", checkpointdir);
+        retval = container_restore(daemon_fp);
+    } else if ( mpi_fp != NULL || job_namespace > 0 ) {
+        // A new PID namespace would end with this rank, taking every rank
+        // that joined it along.  A job's PID namespace is already joined.
+        message(VERBOSE, "Creating container process for job\n");
+        retval = container_launch(namespace_clone_flags() & ~CLONE_NEWPID, mpi_fp != NULL ? mpi_fp : daemon_fp);
     } else {
-        message(ERROR, "Could not fork management process: %s\n", strerror(errno));
-        ABORT(255);
+        message(VERBOSE, "Creating container process\n");
+        retval = container_launch(namespace_clone_flags(), daemon_fp);
     }
 
     message(VERBOSE2, "Starting cleanup...\n");
@@ -789,8 +1369,5 @@ int main(int argc, char ** argv) {
     /* fixme:  Is this intended, given above comment? */
     close(sessiondirlock_fd);
 
-    free(loop_dev_lock);
-    free(sessiondir);
-
     return(retval);
 }
@@ -0,0 +1,160 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "config.h"
+#include "util.h"
+#include "arena.h"
+#include "message.h"
+#include "timing.h"
+
+
+#define TIMING_MAX_MARKS 24
+
+#define TIMING_OFF 0
+#define TIMING_STDERR 1
+#define TIMING_SYSLOG 2
+#define TIMING_FILE 3
+
+static struct {
+    const char *phase;
+    struct timespec ts;
+} timing_marks[TIMING_MAX_MARKS];
+
+static int timing_count = 0;
+static int timing_mode = TIMING_OFF;
+static int timing_fd = -1;
+static pid_t timing_pid = 0;
+
+
+static long timing_diff_us(struct timespec *start, struct timespec *end) {
+    return( ( end->tv_sec - start->tv_sec ) * 1000000L + ( end->tv_nsec - start->tv_nsec ) / 1000L );
+}
+
+void timing_start(void) {
+    timing_count = 0;
+    timing_pid = getpid();
+    timing_mark("start");
+}
+
+void timing_init(void) {
+    char *dest = getenv("SINGULARITY_TIMING"); // Flawfinder: ignore (only compared or opened as the calling user)
+
+    if ( dest == NULL || dest[0] == '\0' ) {
+        return;
+    }
+    unsetenv("SINGULARITY_TIMING");
+
+    if ( strcmp(dest, "stderr") == 0 || strcmp(dest, "1") == 0 ) {
+        timing_mode = TIMING_STDERR;
+    } else if ( strcmp(dest, "syslog") == 0 ) {
+        // Connect now, /dev/log is unlikely to exist after the chroot
+        openlog("Singularity", LOG_NDELAY, LOG_LOCAL0);
+        timing_mode = TIMING_SYSLOG;
+    } else {
+        // Must be called with privileges dropped, so the file is opened
+        // with the caller's permissions and resolved on the host.
+        if ( ( timing_fd = open(dest, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644) ) < 0 ) { // Flawfinder: ignore
+            message(WARNING, "Could not open timing output %s: %s\n", dest, strerror(errno));
+            return;
+        }
+        timing_mode = TIMING_FILE;
+    }
+
+    message(DEBUG, "Launch timing enabled: %s\n", dest);
+}
+
+void timing_set_pid(pid_t pid) {
+    timing_pid = pid;
+}
+
+void timing_mark(const char *phase) {
+    if ( timing_count >= TIMING_MAX_MARKS ) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &timing_marks[timing_count].ts);
+    timing_marks[timing_count].phase = phase;
+    timing_count++;
+}
+
+void timing_report(const char *command) {
+    char record[1024]; // Flawfinder: ignore (all writes bounded by sizeof record)
+    struct arena_mark mark;
+    size_t len;
+    int i;
+
+    if ( timing_mode == TIMING_OFF || timing_count < 1 ) {
+        return;
+    }
+
+    timing_mark("exec");
+
+    // One JSON object per launch, durations in microseconds since the
+    // previous mark
+    mark = arena_save();
+    len = snprintf(record, sizeof(record), "{\"pid\":%d,\"uid\":%d,\"command\":%s,\"phases\":{", // Flawfinder: ignore
+                   timing_pid, getuid(), json_string(command ? command : ""));
+    arena_restore(mark);
+    for ( i = 1; i < timing_count && len < sizeof(record); i++ ) {
+        len += snprintf(&record[len], sizeof(record) - len, "%s\"%s\":%ld", ( i > 1 ) ? "," : "", // Flawfinder: ignore
+                        timing_marks[i].phase, timing_diff_us(&timing_marks[i - 1].ts, &timing_marks[i].ts));
+    }
+    if ( len < sizeof(record) ) {
+        len += snprintf(&record[len], sizeof(record) - len, "},\"total\":%ld}\n", // Flawfinder: ignore
+                        timing_diff_us(&timing_marks[0].ts, &timing_marks[timing_count - 1].ts));
+    }
+    if ( len >= sizeof(record) ) {
+        message(WARNING, "Launch timing record truncated\n");
+        return;
+    }
+
+    switch (timing_mode) {
+        case TIMING_STDERR:
+            if ( write(STDERR_FILENO, record, len) < 0 ) {
+                message(WARNING, "Could not write launch timing: %s\n", strerror(errno));
+            }
+            break;
+        case TIMING_SYSLOG:
+            record[len - 1] = '\0';
+            syslog(LOG_INFO, "timing %s", record);
+            break;
+        case TIMING_FILE:
+            // O_APPEND with a single write keeps concurrent launches' records whole
+            if ( write(timing_fd, record, len) < 0 ) {
+                message(WARNING, "Could not write launch timing: %s\n", strerror(errno));
+            }
+            close(timing_fd);
+            timing_fd = -1;
+            break;
+    }
+
+    timing_mode = TIMING_OFF;
+}
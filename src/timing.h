@@ -0,0 +1,34 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+// Cheap monotonic timestamps at launch phase boundaries.  Marks are always
+// recorded; a record is only emitted when SINGULARITY_TIMING is set to
+// "stderr", "syslog" or a file to append to.
+// timing_start() should be the first thing main() does; timing_init()
+// opens the output and must be called with privileges dropped.
+// timing_set_pid() names the process the record is reported as; the
+// report itself is written from inside the PID namespace, where
+// getpid() would always be 1.
+void timing_start(void);
+void timing_init(void);
+void timing_set_pid(pid_t pid);
+void timing_mark(const char *phase);
+void timing_report(const char *command);
@@ -38,6 +38,7 @@
 #include "config.h"
 #include "message.h"
 #include "util.h"
+#include "arena.h"
 
 void *xmalloc(size_t l) {
     void *m = malloc(l);
@@ -68,7 +69,7 @@ int intlen(int input) {
 char *int2str(int num) {
     char *ret;
     
-    ret = (char *) xmalloc(intlen(num) + 1);
+    ret = (char *) arena_alloc(intlen(num) + 1);
 
     snprintf(ret, intlen(num) + 1, "%d", num); // Flawfinder: ignore
 
@@ -78,7 +79,7 @@ char *int2str(int num) {
 char *joinpath(char * path1, char * path2) {
     char *ret;
 
-    ret = (char *) xmalloc(strlen(path1) + strlen(path2) + 2);
+    ret = (char *) arena_alloc(strlen(path1) + strlen(path2) + 2);
     snprintf(ret, strlen(path1) + strlen(path2) + 2, "%s/%s", path1, path2); // Flawfinder: ignore
 
     return(ret);
@@ -88,12 +89,47 @@ char *strjoin(char *str1, char *str2) {
     char *ret;
     int len = strlen(str1) + strlen(str2) + 1;
 
-    ret = (char *) xmalloc(len);
+    ret = (char *) arena_alloc(len);
     snprintf(ret, len, "%s%s", str1, str2); // Flawfinder: ignore
 
     return(ret);
 }
 
+char *json_string(const char *string) {
+    const char *c;
+    char *ret;
+    int len = 3;
+    int i = 0;
+
+    for ( c = string; *c != '\0'; c++ ) {
+        if ( *c == '"' || *c == '\\' ) {
+            len += 2;
+        } else if ( (unsigned char) *c < 0x20 ) {
+            len += 6;
+        } else {
+            len++;
+        }
+    }
+
+    ret = (char *) arena_alloc(len);
+    ret[i++] = '"';
+    for ( c = string; *c != '\0'; c++ ) {
+        if ( *c == '"' || *c == '\\' ) {
+            ret[i++] = '\\';
+            ret[i++] = *c;
+        } else if ( (unsigned char) *c < 0x20 ) {
+            snprintf(&ret[i], 7, "\\u%04x", *c); // Flawfinder: ignore
+            i += 6;
+        } else {
+            ret[i++] = *c;
+        }
+    }
+    ret[i++] = '"';
+    ret[i] = '\0';
+
+    return(ret);
+}
+
 void chomp(char *str) {
     int len = strlength(str, 4096);
     if ( str[len - 1] == ' ') {
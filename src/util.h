@@ -22,9 +22,14 @@
 #include <unistd.h>
 
 int intlen(int input);
+// The results of int2str(), joinpath(), strjoin() and json_string() live
+// in the arena (arena.h): never free() them, and xstrdup() any that must
+// outlive an arena_restore()
 char *int2str(int num);
 char *joinpath(char * path1, char * path2);
 char *strjoin(char *str1, char *str2);
+// Returns string quoted and escaped as a JSON string
+char *json_string(const char *string);
 void chomp(char *str);
 int strlength(char *string, int max_len);
 //char *random_string(int length);
@@ -0,0 +1,178 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * This software is licensed under a customized 3-clause BSD license.  Please
+ * consult LICENSE file distributed with the sources of this project regarding
+ * your rights to use or distribute this software.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+*/
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "daemon_socket.h"
+#include "zygote.h"
+#include "container_actions.h"
+#include "util.h"
+#include "message.h"
+
+
+/*
+ * A zygote is a long running process started by the namespace daemon
+ * (`start --zygote <command>`) that has already paid for its own expensive
+ * initialisation, and forks a copy of itself for every `exec` request the
+ * daemon receives.  The daemon only hands the request over; the forking is
+ * done by the application, since only it can reuse its warmed state.
+ *
+ * The command is started with $SINGULARITY_ZYGOTE_FD set to one end of a
+ * SOCK_SEQPACKET socket pair.  Each request is one packet holding the NUL
+ * terminated cwd, umask (octal), argument count (decimal), arguments and
+ * environment, carrying stdin, stdout, stderr and a report socket as
+ * SCM_RIGHTS descriptors.  For each packet the zygote forks twice, so the
+ * request process is adopted by the daemon; that process writes its pid
+ * in decimal to the report socket, closes it and runs the request.  The
+ * daemon then passes exit status and signals on as for any other request.
+ */
+
+#define ZYGOTE_FDS 4
+
+
+pid_t zygote_start(char *command, int *zygote_fd) {
+    char *argv[5];
+    char fdstr[16]; // Flawfinder: ignore (bounded by snprintf)
+    int sv[2];
+    pid_t pid;
+
+    message(DEBUG, "Called zygote_start(%s)\n", command);
+
+    if ( socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0 ) {
+        message(ERROR, "Could not create zygote socket: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    if ( ( pid = fork() ) == 0 ) {
+        // The zygote keeps its end across exec
+        close(sv[0]);
+        if ( fcntl(sv[1], F_SETFD, 0) < 0 ) {
+            message(ERROR, "Could not pass zygote socket: %s\n", strerror(errno));
+            ABORT(255);
+        }
+        snprintf(fdstr, sizeof(fdstr), "%d", sv[1]); // Flawfinder: ignore
+        setenv("SINGULARITY_ZYGOTE_FD", fdstr, 1);
+
+        argv[0] = xstrdup("Singularity");
+        argv[1] = xstrdup("/bin/sh");
+        argv[2] = xstrdup("-c");
+        argv[3] = command;
+        argv[4] = NULL;
+        container_exec(4, argv);
+        ABORT(255);
+    }
+    close(sv[1]);
+    if ( pid < 0 ) {
+        message(ERROR, "Could not fork zygote: %s\n", strerror(errno));
+        close(sv[0]);
+        return(-1);
+    }
+
+    *zygote_fd = sv[0];
+    message(DEBUG, "Return zygote_start() = %d\n", pid);
+    return(pid);
+}
+
+
+// Hand a request to the zygote, returning the socket its pid arrives on
+int zygote_send(int zygote_fd, struct daemon_request *request) {
+    struct msghdr msghdr;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * ZYGOTE_FDS)];
+        struct cmsghdr align;
+    } control;
+    int fds[ZYGOTE_FDS];
+    int report[2];
+    char *buf;
+    size_t len = 0;
+    size_t size = 64;
+    int i;
+
+    // cwd, umask and argc, then the arguments without our argv[0], then
+    // the environment
+    for ( i = 1; i < request->argc; i++ ) {
+        size += strlen(request->argv[i]) + 1; // Flawfinder: ignore (NUL terminated by daemon_socket_recv)
+    }
+    for ( i = 0; request->envp[i] != NULL; i++ ) {
+        size += strlen(request->envp[i]) + 1; // Flawfinder: ignore
+    }
+    size += strlen(request->cwd) + 1; // Flawfinder: ignore
+    buf = (char *) xmalloc(size);
+
+    len += snprintf(&buf[len], size - len, "%s", request->cwd) + 1; // Flawfinder: ignore
+    len += snprintf(&buf[len], size - len, "%o", request->umask) + 1; // Flawfinder: ignore
+    len += snprintf(&buf[len], size - len, "%d", request->argc - 1) + 1; // Flawfinder: ignore
+    for ( i = 1; i < request->argc; i++ ) {
+        len += snprintf(&buf[len], size - len, "%s", request->argv[i]) + 1; // Flawfinder: ignore
+    }
+    for ( i = 0; request->envp[i] != NULL; i++ ) {
+        len += snprintf(&buf[len], size - len, "%s", request->envp[i]) + 1; // Flawfinder: ignore
+    }
+
+    if ( socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, report) < 0 ) {
+        message(WARNING, "Could not create zygote report socket: %s\n", strerror(errno));
+        free(buf);
+        return(-1);
+    }
+    fds[0] = request->fds[0];
+    fds[1] = request->fds[1];
+    fds[2] = request->fds[2];
+    fds[3] = report[1];
+
+    memset(&msghdr, 0, sizeof(msghdr));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msghdr.msg_iov = &iov;
+    msghdr.msg_iovlen = 1;
+    msghdr.msg_control = control.buf;
+    msghdr.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msghdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds)); // Flawfinder: ignore (fixed size)
+
+    // Never block on a zygote that has stopped reading its requests; the
+    // client then falls back to an ordinary launch
+    if ( sendmsg(zygote_fd, &msghdr, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ) {
+        message(VERBOSE, "Could not pass request to zygote: %s\n", strerror(errno));
+        close(report[0]);
+        close(report[1]);
+        free(buf);
+        return(-1);
+    }
+
+    close(report[1]);
+    free(buf);
+    return(report[0]);
+}
@@ -1,7 +1,7 @@
 #!/bin/bash
 
 
-ALL_COMMANDS="exec run shell start stop bootstrap copy create expand export import mount"
+ALL_COMMANDS="exec run shell start stop checkpoint restore bootstrap copy create expand export import mount"
 
 if [ ! -f "autogen.sh" ]; then
     /bin/echo "ERROR: Run this from the singularity source root"
@@ -102,6 +102,104 @@ stest 1 singularity exec "$CONTAINER" blahh
 stest 0 sh -c "echo hi | singularity exec $CONTAINER grep hi"
 stest 1 sh -c "echo bye | singularity exec $CONTAINER grep hi"
 
+/bin/echo
+/bin/echo "Running container task tests..."
+
+stest 0 sh -c "printf 'true\n/bin/true\n\n# comment\n' | singularity exec --tasks - '$CONTAINER'"
+stest 1 sh -c "printf 'true\nfalse\n' | singularity exec --tasks - '$CONTAINER'"
+stest 1 singularity exec --tasks tasks.missing "$CONTAINER"
+stest 0 sh -c "printf 'echo one\necho two >&2\n' > tasks.txt"
+stest 0 mkdir tasks.out
+stest 0 singularity exec --tasks tasks.txt --jobs 2 --output tasks.out "$CONTAINER"
+stest 0 grep -q one tasks.out/task.1.out
+stest 0 grep -q two tasks.out/task.2.err
+stest 0 grep -q '"task":2,' tasks.out/tasks.json
+stest 0 sh -c "echo 'test \"\$SINGULARITY_TASK_ID\" = 1' | singularity exec -t - -j 1 '$CONTAINER'"
+stest 1 singularity exec --tasks tasks.txt --output tasks.missing "$CONTAINER"
+# An interrupted task farm passes the signal on to its running tasks,
+# starts no more, and still reports each one
+stest 0 sh -c "printf 'sleep 60\nsleep 60\ntouch tasks.late\n' > tasks.slow"
+stest 0 mkdir tasks.int
+stest 1 sh -c "singularity exec --tasks tasks.slow --jobs 2 --output tasks.int '$CONTAINER' & sleep 3; kill -TERM \$!; wait \$!"
+stest 0 test `grep -c '"exit":143' tasks.int/tasks.json` -eq 2
+stest 1 test -f tasks.late
+
+/bin/echo
+/bin/echo "Running container pool tests..."
+
+stest 0 singularity start --pool 2 "$CONTAINER"
+stest 1 singularity start --pool 2 "$CONTAINER"
+stest 0 sh -c "singularity -d exec '$CONTAINER' true 2>&1 | grep -q 'Return daemon_socket_exec(.*/pool.sock) = 0'"
+stest 1 singularity exec "$CONTAINER" false
+stest 0 sh -c "echo hi | singularity exec '$CONTAINER' grep hi"
+stest 0 singularity shell "$CONTAINER" -c true
+stest 0 singularity exec "$CONTAINER" test -d "$TEMPDIR"
+# Launches with other options than the pool's set up their own container
+stest 1 sh -c "singularity -d exec -C '$CONTAINER' true 2>&1 | grep -q 'Return daemon_socket_exec(.*/pool'"
+stest 1 singularity exec -C "$CONTAINER" test -d "$TEMPDIR"
+stest 0 singularity stop "$CONTAINER"
+stest 1 sh -c "singularity -d exec '$CONTAINER' true 2>&1 | grep -q 'Return daemon_socket_exec(.*/pool.sock) = 0'"
+stest 1 singularity start --pool 0 "$CONTAINER"
+stest 0 singularity start --pool 1 --idle-timeout 2 "$CONTAINER"
+stest 0 sleep 4
+stest 0 singularity start -C --pool 1 "$CONTAINER"
+stest 0 sh -c "singularity -d exec -C '$CONTAINER' true 2>&1 | grep -q 'Return daemon_socket_exec(.*/pool-c.sock) = 0'"
+stest 0 singularity stop "$CONTAINER"
+
+/bin/echo
+/bin/echo "Running checkpoint/restore tests..."
+
+stest 1 singularity checkpoint --bogus "$CONTAINER"
+stest 1 singularity restore --bogus "$CONTAINER"
+stest 1 singularity checkpoint "$CONTAINER"
+stest 1 singularity restore "$CONTAINER"
+if [ -x /usr/sbin/criu ]; then
+    stest 0 singularity start "$CONTAINER"
+    stest 1 singularity restore "$CONTAINER"
+    stest 0 singularity checkpoint --leave-running "$CONTAINER"
+    stest 0 singularity exec "$CONTAINER" true
+    stest 0 singularity checkpoint "$CONTAINER"
+    stest 1 singularity checkpoint "$CONTAINER"
+    stest 0 singularity restore "$CONTAINER"
+    stest 1 singularity restore "$CONTAINER"
+    stest 0 singularity exec "$CONTAINER" true
+    stest 0 singularity stop "$CONTAINER"
+else
+    /bin/echo "WARNING: criu is not found, checkpoint/restore tests skipped"
+fi
+
+/bin/echo
+/bin/echo "Running command line front-end tests..."
+
+# exec, run, shell, start and stop are handled without the shell scripts
+stest 1 sh -c "singularity -d exec '$CONTAINER' true 2>&1 | grep -q 'cli/exec.exec'"
+stest 0 sh -c "singularity -d copy 2>&1 | grep -q 'cli/copy.exec'"
+stest 0 singularity -q exec "$CONTAINER" true
+stest 0 singularity --quiet exec "$CONTAINER" true
+stest 0 singularity -v -v exec "$CONTAINER" true
+stest 0 singularity --verbose exec "$CONTAINER" true
+stest 0 singularity --debug exec "$CONTAINER" true
+stest 1 singularity --bogus exec "$CONTAINER" true
+stest 1 singularity exec --bogus "$CONTAINER" true
+stest 1 singularity run --tasks tasks.txt "$CONTAINER"
+stest 0 sh -c "singularity exec | grep -q USAGE"
+stest 0 sh -c "singularity shell help | grep -q USAGE"
+stest 0 singularity exec "$CONTAINER" test -d "$TEMPDIR"
+stest 1 singularity exec -C "$CONTAINER" test -d "$TEMPDIR"
+stest 0 singularity run "$CONTAINER" -c "test -d '$TEMPDIR'"
+stest 1 singularity run --contain "$CONTAINER" -c "test -d '$TEMPDIR'"
+stest 1 singularity shell -C "$CONTAINER" -c "test -d '$TEMPDIR'"
+stest 0 singularity shell -s /bin/sh "$CONTAINER" -c true
+stest 1 singularity shell --shell /bin/false "$CONTAINER" -c true
+stest 0 env -u HOME -u USER "$TEMPDIR/bin/singularity" exec "$CONTAINER" true
+# As etc/singularity/init would: no PID namespace under a resource manager
+stest 1 singularity exec "$CONTAINER" sh -c 'test $$ -ne 1'
+stest 0 env SLURM_JOB_ID=1 "$TEMPDIR/bin/singularity" exec "$CONTAINER" sh -c 'test $$ -ne 1'
+stest 0 sh -c "test -z \"\`singularity -q start '$CONTAINER'\`\""
+stest 0 sh -c "singularity stop '$CONTAINER' | grep -q 'has been stopped'"
+stest 0 sh -c "singularity start -C --pool 1 '$CONTAINER' | grep -q 'container pool has started'"
+stest 0 singularity stop "$CONTAINER"
+
 /bin/echo
 /bin/echo "Running container run tests..."
 